@@ -31,9 +31,10 @@ int    DO_STAGE;   //  Which step to perform
 
 #endif
 
-static char *Usage[] = { "[-k<int(40)>] -t[<int(4)>]] [-p[:<table>[.ktab]]] [-c] [-bc<int(0)>]",
+static char *Usage[] = { "[-k<int(40)>] -t[<int(4)>]] [-i] [-p[:<table>[.ktab]|=<real>|=<file>]]",
+                         "  [-s[<int(4)>]] [-c] [-bc<int(0)>] [-q<int>] [-S<file> [-B<int>-<int>]]",
                          "  [-v] [-N<path_name>] [-P<dir(/tmp)>] [-M<int(12)>] [-T<int(4)>]",
-                         "    <source>[.cram|.[bs]am|.db|.dam|.f[ast][aq][.gz] ..."
+                         "  [-G<int>] <source>[.cram|.[bs]am|.db|.dam|.f[ast][aq][.gz] ... | -"
                        };
 
   //  Option Settings
@@ -46,12 +47,23 @@ char  *SORT_PATH;    //  where to put external files
 
 int    KMER;         //  desired K-mer length
 int    DO_TABLE;     // Zero or table cutoff
+int    DO_INDEX;     // Also write a .kidx search index for the table
 int    DO_PROFILE;   // Do or not
 int      PRO_THREADS;  //  If > 0, # of threads in .ktab for profile
 char    *PRO_HIDDEN;   //  Root of .ktab hidden files for profile
+int      PRO_SELECT;   //  Profile only a selection of the reads
+double   PRO_FRACT;    //    a random fraction of them if PRO_LIST is NULL, or
+int64   *PRO_LIST;     //    the sorted, disjoint (0-based) read id ranges [beg,end)
+int64    PRO_LLEN;     //    PRO_LIST[2i,2i+1] for i in [0,PRO_LLEN)
+int      PRO_SOLID;    //  If > 0, also output read summaries w.r.t. this solid count
 int    BC_PREFIX;    // Ignore prefix of each sequence of this length
 char  *OUT_NAME;     // Prefix root for all output file names
 int    COMPRESS;     // Homopoloymer compress input
+int    QUAL_MIN;     // Mask bases with quality below this (0 = no masking)
+int64  STREAM_SIZE;  // Estimated # of bases in a streamed input (0 if not given)
+char  *SCHEME_NAME;  // File to save the bucket scheme to, or with -B to load it from
+int    SHARD_BEG;    // Count only buckets [SHARD_BEG,SHARD_END) of the scheme (-B) if
+int    SHARD_END;    //   SHARD_END > 0
 
   //  Major parameters, sizes of things
 
@@ -151,6 +163,84 @@ void timeTo(FILE *f)
 }
 
 
+  //  Set the read selection for -p=<arg>: a real in (0,1] selects that fraction of the reads
+  //    at random, otherwise <arg> is a file of 1-based read ids and ranges thereof (x-y)
+
+static int SORT_ID(const void *l, const void *r)
+{ int64 x = *((int64 *) l);
+  int64 y = *((int64 *) r);
+
+  return ((x > y) - (x < y));
+}
+
+static void Read_Selection(char *arg)
+{ char  *eptr;
+  FILE  *f;
+  int64  beg, end, max, n, i;
+  int    c;
+
+  PRO_SELECT = 1;
+  PRO_LIST   = NULL;
+  PRO_LLEN   = 0;
+
+  PRO_FRACT = strtod(arg,&eptr);
+  if (*eptr == '\0' && eptr != arg)
+    { if (PRO_FRACT <= 0. || PRO_FRACT > 1.)
+        { fprintf(stderr,"%s: -p fraction %s not in (0,1]\n",Prog_Name,arg);
+          exit (1);
+        }
+      return;
+    }
+
+  f = fopen(arg,"r");
+  if (f == NULL)
+    { fprintf(stderr,"%s: Cannot open read id file %s\n",Prog_Name,arg);
+      exit (1);
+    }
+  max = 0;
+  while ((c = fscanf(f," %lld",&beg)) == 1)
+    { end = beg;
+      if (fscanf(f," - %lld",&end) != 1)
+        end = beg;
+      if (beg <= 0 || end < beg)
+        { fprintf(stderr,"%s: Read id %lld-%lld in %s is not a valid range\n",
+                         Prog_Name,beg,end,arg);
+          exit (1);
+        }
+      if (PRO_LLEN >= max)
+        { max = 1.2*PRO_LLEN + 10000;
+          PRO_LIST = Realloc(PRO_LIST,2*sizeof(int64)*max,"Allocating read id list");
+          if (PRO_LIST == NULL)
+            exit (1);
+        }
+      PRO_LIST[2*PRO_LLEN]   = beg-1;
+      PRO_LIST[2*PRO_LLEN+1] = end;
+      PRO_LLEN += 1;
+    }
+  if (c != EOF)
+    { fprintf(stderr,"%s: Read id file %s contains a non-integer\n",Prog_Name,arg);
+      exit (1);
+    }
+  fclose(f);
+
+  //  Sort the ranges on their start and merge those that overlap or abut
+
+  qsort(PRO_LIST,PRO_LLEN,2*sizeof(int64),SORT_ID);
+
+  n = 0;
+  for (i = 0; i < PRO_LLEN; i++)
+    if (n > 0 && PRO_LIST[2*i] <= PRO_LIST[2*n-1])
+      { if (PRO_LIST[2*i+1] > PRO_LIST[2*n-1])
+          PRO_LIST[2*n-1] = PRO_LIST[2*i+1];
+      }
+    else
+      { PRO_LIST[2*n]   = PRO_LIST[2*i];
+        PRO_LIST[2*n+1] = PRO_LIST[2*i+1];
+        n += 1;
+      }
+  PRO_LLEN = n;
+}
+
 int main(int argc, char *argv[])
 { char  *root;
   char  *pwd;
@@ -159,7 +249,7 @@ int main(int argc, char *argv[])
 
   { int    i, j, k;
     int    flags[128];
-    int    memory, promer; 
+    int    memory, promer, gbps; 
     char  *eptr;
 
     ARG_INIT("FastK")
@@ -171,18 +261,25 @@ int main(int argc, char *argv[])
     DO_TABLE    = 0;
     DO_PROFILE  = 0;
     PRO_THREADS = 0;
+    PRO_SELECT  = 0;
+    PRO_SOLID   = 0;
     BC_PREFIX   = 0;
+    QUAL_MIN    = 0;
     OUT_NAME    = NULL;
+    STREAM_SIZE = 0;
+    SCHEME_NAME = NULL;
+    SHARD_BEG   = 0;
+    SHARD_END   = 0;
 #ifdef DEVELOPER
     DO_STAGE    = 0;
 #endif
 
     j = 1;
     for (i = 1; i < argc; i++)
-      if (argv[i][0] == '-')
+      if (argv[i][0] == '-' && argv[i][1] != '\0')
         switch (argv[i][1])
         { default:
-            ARG_FLAGS("vcpt")
+            ARG_FLAGS("vcptis")
             break;
           case 'b':
             if (argv[i][2] != 'c')
@@ -193,12 +290,33 @@ int main(int argc, char *argv[])
             ARG_NON_NEGATIVE(BC_PREFIX,"Bar code prefiex")
             argv[i] -= 1;
             break;
+          case 'B':
+            SHARD_BEG = strtol(argv[i]+2,&eptr,10);
+            if (eptr > argv[i]+2 && *eptr == '-')
+              { char *fptr = eptr+1;
+
+                SHARD_END = strtol(fptr,&eptr,10);
+                if (eptr > fptr && *eptr == '\0' && SHARD_BEG >= 0 && SHARD_BEG < SHARD_END)
+                  break;
+              }
+            fprintf(stderr,"%s: -B argument '%s' is not a bucket range <a>-<b> with a < b\n",
+                           Prog_Name,argv[i]+2);
+            exit (1);
+          case 'G':
+            ARG_POSITIVE(gbps,"Gbp in streamed input")
+            STREAM_SIZE = gbps * 1000000000ll;
+            break;
           case 'k':
             ARG_POSITIVE(KMER,"K-mer length")
             break;
           case 'p':
+            if (argv[i][2] == '=')
+              { Read_Selection(argv[i]+3);
+                DO_PROFILE = 1;
+                break;
+              }
             if (argv[i][2] != ':')
-              { ARG_FLAGS("vcpt");
+              { ARG_FLAGS("vcptis");
                 break;
               }
             { char *d, *r;
@@ -224,9 +342,16 @@ int main(int argc, char *argv[])
               DO_PROFILE = 1;
             }
             break;
+          case 's':
+            if (argv[i][2] == '\0' || isalpha(argv[i][2]))
+              { ARG_FLAGS("vcptis");
+                break;
+              }
+            ARG_POSITIVE(PRO_SOLID,"Solid count for read summaries")
+            break;
           case 't':
             if (argv[i][2] == '\0' || isalpha(argv[i][2]))
-              { ARG_FLAGS("vcpt");
+              { ARG_FLAGS("vcptis");
                 break;
               }
             ARG_POSITIVE(DO_TABLE,"Cutoff for k-mer table")
@@ -241,6 +366,12 @@ int main(int argc, char *argv[])
           case 'P':
             SORT_PATH = argv[i]+2;
             break;
+          case 'S':
+            SCHEME_NAME = argv[i]+2;
+            break;
+          case 'q':
+            ARG_NON_NEGATIVE(QUAL_MIN,"Minimum base quality")
+            break;
           case 'T':
             ARG_POSITIVE(NTHREADS,"Number of threads")
             break;
@@ -267,8 +398,19 @@ int main(int argc, char *argv[])
     COMPRESS   = flags['c'];
     if (flags['t'])
       DO_TABLE = 4;
+    DO_INDEX = flags['i'];
+    if (DO_INDEX && DO_TABLE == 0)
+      { fprintf(stderr,"%s: -i requires that a table be produced (-t)\n",Prog_Name);
+        exit (1);
+      }
     if (flags['p'])
       DO_PROFILE = 1;
+    if (flags['s'])
+      PRO_SOLID = 4;
+    if (PRO_SOLID > 0 && DO_PROFILE == 0)
+      { fprintf(stderr,"%s: -s requires that profiles be produced (-p)\n",Prog_Name);
+        exit (1);
+      }
 
     if (PRO_THREADS > 0)
       { if (promer != KMER)
@@ -280,22 +422,44 @@ int main(int argc, char *argv[])
         exit (1);
       }
 
+    if (SHARD_END > 0 && SCHEME_NAME == NULL)
+      { fprintf(stderr,"%s: -B requires a scheme saved with -S\n",Prog_Name);
+        exit (1);
+      }
+    if (SHARD_END > 0 && DO_PROFILE)
+      { fprintf(stderr,"%s: -B cannot be used with -p as profiles need every bucket\n",Prog_Name);
+        exit (1);
+      }
+
+    if (QUAL_MIN > 0 && (DO_PROFILE || BC_PREFIX > 0))
+      { fprintf(stderr,"%s: -q cannot be used with -p or -bc as it splits reads\n",Prog_Name);
+        exit (1);
+      }
+
     if (argc < 2)
       { fprintf(stderr,"\nUsage: %s %s\n",Prog_Name,Usage[0]);
         fprintf(stderr,"       %*s %s\n",(int) strlen(Prog_Name),"",Usage[1]);
         fprintf(stderr,"       %*s %s\n",(int) strlen(Prog_Name),"",Usage[2]);
+        fprintf(stderr,"       %*s %s\n",(int) strlen(Prog_Name),"",Usage[3]);
         fprintf(stderr,"\n");
         fprintf(stderr,"      -v: Verbose mode, output statistics as proceed.\n");
         fprintf(stderr,"      -T: Use -T threads.\n");
         fprintf(stderr,"      -N: Use given path for output directory and root name prefix.\n");
         fprintf(stderr,"      -P: Place block level sorts in directory -P.\n");
         fprintf(stderr,"      -M: Use -M GB of memory in downstream sorting steps of KMcount.\n");
+        fprintf(stderr,"      -G: Estimated Gbp of a source streamed from stdin (-) or a pipe.\n");
         fprintf(stderr,"\n");
         fprintf(stderr,"      -k: k-mer size.\n");
         fprintf(stderr,"      -t: Produce table of sorted k-mer & counts >= level specified\n");
+        fprintf(stderr,"      -i: Also produce a search index for the table\n");
         fprintf(stderr,"      -p: Produce sequence count profiles (w.r.t. table if given)\n");
+        fprintf(stderr,"          =: only for the given fraction of reads or those listed in file\n");
+        fprintf(stderr,"      -s: Also summarize each profile w.r.t. k-mers with count >= level\n");
         fprintf(stderr,"     -bc: Ignore prefix of each read of given length (e.g. bar code)\n");
         fprintf(stderr,"      -c: Homopolymer compress every sequence\n");
+        fprintf(stderr,"      -q: Mask bases with quality below given level (fastq, sam, bam, cram)\n");
+        fprintf(stderr,"      -S: Save the bucket scheme to file and stop, or with -B load it\n");
+        fprintf(stderr,"      -B: Count only the buckets in range [a,b) of the scheme\n");
         exit (1);
       }
   }
@@ -376,9 +540,9 @@ int main(int argc, char *argv[])
         else
           fprintf(stderr,"  Estimate %.3fK",est/1.e3);
         fprintf(stderr," %d-%smers\n",KMER,COMPRESS?"hoco-":"");
-        if (NPARTS > 1)
+        if (NPARTS > 1 && SHARD_END == 0)
           fprintf(stderr,"  Dividing data into %d buckets\n",NPARTS);
-        else
+        else if (SHARD_END == 0)
           fprintf(stderr,"  Handling data in a single bucket\n");
       }
 
@@ -388,7 +552,29 @@ int main(int argc, char *argv[])
     MOD_LEN <<= 1;
     MOD_MSK = MOD_LEN-1;
 
-    MAX_SUPER = Determine_Scheme(block);
+    //  With -B use the saved scheme and keep only the buckets in range, otherwise
+    //    determine the scheme, and if -S is given, save it and stop
+
+    if (SHARD_END > 0)
+      { MAX_SUPER = Load_Scheme(SCHEME_NAME);
+        if (SHARD_END > NPARTS)
+          { fprintf(stderr,"%s: -B range %d-%d exceeds the %d buckets of scheme %s\n",
+                           Prog_Name,SHARD_BEG,SHARD_END,NPARTS,SCHEME_NAME);
+            exit (1);
+          }
+        if (VERBOSE)
+          fprintf(stderr,"  Counting buckets [%d,%d) of %d\n",SHARD_BEG,SHARD_END,NPARTS);
+        Restrict_Scheme(SHARD_BEG,SHARD_END);
+      }
+    else
+      { MAX_SUPER = Determine_Scheme(block);
+        if (SCHEME_NAME != NULL)
+          { Save_Scheme(SCHEME_NAME);
+            if (VERBOSE)
+              fprintf(stderr,"  Saved scheme with %d buckets to %s\n",NPARTS,SCHEME_NAME);
+            exit (0);
+          }
+      }
 
     Free_First_Block(block);
 
@@ -408,6 +594,7 @@ int main(int argc, char *argv[])
 
     //  Make sure you can open (NPARTS + 2) * NTHREADS + tid files and then set up data structures
     //    for each such file.  tid is typically 3 unless using valgrind or other instrumentation.
+    //    Read summaries (-s) need one more file per thread.
 
     { struct rlimit rlp;
       int           tid;
@@ -418,6 +605,8 @@ int main(int argc, char *argv[])
       unlink(".xxx");
 
       nfiles = (NPARTS+2)*NTHREADS + tid;
+      if (PRO_SOLID > 0)
+        nfiles += NTHREADS;
       getrlimit(RLIMIT_NOFILE,&rlp);
       if (nfiles > rlp.rlim_max)
         { fprintf(stderr,"\n%s: Cannot open %lld files simultaneously\n",Prog_Name,nfiles);
@@ -39,10 +39,18 @@ extern int      ITHREADS;    //  # of threads possible for input
 extern char  *SORT_PATH;   //  where to put external files
 
 extern int    DO_TABLE;    // Zero or table cutoff
+extern int    DO_INDEX;    // Also write a .kidx search index for the table
 extern int    DO_PROFILE;  // Do or not
 extern int      PRO_THREADS;  //  If > 0, # of threads in .ktab for profile  
+extern int      PRO_SELECT;   //  Profile only a selection of the reads
+extern double   PRO_FRACT;    //    a random fraction of them if PRO_LIST is NULL, or
+extern int64   *PRO_LIST;     //    the sorted, disjoint (0-based) read id ranges [beg,end)
+extern int64    PRO_LLEN;     //    PRO_LIST[2i,2i+1] for i in [0,PRO_LLEN)
+extern int      PRO_SOLID;    //  If > 0, also output read summaries w.r.t. this solid count
 extern int    BC_PREFIX;   // Ignore prefix of each read of this length
 extern int    COMPRESS;    // Homopolymer compress the input
+extern int    QUAL_MIN;    // Mask bases with quality below this (0 = no masking)
+extern int64  STREAM_SIZE; // Estimated # of bases in a streamed input (0 if not given)
 
 
   //  Sizes and numbers of items (k-mers, super-mers, reads, positions)
@@ -78,6 +86,10 @@ extern int CMER_WORD;    //  bytes to hold a count/position entry
 
 extern int64 *NUM_RID;   //  [i] for i in [0,ITHREADS) = # of super-mers per vertical stripe
 
+extern int64 *NUM_READS; //  [i] for i in [0,ITHREADS) = # of reads per vertical stripe (-p=)
+extern int64  SEL_NUM;   //  # of ranges of super-mer ids of the selected reads (-p=)
+extern int64 *SEL_RANGE; //  [3i,3i+1] = ids [beg,end) of range i, [3i+2] = id of its 1st read
+
 extern uint8 Comp[256];  //  complement of 4bp byte code
 
   //  IO Module Interface
@@ -108,12 +120,20 @@ typedef void *Input_Partition;
 
   void Scan_All_Input(Input_Partition *part);
 
+  int64 Masked_Bases(Input_Partition *part, int64 *dropped);
+
   void Free_Input_Partition(Input_Partition *part);
 
   //  Stages
 
 int Determine_Scheme(DATA_BLOCK *block);
 
+void Save_Scheme(char *name);
+
+int Load_Scheme(char *name);
+
+void Restrict_Scheme(int beg, int end);
+
 void Split_Kmers(Input_Partition *io, char *root);
 
   void Distribute_Block(DATA_BLOCK *block, int tid);
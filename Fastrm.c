@@ -65,7 +65,7 @@ int main(int argc, char **argv)
       if ((int) strlen(argv[c]) > len)
         len = strlen(argv[c]);
 
-    command = Malloc(3*len+50,"Allocating command buffer");
+    command = Malloc(5*len+100,"Allocating command buffer");
 
     for (c = 1; c < argc; c++)
       { dir  = PathTo(argv[c]);
@@ -115,7 +115,8 @@ int main(int argc, char **argv)
                     yes = 0;
               }
             if (yes)
-              { sprintf(command,"rm -f %s/%s.ktab %s/.%s.ktab.*",dir,root,dir,root);
+              { sprintf(command,"rm -f %s/%s.ktab %s/.%s.ktab.* %s/.%s.kidx %s/.%s.khsh",
+                                dir,root,dir,root,dir,root,dir,root);
                 system(command);
               }
           }
@@ -133,8 +134,8 @@ int main(int argc, char **argv)
                     yes = 0;
               }
             if (yes)
-              { sprintf(command,"rm -f %s/%s.prof %s/.%s.pidx.* %s/.%s.prof.*",
-                                dir,root,dir,root,dir,root);
+              { sprintf(command,"rm -f %s/%s.prof %s/.%s.pidx.* %s/.%s.prof.* %s/%s.psum",
+                                dir,root,dir,root,dir,root,dir,root);
                 system(command);
               }
           }
@@ -26,6 +26,8 @@
 
 static char *Usage = "[-in] <source> <dest>";
 
+static char *Index_Suffix[2] = { ".kidx", ".khsh" };
+
 int main(int argc, char **argv)
 { int   QUERY;
   int   NO_OVERWRITE;
@@ -163,6 +165,14 @@ int main(int argc, char **argv)
               { sprintf(command,"%s -f %s/.%s.ktab.%d %s/.%s.ktab.%d",op,dir,root,p,DIR,ROOT,p);
                 system(command);
               }
+            for (p = 0; p < 2; p++)          //  Search index (.kidx) and hash (.khsh)
+              { if (stat(Catenate(dir,"/.",root,Index_Suffix[p]),&B) == 0)
+                  sprintf(command,"%s -f %s/.%s%s %s/.%s%s",
+                                  op,dir,root,Index_Suffix[p],DIR,ROOT,Index_Suffix[p]);
+                else
+                  sprintf(command,"rm -f %s/.%s%s",DIR,ROOT,Index_Suffix[p]);
+                system(command);
+              }
             sprintf(command,"%s -f %s/%s.ktab %s/%s.ktab",op,dir,root,DIR,ROOT);
             system(command);
           }
@@ -194,6 +204,11 @@ int main(int argc, char **argv)
                 sprintf(command,"%s -f %s/.%s.prof.%d %s/.%s.prof.%d",op,dir,root,p,DIR,ROOT,p);
                 system(command);
               }
+            if (stat(Catenate(dir,"/",root,".psum"),&B) == 0)     //  Summaries (.psum) of -s
+              sprintf(command,"%s -f %s/%s.psum %s/%s.psum",op,dir,root,DIR,ROOT);
+            else
+              sprintf(command,"rm -f %s/%s.psum",DIR,ROOT);
+            system(command);
             sprintf(command,"%s -f %s/%s.prof %s/%s.prof",op,dir,root,DIR,ROOT);
             system(command);
           }
@@ -14,12 +14,14 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <math.h>
+#include <pthread.h>
 
 #undef DEBUG_PARTITION
+#undef DEBUG_THREADS
 
 #include "libfastk.h"
 
-static char *Usage = "[-g<int>:<int>] <source>[.ktab]";
+static char *Usage = "[-T<int(4)>] [-P<dir(/tmp)>] [-g<int>:<int>] <source>[.ktab]";
 
 /****************************************************************************************
  *
@@ -53,15 +55,15 @@ static void setup_fmer_table()
        }
 }
 
-static void print_seq(uint8 *seq, int len)
+static void print_seq(FILE *out, uint8 *seq, int len)
 { int i, b, k;
 
   b = len >> 2;
   for (i = 0; i < b; i++)
-    printf("%s",fmer[seq[i]]);
+    fprintf(out,"%s",fmer[seq[i]]);
   k = 6;
   for (i = b << 2; i < len; i++)
-    { printf("%c",dna[seq[b] >> k]);
+    { fprintf(out,"%c",dna[(seq[b] >> k) & 0x3]);
       k -= 2;
     }
 }
@@ -82,11 +84,23 @@ static inline void mycpy(uint8 *a, uint8 *b, int n)
 
 /****************************************************************************************
  *
- *  Find Haplotype Pairs
+ *  Find Haplotype Pairs.  Each thread scans the entries [beg,end) of the table, where the
+ *    boundaries of the ranges are aligned to the start of a group of k-mers that share
+ *    their first khalf bases, and prints the pairs it finds to its own output file.
  *
  *****************************************************************************************/
 
-static int HAPLO_LOW, HAPLO_HGH;
+static int   HAPLO_LOW, HAPLO_HGH;
+static int   NTHREADS;
+static char *SORT_PATH;
+
+typedef struct
+  { int          tid;
+    Kmer_Stream *T;      //  The table (threads other than 0 open their own copy)
+    int64        beg;
+    int64        end;
+    FILE        *out;
+  } TP;
 
 static inline int mypref(uint8 *a, uint8 *b, int n)
 { int   i;
@@ -113,7 +127,14 @@ static inline int mypref(uint8 *a, uint8 *b, int n)
   return (n+1);
 }
 
-void Find_Haplo_Pairs(Kmer_Stream *T)
+static inline uint8 *next_entry(Kmer_Stream *T, int64 end)
+{ uint8 *iptr = Next_Kmer_Entry(T);
+  if (T->cidx >= end)
+    return (NULL);
+  return (iptr);
+}
+
+static void Find_Haplo_Pairs(Kmer_Stream *T, int64 beg, int64 end, FILE *out)
 { int    kmer  = T->kmer;
   int    tbyte = T->tbyte;
   int    kbyte = T->kbyte;
@@ -135,8 +156,6 @@ void Find_Haplo_Pairs(Kmer_Stream *T)
   int    mc, hc;
   uint8 *mr, *hr;
 
-  setup_fmer_table();
-
   khalf = kmer/2;
   mask  = prefs[khalf&0x3]; 
   offs  = (khalf >> 2) + 1;
@@ -150,13 +169,15 @@ void Find_Haplo_Pairs(Kmer_Stream *T)
   cptr  = cache;
   ctop  = cache + 4096*tbyte;
 
-  iptr = First_Kmer_Entry(T);
+  iptr = GoTo_Kmer_Index(T,beg);
+  if (T->cidx >= end)
+    iptr = NULL;
   while (iptr != NULL)
     { f = 0;
       cptr = cache;
       index[f++] = 0;
       mycpy(cptr,iptr,tbyte);
-      for (iptr = Next_Kmer_Entry(T); iptr != NULL; iptr = Next_Kmer_Entry(T))
+      for (iptr = next_entry(T,end); iptr != NULL; iptr = next_entry(T,end))
         { int x = mypref(cptr,iptr,khalf); 
           cptr += tbyte;
           if (x < khalf)
@@ -245,10 +266,10 @@ void Find_Haplo_Pairs(Kmer_Stream *T)
           if (c > 1) 
             { for (i = 0; i < c; i++)
                 { uint8 *fp = finger[good[i]];
-                  print_seq(fp,kmer);
-                  printf(" %d\n",COUNT_OF(fp));
+                  print_seq(out,fp,kmer);
+                  fprintf(out," %d\n",COUNT_OF(fp));
                 }
-              printf("\n");
+              fprintf(out,"\n");
             }
           for (i = 0; i < a; i++)
             finger[advn[i]] += tbyte;
@@ -260,8 +281,28 @@ void Find_Haplo_Pairs(Kmer_Stream *T)
 #endif
         }
     }
+
+  free(cache);
+}
+
+static void *haplo_thread(void *args)
+{ TP *parm = (TP *) args;
+
+  if (parm->tid != 0)
+    { parm->T = Clone_Kmer_Stream(parm->T);
+      if (parm->T == NULL)
+        { fprintf(stderr,"%s: Cannot reopen the k-mer table\n",Prog_Name);
+          exit (1);
+        }
+    }
+
+  Find_Haplo_Pairs(parm->T,parm->beg,parm->end,parm->out);
+
+  if (parm->tid != 0)
+    Free_Kmer_Stream(parm->T);
+
+  return (NULL);
 }
-          
 
 /****************************************************************************************
  *
@@ -282,6 +323,8 @@ int main(int argc, char *argv[])
 
     HAPLO_LOW = 1;
     HAPLO_HGH = 0x7fff;
+    NTHREADS  = 4;
+    SORT_PATH = "/tmp";
 
     j = 1;
     for (i = 1; i < argc; i++)
@@ -316,6 +359,12 @@ int main(int argc, char *argv[])
               }
             fprintf(stderr,"%s: Syntax of -g option invalid -h<int>:<int>\n",Prog_Name);
             exit (1);
+          case 'P':
+            SORT_PATH = argv[i]+2;
+            break;
+          case 'T':
+            ARG_POSITIVE(NTHREADS,"Number of threads")
+            break;
         }
       else
         argv[j++] = argv[i];
@@ -325,13 +374,99 @@ int main(int argc, char *argv[])
       { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage);
         fprintf(stderr,"\n");
         fprintf(stderr,"      -g: Accept only haplotypes with count in given range (inclusive).\n");
+        fprintf(stderr,"      -T: Use -T threads.\n");
+        fprintf(stderr,"      -P: Place block level temporary files in directory -P.\n");
         exit (1);
       }
   }
 
   T = Open_Kmer_Stream(argv[1]);
+  if (T == NULL)
+    { fprintf(stderr,"%s: Cannot open k-mer table %s\n",Prog_Name,argv[1]);
+      exit (1);
+    }
+
+  setup_fmer_table();
+
+  //  Partition the table into NTHREADS ranges whose boundaries are moved back to the first
+  //    k-mer with the same khalf-prefix, so that no group of haplotype candidates is split.
+  //    Thread 0 prints directly, the others to temporary files that are then appended in order.
+
+  { int64     range[NTHREADS+1];
+    pthread_t threads[NTHREADS];
+    TP        parm[NTHREADS];
+    int       kbyte = T->kbyte;
+    int       khalf = T->kmer/2;
+    uint8     pref[kbyte];
+    uint8     keep[] = { 0x00, 0xc0, 0xf0, 0xfc };
+    int       t, b;
+    int64     p;
+
+    range[0] = 0;
+    range[NTHREADS] = T->nels;
+    for (t = 1; t < NTHREADS; t++)
+      { p = (T->nels*t)/NTHREADS;
+        if (p >= T->nels)
+          { range[t] = T->nels;
+            continue;
+          }
+        GoTo_Kmer_Index(T,p);
+        memcpy(pref,T->celm,kbyte);
+        b = (khalf >> 2);
+        pref[b] &= keep[khalf&0x3];
+        for (b++; b < kbyte; b++)
+          pref[b] = 0;
+        GoTo_Kmer_String(T,pref);
+        range[t] = T->cidx;
+        if (range[t] < range[t-1])
+          range[t] = range[t-1];
+      }
+
+    for (t = 0; t < NTHREADS; t++)
+      { parm[t].tid = t;
+        parm[t].T   = T;
+        parm[t].beg = range[t];
+        parm[t].end = range[t+1];
+        if (t == 0)
+          parm[t].out = stdout;
+        else
+          { char *fname = Malloc(strlen(SORT_PATH)+100,"Allocating file name");
+            if (fname == NULL)
+              exit (1);
+            sprintf(fname,"%s/Haplex.%d.T%d",SORT_PATH,getpid(),t);
+            parm[t].out = fopen(fname,"w+");
+            if (parm[t].out == NULL)
+              { fprintf(stderr,"%s: Cannot create temporary file in directory %s\n",
+                               Prog_Name,SORT_PATH);
+                exit (1);
+              }
+            unlink(fname);
+            free(fname);
+          }
+      }
+
+#ifdef DEBUG_THREADS
+    for (t = 0; t < NTHREADS; t++)
+      haplo_thread(parm+t);
+#else
+    for (t = 1; t < NTHREADS; t++)
+      pthread_create(threads+t,NULL,haplo_thread,parm+t);
+    haplo_thread(parm);
+    for (t = 1; t < NTHREADS; t++)
+      pthread_join(threads[t],NULL);
+#endif
 
-  Find_Haplo_Pairs(T);
+    { char   buf[0x10000];
+      size_t n;
+
+      for (t = 1; t < NTHREADS; t++)
+        { rewind(parm[t].out);
+          while ((n = fread(buf,1,sizeof(buf),parm[t].out)) > 0)
+            fwrite(buf,1,n,stdout);
+          fclose(parm[t].out);
+        }
+    }
+  }
 
   Free_Kmer_Stream(T);
 
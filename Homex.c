@@ -13,14 +13,16 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <math.h>
+#include <pthread.h>
 
 #undef   DEBUG_PARTITION
+#undef   DEBUG_THREADS
 #undef   DEBUG_QUEUE
 #undef   DEBUG_DATA_POINT
 
 #include "libfastk.h"
 
-static char *Usage = "-e<int> -g<int>:<int> <source_root>[.ktab]";
+static char *Usage = "[-T<int(4)>] -e<int> -g<int>:<int> <source_root>[.ktab]";
 
 #define MAX_HOMO_LEN 10
 
@@ -66,7 +68,7 @@ static void print_seq(uint8 *seq, int len)
     printf("%s",fmer[seq[i]]);
   k = 6;
   for (i = b << 2; i < len; i++)
-    { printf("%c",dna[seq[b] >> k]);
+    { printf("%c",dna[(seq[b] >> k) & 0x3]);
       k -= 2;
     }
 }
@@ -81,13 +83,17 @@ static inline void mycpy(uint8 *a, uint8 *b, int n)
 
 /****************************************************************************************
  *
- *  Find Haplotype Pairs
+ *  Count Homopolymer Errors.  Each thread scans the entries [beg,end) of the table, where
+ *    the boundaries of the ranges are aligned to the start of a group of k-mers that share
+ *    their first khalf bases (and hence all the homopolymer variants of a k-mer), and
+ *    accumulates into its own profile.
  *
  *****************************************************************************************/
 
 static int ERROR;
 static int GOOD_LOW;
 static int GOOD_HGH;
+static int NTHREADS;
 
 static inline int mypref(uint8 *a, uint8 *b, int n)
 { int   i;
@@ -143,10 +149,23 @@ typedef struct
 
 typedef Point Profile[4][MAX_HOMO_LEN+1]; 
 
-Profile *Count_Homopolymer_Errors(Kmer_Stream *T)
-{ static Profile profile;
+typedef struct
+  { int          tid;
+    Kmer_Stream *T;      //  The table (threads other than 0 open their own copy)
+    int64        beg;
+    int64        end;
+    Profile      profile;
+  } TP;
+
+static inline uint8 *next_entry(Kmer_Stream *T, int64 end)
+{ uint8 *iptr = Next_Kmer_Entry(T);
+  if (T->cidx >= end)
+    return (NULL);
+  return (iptr);
+}
 
-  int    kmer  = T->kmer;
+static void Count_Homopolymer_Errors(Kmer_Stream *T, int64 beg, int64 end, Profile profile)
+{ int    kmer  = T->kmer;
   int    tbyte = T->tbyte;
   int    kbyte = T->kbyte;
 
@@ -171,30 +190,20 @@ Profile *Count_Homopolymer_Errors(Kmer_Stream *T)
   int   cn[4];
   int64 ridx;
 
-  setup_fmer_table();
-
-  for (hsym = 0; hsym < 4; hsym++)
-    for (hlen = 0; hlen < MAX_HOMO_LEN; hlen++)
-      { profile[hsym][hlen].correct = 0;
-        profile[hsym][hlen].lessone = 0;
-        profile[hsym][hlen].plusone = 0;
-      }
+  bzero(profile,sizeof(Profile));
 
   khalf = kmer/2;
-  klong = khalf - (MAX_HOMO_LEN/2);
-  if (klong < 10)
-    { fprintf(stderr,"%s: A k-mer length of at least %d is needed\n",Prog_Name,20+MAX_HOMO_LEN);
-      exit (1);
-    }
-  klong -= 1;
+  klong = (khalf - (MAX_HOMO_LEN/2)) - 1;
 
   cache = Malloc(4096*tbyte,"Allocating entry buffer");
   cptr  = cache;
   ctop  = cache + 4096*tbyte;
   fbeg[4] = 0;
 
-  ridx = 0;
-  iptr = First_Kmer_Entry(T);
+  ridx = beg;
+  iptr = GoTo_Kmer_Index(T,beg);
+  if (T->cidx >= end)
+    iptr = NULL;
   while (iptr != NULL)
     { hlen = khalf-1;
       hsym = SYMBOL(iptr,hlen);
@@ -206,7 +215,7 @@ Profile *Count_Homopolymer_Errors(Kmer_Stream *T)
       if (hlen <= klong)
         { mycpy(cache,iptr,tbyte);
           ridx += 1;
-          for (iptr = Next_Kmer_Entry(T); iptr != NULL; iptr = Next_Kmer_Entry(T))
+          for (iptr = next_entry(T,end); iptr != NULL; iptr = next_entry(T,end))
             { int x = mypref(iptr,cache,khalf); 
               if (x < khalf)
                 break;
@@ -246,7 +255,7 @@ Profile *Count_Homopolymer_Errors(Kmer_Stream *T)
         fend[i] = -1;
     
       cptr = cache;
-      for (; iptr != NULL; iptr = Next_Kmer_Entry(T))
+      for (; iptr != NULL; iptr = next_entry(T,end))
         { int x = mypref(iptr,suffix,kchkl); 
           if (x < khalf)
             break;
@@ -276,7 +285,7 @@ Profile *Count_Homopolymer_Errors(Kmer_Stream *T)
 #endif
 
       if (fend[1] < 0 && fend[2] < 0)
-        { ridx += ctop-cache;
+        { ridx += (cptr-cache)/tbyte;
           continue;
         }
 
@@ -364,10 +373,29 @@ Profile *Count_Homopolymer_Errors(Kmer_Stream *T)
             printf("\n");
 #endif
         }
-      ridx += ctop-cache;
+      ridx += (cptr-cache)/tbyte;
+    }
+
+  free(cache);
+}
+
+static void *homo_thread(void *args)
+{ TP *parm = (TP *) args;
+
+  if (parm->tid != 0)
+    { parm->T = Clone_Kmer_Stream(parm->T);
+      if (parm->T == NULL)
+        { fprintf(stderr,"%s: Cannot reopen the k-mer table\n",Prog_Name);
+          exit (1);
+        }
     }
 
-  return (&profile);
+  Count_Homopolymer_Errors(parm->T,parm->beg,parm->end,parm->profile);
+
+  if (parm->tid != 0)
+    Free_Kmer_Stream(parm->T);
+
+  return (NULL);
 }
 
 
@@ -379,7 +407,7 @@ Profile *Count_Homopolymer_Errors(Kmer_Stream *T)
 
 int main(int argc, char *argv[])
 { Kmer_Stream *T;
-  Profile     *P;
+  Profile      P;
 
   { int    i, j, k;
     int    flags[128];
@@ -391,6 +419,7 @@ int main(int argc, char *argv[])
 
     ERROR    = -1;
     GOOD_LOW = -1;
+    NTHREADS = 4;
 
     j = 1;
     for (i = 1; i < argc; i++)
@@ -437,6 +466,9 @@ int main(int argc, char *argv[])
               }
             fprintf(stderr,"%s: Syntax of -g option invalid -g<int>:<int>\n",Prog_Name);
             exit (1);
+          case 'T':
+            ARG_POSITIVE(NTHREADS,"Number of threads")
+            break;
         }
       else
         argv[j++] = argv[i];
@@ -447,6 +479,7 @@ int main(int argc, char *argv[])
         fprintf(stderr,"\n");
         fprintf(stderr,"      -e: Counts <= this value are considered errors.\n");
         fprintf(stderr,"      -g: Counts in this range are considered correct.\n");
+        fprintf(stderr,"      -T: Use -T threads.\n");
         exit (1);
       }
 
@@ -461,8 +494,84 @@ int main(int argc, char *argv[])
   }
 
   T = Open_Kmer_Stream(argv[1]);
+  if (T == NULL)
+    { fprintf(stderr,"%s: Cannot open k-mer table %s\n",Prog_Name,argv[1]);
+      exit (1);
+    }
+  if ((T->kmer/2 - (MAX_HOMO_LEN/2)) < 10)
+    { fprintf(stderr,"%s: A k-mer length of at least %d is needed\n",Prog_Name,20+MAX_HOMO_LEN);
+      exit (1);
+    }
+
+  setup_fmer_table();
+
+  //  Partition the table into NTHREADS ranges whose boundaries are moved back to the first
+  //    k-mer with the same khalf-prefix, so that the homopolymer variants of every k-mer
+  //    are in the same range, profile each in a thread, and then sum the threads' profiles
+
+  { int64     range[NTHREADS+1];
+    pthread_t threads[NTHREADS];
+    TP       *parm;
+    int       kbyte = T->kbyte;
+    int       khalf = T->kmer/2;
+    uint8     pref[kbyte];
+    uint8     keep[] = { 0x00, 0xc0, 0xf0, 0xfc };
+    int       t, b, h;
+    int64     p;
+
+    range[0] = 0;
+    range[NTHREADS] = T->nels;
+    for (t = 1; t < NTHREADS; t++)
+      { p = (T->nels*t)/NTHREADS;
+        if (p >= T->nels)
+          { range[t] = T->nels;
+            continue;
+          }
+        GoTo_Kmer_Index(T,p);
+        memcpy(pref,T->celm,kbyte);
+        b = (khalf >> 2);
+        pref[b] &= keep[khalf&0x3];
+        for (b++; b < kbyte; b++)
+          pref[b] = 0;
+        GoTo_Kmer_String(T,pref);
+        range[t] = T->cidx;
+        if (range[t] < range[t-1])
+          range[t] = range[t-1];
+      }
 
-  P = Count_Homopolymer_Errors(T);
+    parm = Malloc(sizeof(TP)*NTHREADS,"Allocating thread records");
+    if (parm == NULL)
+      exit (1);
+
+    for (t = 0; t < NTHREADS; t++)
+      { parm[t].tid = t;
+        parm[t].T   = T;
+        parm[t].beg = range[t];
+        parm[t].end = range[t+1];
+      }
+
+#ifdef DEBUG_THREADS
+    for (t = 0; t < NTHREADS; t++)
+      homo_thread(parm+t);
+#else
+    for (t = 1; t < NTHREADS; t++)
+      pthread_create(threads+t,NULL,homo_thread,parm+t);
+    homo_thread(parm);
+    for (t = 1; t < NTHREADS; t++)
+      pthread_join(threads[t],NULL);
+#endif
+
+    bzero(P,sizeof(Profile));
+    for (t = 0; t < NTHREADS; t++)
+      for (b = 0; b < 4; b++)
+        for (h = 0; h <= MAX_HOMO_LEN; h++)
+          { P[b][h].correct += parm[t].profile[b][h].correct;
+            P[b][h].lessone += parm[t].profile[b][h].lessone;
+            P[b][h].plusone += parm[t].profile[b][h].plusone;
+          }
+
+    free(parm);
+  }
 
   Free_Kmer_Stream(T);
 
@@ -470,18 +579,18 @@ int main(int argc, char *argv[])
 
     printf("\n              -1      Good          +1      Error Rate\n\n");
     for (h = 2; h <= MAX_HOMO_LEN; h++)
-      { int64 cc = (*P)[0][h].correct + (*P)[3][h].correct;
-        int64 cl = (*P)[0][h].lessone + (*P)[3][h].lessone;
-        int64 cp = (*P)[0][h].plusone + (*P)[3][h].plusone;
+      { int64 cc = P[0][h].correct + P[3][h].correct;
+        int64 cl = P[0][h].lessone + P[3][h].lessone;
+        int64 cp = P[0][h].plusone + P[3][h].plusone;
 
         printf(" %2d at: %10lld %10lld %10lld -> %.1f%%\n",h,cl,cc,cp,(100.*(cl+cp))/(cc+cl+cp));
       }
 
     printf("\n");
     for (h = 2; h <= MAX_HOMO_LEN; h++)
-      { int64 cc = (*P)[1][h].correct + (*P)[2][h].correct;
-        int64 cl = (*P)[1][h].lessone + (*P)[2][h].lessone;
-        int64 cp = (*P)[1][h].plusone + (*P)[2][h].plusone;
+      { int64 cc = P[1][h].correct + P[2][h].correct;
+        int64 cl = P[1][h].lessone + P[2][h].lessone;
+        int64 cp = P[1][h].plusone + P[2][h].plusone;
 
         printf(" %2d cg: %10lld %10lld %10lld -> %.1f%%\n",h,cl,cc,cp,(100.*(cl+cp))/(cc+cl+cp));
       }
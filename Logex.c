@@ -11,16 +11,18 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <pthread.h>
+#include <time.h>
 
 #undef   DEBUG
 #undef   DEBUG_THREADS
+#undef   BENCH_EVAL       //  Logex becomes a microbenchmark of the expression evaluators
 
 #include "libfastk.h"
 
 static char *Usage[] = { " [-T<int(4)>] [-[hH]{<int(1)>:]<int>]",
                          "   <output:name=expr> ... <source_root>[.ktab] ..." };
 
-#define MAX_TABS 8
+#define MAX_TABS     256
 
 static int DO_TABLE;
 static int NTHREADS;
@@ -40,6 +42,10 @@ static int HIST_LOW, HIST_HGH;
 #define OP_NUM 5
 #define OP_ARG 6
 
+#define LOG_ALL  7    //  Compiled logic tests on the set of tables containing a k-mer
+#define LOG_ANY  8
+#define LOG_NONE 9
+
 #define MOD_AVE 0
 #define MOD_SUM 1
 #define MOD_SUB 2
@@ -67,10 +73,9 @@ typedef struct _node
 
 static char *Scan;
 static int   Error;
-static int   VarV;
+static uint8 Used[MAX_TABS];
 static int   hasFilter;
 static char *hasNoMode;
-static int   Narg;
 static Node *or();
 
 #define ERROR(msg)	\
@@ -87,7 +92,7 @@ static char *Error_Messages[] =
     "Expecting a -",					// 5
     "Expecting a , or ]",				// 6
     "Do not recognize this operator",			// 7
-    "Largest argument possible is H/h",			// 8
+    "Table number is out of range",			// 8
     "Modeless operator not in # argument",		// 9
     "Invalid modulator"	                		// 10
   };
@@ -111,8 +116,6 @@ static void free_tree(Node *v)
         free_tree(v->lft);
       if (v->op == OP_CNT)
         free(v->rgt);
-      else if (v->op == OP_NUM && v->mode)
-        free(v->rgt);
       else if (v->rgt != NULL)
         free_tree(v->rgt);
     }
@@ -137,17 +140,27 @@ static Node *terminal()
       Scan += 1;
       return (v);
     }
-  else if (isalpha(*Scan))
+  else if (isalpha(*Scan) || *Scan == '$')
     { int64 x;
 
-      if (islower(*Scan))
-        x = *Scan-'a';
+      if (*Scan == '$')
+        { char *eptr;
+
+          x = strtol(Scan+1,&eptr,10) - 1;
+          if (eptr == Scan+1)
+            ERROR(1)
+          if (x < 0 || x >= MAX_TABS)
+            ERROR(8)
+          Scan = eptr;
+        }
       else
-        x = *Scan-'A';
-      if (x > MAX_TABS)
-        ERROR(8)
-      VarV |= (1 << x);
-      Scan += 1;
+        { if (islower(*Scan))
+            x = *Scan-'a';
+          else
+            x = *Scan-'A';
+          Scan += 1;
+        }
+      Used[x] = 1;
       return (node(OP_ARG,0,(Node *) x,NULL));
     }
   else
@@ -179,14 +192,9 @@ static Node *num()
           return (node(OP_NUM,0,v,NULL));
         }
       else
-        { int *tab = Malloc(sizeof(int)*(1<<Narg),"Allocating logic table");
-          if (tab == NULL)
-            { free_tree(v);
-              ERROR(0);
-            }
-          hasFilter = hF;
+        { hasFilter = hF;
           hasNoMode = hM;
-          return (node(OP_NUM,1,v,(Node *) tab));
+          return (node(OP_NUM,1,v,NULL));
         }
     }
   else
@@ -330,7 +338,7 @@ static int get_mode()
     case '.':
       return (MOD_LFT);
     default:
-      if (*Scan == '(' || isalpha(*Scan) || *Scan == '#' || isspace(*Scan))
+      if (*Scan == '(' || isalpha(*Scan) || *Scan == '$' || *Scan == '#' || isspace(*Scan))
         return (MOD_ONE);
       else
         return (-1);
@@ -463,9 +471,6 @@ static void print_tree(Node *v, int level)
     }
   else if (v->op == OP_NUM)
     { printf("%*s%s (%d)\n",level,"",Operator[v->op],v->mode);
-      if (v->mode)
-        for (int i = 0; i < (1<<Narg); i++)
-          printf("%*s  %0*x: %d\n",level,"",(Narg-1)/4+1,i,((int *) (v->rgt))[i]);
       fflush(stdout);
       print_tree(v->lft,level+2);
     }
@@ -482,13 +487,11 @@ static void print_tree(Node *v, int level)
 
 #endif
 
-static Node *parse_expression(char *expr, int *varg, int ntabs)
+static Node *parse_expression(char *expr)
 { Node *v;
 
   hasNoMode = NULL;
   hasFilter = 0;
-  Narg = ntabs;
-  VarV = 0;
   Scan = expr;
   v    = or();
   if (v != NULL)
@@ -516,65 +519,208 @@ static Node *parse_expression(char *expr, int *varg, int ntabs)
       exit (1);
     }
 
-  *varg = VarV;
   return (v);
 }
 
-static int eval_logic(Node *t, int i)
-{ int x, y;
-  switch (t->op)
-  { case OP_OR:
-      x = eval_logic(t->lft,i);
-      y = eval_logic(t->rgt,i);
-      return (x || y);
-    case OP_MIN:
-      x = eval_logic(t->lft,i);
-      y = eval_logic(t->rgt,i);
-      return (x && (1-y));
-    case OP_XOR:
-      x = eval_logic(t->lft,i);
-      y = eval_logic(t->rgt,i);
-      return (x != y);
-    case OP_AND:
-      x = eval_logic(t->lft,i);
-      y = eval_logic(t->rgt,i);
-      return (x && y);
-    case OP_CNT:
-      return (eval_logic(t->lft,i));
-    case OP_NUM:
-      x = eval_logic(t->lft,i);
-      if (t->mode)
-        ((int *) (t->rgt))[i] = x;
-      return (x);
-    case OP_ARG:
-      { x = (int64) (t->lft);
-        if ( (i & (1<<x)) != 0)
-          return (1);
-        else
-          return (0);
-      }
-    default:
-      return (0);
-  }
+  //  The logical predicate of an expression is compiled into a postfix program over the set of
+  //  tables that contain the current k-mer, represented as a bit vector of Nword 64-bit words.
+  //  Maximal subtrees that are a conjunction or a disjunction of arguments become a single
+  //  bit-vector test (LOG_ALL, LOG_ANY), as does the right side of a minus (LOG_NONE).
+
+typedef struct
+  { int     op;     //  LOG_ALL, LOG_ANY, LOG_NONE test, or OP_OR, OP_AND, OP_MIN, OP_XOR of the
+    uint64 *bits;   //    top two results on the stack.  bits is the table set of a test.
+  } Logic;
+
+static int Nword;
+
+static Node *logic_of(Node *t)      //  Count filters and #'s do not affect the logic
+{ while (t->op == OP_CNT || t->op == OP_NUM)
+    t = t->lft;
+  return (t);
 }
 
-static int *compile_expression(Node *t, int ntabs)
-{ int *table;
-  int  i;
+static int is_pure(Node *t, int op)
+{ t = logic_of(t);
+  if (t->op == OP_ARG)
+    return (1);
+  if (t->op != op)
+    return (0);
+  return (is_pure(t->lft,op) && is_pure(t->rgt,op));
+}
+
+static void arg_set(Node *t, uint64 *bits)
+{ int64 x;
 
-  if (t->op == OP_NUM)
-    { for (i = (1 << ntabs)-1; i >= 0; i--)
-        eval_logic(t,i);
-      return ((int *) (t->rgt));
+  t = logic_of(t);
+  if (t->op == OP_ARG)
+    { x = (int64) (t->lft);
+      bits[x>>6] |= (1llu << (x&0x3f));
     }
   else
-    { table = Malloc(sizeof(int)*(1<<ntabs),"Allocating logic table");
-      for (i = (1 << ntabs)-1; i >= 0; i--)
-        table[i] = eval_logic(t,i);
-      return (table);
+    { arg_set(t->lft,bits);
+      arg_set(t->rgt,bits);
+    }
+}
+
+static int emit_test(Node *t, int op, Logic *prog, int n)
+{ if (prog != NULL)
+    { prog[n].op   = op;
+      prog[n].bits = Malloc(sizeof(uint64)*Nword,"Allocating logic program");
+      if (prog[n].bits == NULL)
+        exit (1);
+      bzero(prog[n].bits,sizeof(uint64)*Nword);
+      arg_set(t,prog[n].bits);
     }
+  return (n+1);
 }
 
+static int emit_logic(Node *t, Logic *prog, int n)
+{ t = logic_of(t);
+  if (is_pure(t,OP_AND))
+    return (emit_test(t,LOG_ALL,prog,n));
+  if (is_pure(t,OP_OR))
+    return (emit_test(t,LOG_ANY,prog,n));
+  n = emit_logic(t->lft,prog,n);
+  if (t->op == OP_MIN && is_pure(t->rgt,OP_OR))
+    { n = emit_test(t->rgt,LOG_NONE,prog,n);
+      if (prog != NULL)
+        prog[n].op = OP_AND;
+    }
+  else
+    { n = emit_logic(t->rgt,prog,n);
+      if (prog != NULL)
+        prog[n].op = t->op;
+    }
+  return (n+1);
+}
+
+static Logic *compile_logic(Node *t, int *len)
+{ Logic *prog;
+
+  *len = emit_logic(t,NULL,0);
+  prog = Malloc(sizeof(Logic)*(*len),"Allocating logic program");
+  if (prog == NULL)
+    exit (1);
+  emit_logic(t,prog,0);
+  return (prog);
+}
+
+static void free_logic(Logic *prog, int len)
+{ int i;
+
+  for (i = 0; i < len; i++)
+    if (prog[i].op >= LOG_ALL)
+      free(prog[i].bits);
+  free(prog);
+}
+
+  //  Evaluate prog of length len on the table set in, using stack (of size len) as scratch
+
+static inline int eval_logic(Logic *prog, int len, uint64 *in, int *stack)
+{ int     i, w, h, x;
+  uint64 *b, s;
+
+  if (Nword == 1)                   //  Up to 64 tables, every test is a single word operation
+    { s = in[0];
+      if (len == 1)
+        { b = prog->bits;
+          switch (prog->op)
+          { case LOG_ALL:
+              return ((s & *b) == *b);
+            case LOG_ANY:
+              return ((s & *b) != 0);
+            default:
+              return ((s & *b) == 0);
+          }
+        }
+      h = 0;
+      for (i = 0; i < len; i++)
+        { b = prog[i].bits;
+          switch (prog[i].op)
+          { case LOG_ALL:
+              stack[h++] = ((s & *b) == *b);
+              break;
+            case LOG_ANY:
+              stack[h++] = ((s & *b) != 0);
+              break;
+            case LOG_NONE:
+              stack[h++] = ((s & *b) == 0);
+              break;
+            case OP_OR:
+              h -= 1;
+              stack[h-1] |= stack[h];
+              break;
+            case OP_AND:
+              h -= 1;
+              stack[h-1] &= stack[h];
+              break;
+            case OP_MIN:
+              h -= 1;
+              stack[h-1] &= ! stack[h];
+              break;
+            case OP_XOR:
+              h -= 1;
+              stack[h-1] ^= stack[h];
+              break;
+          }
+        }
+      return (stack[0]);
+    }
+
+  h = 0;
+  for (i = 0; i < len; i++)
+    { b = prog[i].bits;
+      switch (prog[i].op)
+      { case LOG_ALL:
+          for (w = 0; w < Nword; w++)
+            if ((in[w] & b[w]) != b[w])
+              break;
+          stack[h++] = (w >= Nword);
+          break;
+        case LOG_ANY:
+          x = 0;
+          for (w = 0; w < Nword; w++)
+            if ((in[w] & b[w]) != 0)
+              { x = 1;
+                break;
+              }
+          stack[h++] = x;
+          break;
+        case LOG_NONE:
+          x = 1;
+          for (w = 0; w < Nword; w++)
+            if ((in[w] & b[w]) != 0)
+              { x = 0;
+                break;
+              }
+          stack[h++] = x;
+          break;
+        case OP_OR:
+          h -= 1;
+          stack[h-1] |= stack[h];
+          break;
+        case OP_AND:
+          h -= 1;
+          stack[h-1] &= stack[h];
+          break;
+        case OP_MIN:
+          h -= 1;
+          stack[h-1] &= ! stack[h];
+          break;
+        case OP_XOR:
+          h -= 1;
+          stack[h-1] ^= stack[h];
+          break;
+      }
+    }
+  return (stack[0]);
+}
+
+#ifdef BENCH_EVAL
+
+  //  The original tree-walking evaluator, kept as the reference for the benchmark
+
 static inline int modulate(int x, int y, int mode)
 { switch (mode)
   { case MOD_AVE:
@@ -682,6 +828,181 @@ static int eval_expression(Node *t, int *cnts)
   }
 }
 
+#endif
+
+
+/****************************************************************************************
+ *
+ *  Expression byte code
+ *
+ *****************************************************************************************/
+
+  //  An expression is lowered to a postfix program whose instructions are evaluated over a
+  //  batch of up to EVAL_BATCH k-mers at a time.  The counts are in "column" form, i.e. the count
+  //  of the b'th k-mer of the batch in table c is at cnts[c*EVAL_BATCH+b], so each instruction is
+  //  a simple loop over the batch that the compiler can vectorize.  The result of an instruction
+  //  is a row of counts, and an argument instruction simply pushes its column.
+
+#define EVAL_BATCH 256
+
+typedef struct
+  { int16  op;      //  OP_* code
+    int16  mode;    //  Modulator of OP_OR and OP_AND, or # of range bounds of OP_CNT
+    int    arg;     //  Table of OP_ARG
+    int   *range;   //  Ranges of OP_CNT (belongs to the expression tree)
+  } Code;
+
+static int emit_code(Node *t, Code *code, int n)
+{ if (t->op == OP_ARG)
+    { if (code != NULL)
+        { code[n].op  = OP_ARG;
+          code[n].arg = (int64) (t->lft);
+        }
+      return (n+1);
+    }
+  n = emit_code(t->lft,code,n);
+  if (t->op != OP_CNT && t->op != OP_NUM)
+    n = emit_code(t->rgt,code,n);
+  if (code != NULL)
+    { code[n].op   = t->op;
+      code[n].mode = t->mode;
+      if (t->op == OP_CNT)
+        code[n].range = (int *) (t->rgt);
+    }
+  return (n+1);
+}
+
+static Code *compile_code(Node *t, int *len)
+{ Code *code;
+
+  *len = emit_code(t,NULL,0);
+  code = Malloc(sizeof(Code)*(*len),"Allocating expression code");
+  if (code == NULL)
+    exit (1);
+  emit_code(t,code,0);
+  return (code);
+}
+
+  //  The loop of a modulated operator is specialized to each modulator, and the rules for
+  //  zero operands are written without branches, so that every loop vectorizes
+
+#define MOD_LOOP(RULE)							\
+  switch (mode)								\
+  { case MOD_AVE:							\
+      for (b = 0; b < n; b++)						\
+        { u = x[b]; v = y[b]; r[b] = RULE((u+v) >> 1); }		\
+      break;								\
+    case MOD_SUM:							\
+      for (b = 0; b < n; b++)						\
+        { u = x[b]; v = y[b]; r[b] = RULE(u+v); }			\
+      break;								\
+    case MOD_SUB:							\
+      for (b = 0; b < n; b++)						\
+        { u = x[b]; v = y[b]; r[b] = RULE((u > v)*(u-v)); }		\
+      break;								\
+    case MOD_MIN:							\
+      for (b = 0; b < n; b++)						\
+        { u = x[b]; v = y[b]; r[b] = RULE(u < v ? u : v); }		\
+      break;								\
+    case MOD_MAX:							\
+      for (b = 0; b < n; b++)						\
+        { u = x[b]; v = y[b]; r[b] = RULE(u > v ? u : v); }		\
+      break;								\
+    case MOD_LFT:							\
+      for (b = 0; b < n; b++)						\
+        { u = x[b]; v = y[b]; r[b] = RULE(u == 0 ? v : u); }		\
+      break;								\
+    default:								\
+      for (b = 0; b < n; b++)						\
+        { u = x[b]; v = y[b]; r[b] = RULE(1); }				\
+      break;								\
+  }
+
+#define OR_RULE(m)  ((u == 0)*v + (v == 0)*u + ((u != 0) & (v != 0))*(m))
+#define AND_RULE(m) (((u != 0) & (v != 0))*(m))
+
+  //  Evaluate code of length len on the n <= EVAL_BATCH count vectors in cnts.  stack has len
+  //  entries and scratch len*EVAL_BATCH ints.  Returns a pointer to the row of results.
+
+static int *eval_code(Code *code, int len, int *cnts, int n, int **stack, int *scratch)
+{ int  i, b, h, j;
+  int *x, *y, *r;
+
+  h = 0;
+  for (i = 0; i < len; i++)
+    { if (code[i].op == OP_ARG)
+        { stack[h++] = cnts + code[i].arg*EVAL_BATCH;
+          continue;
+        }
+
+      r = scratch + (h-1)*EVAL_BATCH;
+      x = stack[h-1];
+      switch (code[i].op)
+      { case OP_NUM:
+          for (b = 0; b < n; b++)
+            r[b] = (x[b] > 0);
+          break;
+
+        case OP_CNT:
+          { int *rng = code[i].range;
+            int  nrg = code[i].mode;
+            int *in  = scratch + h*EVAL_BATCH;    //  row h is free as the stack has h entries
+            int  lo, hi, u;
+
+            for (b = 0; b < n; b++)
+              in[b] = 0;
+            for (j = 0; j < nrg; j += 2)
+              { lo = rng[j];
+                hi = rng[j+1];
+                for (b = 0; b < n; b++)
+                  { u = x[b];
+                    in[b] |= (u >= lo) & (u <= hi);
+                  }
+              }
+            for (b = 0; b < n; b++)
+              r[b] = in[b] * x[b];
+            break;
+          }
+
+        default:
+          { int mode = code[i].mode;
+            int u, v;
+
+            h -= 1;
+            r = scratch + (h-1)*EVAL_BATCH;
+            x = stack[h-1];
+            y = stack[h];
+            switch (code[i].op)
+            { case OP_OR:
+                MOD_LOOP(OR_RULE)
+                break;
+              case OP_AND:
+                MOD_LOOP(AND_RULE)
+                break;
+              case OP_XOR:
+                for (b = 0; b < n; b++)
+                  { u = x[b];
+                    v = y[b];
+                    r[b] = (u == 0 ? v : (v == 0 ? u : 0));
+                  }
+                break;
+              case OP_MIN:
+                for (b = 0; b < n; b++)
+                  { u = x[b];
+                    v = y[b];
+                    r[b] = (v == 0 ? u : 0);
+                  }
+                break;
+            }
+            break;
+          }
+      }
+      stack[h-1] = r;
+    }
+
+  return (stack[0]);
+}
+
 
 /****************************************************************************************
  *
@@ -690,33 +1011,35 @@ static int eval_expression(Node *t, int *cnts)
  *****************************************************************************************/
 
 typedef struct
-  { Node *expr;
-    int   varg;
-    char *root;
-    char *path;
-    int  *filter;
-    int   logical;
-    int   ntabs;
+  { Node  *expr;
+    char  *root;
+    char  *path;
+    Logic *logic;
+    int    llen;
+    Code  *code;
+    int    clen;
+    int    logical;
   } Assignment;
 
-static Assignment *parse_assignment(char *ass, int ntabs)
-{ char       *expr;
+static Assignment *parse_assignment(char *ass)
+{ char       *expr, *eq;
   Assignment *A;
 
   A = Malloc(sizeof(Assignment),"Allocating assignment\n");
   if (A == NULL)
     exit (1);
 
-  expr = index(ass,'=');
-  while (isspace(expr[-1]))
+  eq   = index(ass,'=');
+  expr = eq;
+  while (expr > ass && isspace(expr[-1]))
     expr -= 1;
-  *expr++ = '\0';
+  *expr = '\0';
 
-  A->ntabs   = ntabs;
   A->root    = Root(ass,".ktab");
   A->path    = PathTo(ass);
-  A->expr    = parse_expression(expr+1,&(A->varg),ntabs);
-  A->filter  = compile_expression(A->expr,ntabs);
+  A->expr    = parse_expression(eq+1);
+  A->logic   = compile_logic(A->expr,&(A->llen));
+  A->code    = compile_code(A->expr,&(A->clen));
   A->logical = (A->expr->op == OP_NUM);
   return (A);
 }
@@ -724,19 +1047,26 @@ static Assignment *parse_assignment(char *ass, int ntabs)
 #ifdef DEBUG
 
 static void print_assignment(Assignment *A)
-{ printf("'%s' '%s' %02x:\n",A->path,A->root,A->varg);
-  Narg = A->ntabs;
+{ int i, w;
+
+  printf("'%s' '%s':\n",A->path,A->root);
   print_tree(A->expr,0);
-  if ( ! A->logical)
-    for (int i = 0; i < (1 << Narg); i++)
-      printf(" %0*x: %d\n",(Narg-1)/4+1,i,A->filter[i]);
+  for (i = 0; i < A->llen; i++)
+    if (A->logic[i].op >= LOG_ALL)
+      { printf("  %s",A->logic[i].op == LOG_ALL ? "ALL" : (A->logic[i].op == LOG_ANY ? "ANY" : "NONE"));
+        for (w = Nword-1; w >= 0; w--)
+          printf(" %016llx",A->logic[i].bits[w]);
+        printf("\n");
+      }
+    else
+      printf("  %s\n",Operator[A->logic[i].op]);
 }
 
 #endif
 
 static void free_assignment(Assignment *A)
-{ if ( ! A->logical)
-    free(A->filter);
+{ free_logic(A->logic,A->llen);
+  free(A->code);
   free_tree(A->expr);
   free(A->path);
   free(A->root);
@@ -751,8 +1081,7 @@ static void free_assignment(Assignment *A)
 
 typedef struct
   { int           tid;
-    char        **arg;
-    Kmer_Stream **S;
+    Kmer_Stream **S;      //  The tables (threads other than 0 open their own copies)
     int           narg;
     Assignment  **A;
     int           nass;
@@ -761,16 +1090,6 @@ typedef struct
     int64       **hist;
   } TP;
 
-#define  COUNT_OF(p) (*((uint16 *) (p+kbyte)))
-
-static inline int mycmp(uint8 *a, uint8 *b, int n)
-{ while (n-- > 0)
-    { if (*a++ != *b++)
-        return (a[-1] < b[-1] ? -1 : 1);
-    }
-  return (0);
-}
-
 #ifdef DEBUG
 
 static char dna[4] = { 'a', 'c', 'g', 't' };
@@ -815,7 +1134,6 @@ static void print_seq(FILE *out, uint8 *seq, int len)
 static void *merge_thread(void *args)
 { TP *parm = (TP *) args;
   int           tid   = parm->tid;
-  char        **arg   = parm->arg;
   Assignment  **A     = parm->A;
   int           ntabs = parm->narg;
   int           nass  = parm->nass;
@@ -828,22 +1146,35 @@ static void *merge_thread(void *args)
   int kmer  = T[0]->kmer;
   int hgram = (HIST_LOW > 0);
 
-  uint8 **ptr, *bp;
-  FILE  **out;
-  int64 **hist, *nels;
-  int    *filter, need_counts;
-  int    itop, *in, *cnt;
-  int    c, v, x, i;
+  Kmer_Merge *M;
+  uint8      *kmrs;
+  FILE      **out;
+  int64     **hist, *nels;
+  uint64     *sets, *set;
+  int        *stack, **cstack, *scratch, *res;
+  int        *cnt, *clr, ncl;
+  int         c, v, x, i, b, n, nb, last;
 
 #ifdef DEBUG
   setup_fmer_table();
 #endif
 
-  ptr    = Malloc(sizeof(uint8 *)*ntabs,"Allocating thread working memory");
-  in     = Malloc(sizeof(int)*ntabs,"Allocating thread working memory");
-  cnt    = Malloc(sizeof(int)*ntabs,"Allocating thread working memory");
-  nels   = Malloc(sizeof(int64)*nass,"Allocating thread working memory");
-  filter = Malloc(sizeof(int)*(1<<ntabs),"Allocating thread working memory");
+  x = 1;
+  for (i = 0; i < nass; i++)
+    { if (A[i]->llen > x)
+        x = A[i]->llen;
+      if (A[i]->clen > x)
+        x = A[i]->clen;
+    }
+
+  stack   = Malloc(sizeof(int)*x,"Allocating thread working memory");
+  cstack  = Malloc(sizeof(int *)*x,"Allocating thread working memory");
+  scratch = Malloc(sizeof(int)*x*EVAL_BATCH,"Allocating thread working memory");
+  cnt     = Malloc(sizeof(int)*ntabs*EVAL_BATCH,"Allocating thread working memory");
+  clr     = Malloc(sizeof(int)*ntabs*EVAL_BATCH,"Allocating thread working memory");
+  sets    = Malloc(sizeof(uint64)*Nword*EVAL_BATCH,"Allocating thread working memory");
+  kmrs    = Malloc(kbyte*EVAL_BATCH,"Allocating thread working memory");
+  nels    = Malloc(sizeof(int64)*nass,"Allocating thread working memory");
 
 #ifdef DEBUG_THREADS
   printf("Doing %d:",tid);
@@ -853,9 +1184,11 @@ static void *merge_thread(void *args)
 #endif
 
   if (tid != 0)
-    { T = Malloc(sizeof(Kmer_Stream *)*ntabs,"Allocating thread working memory");
-      for (c = 1; c <= ntabs; c++)
-        T[c-1] = Open_Kmer_Stream(arg[c]);
+    { T = Clone_Kmer_Streams(ntabs,T);
+      if (T == NULL)
+        { fprintf(stderr,"%s: Cannot reopen the source tables\n",Prog_Name);
+          exit (1);
+        }
     }
   else if (DO_TABLE)
     { for (i = 0; i < nass; i++)
@@ -864,20 +1197,11 @@ static void *merge_thread(void *args)
           fwrite(&NTHREADS,sizeof(int),1,f);
           fwrite(&one,sizeof(int),1,f);
           fclose(f);
+          unlink(Catenate(A[i]->path,"/.",A[i]->root,".kidx"));   //  Of a prior table
+          unlink(Catenate(A[i]->path,"/.",A[i]->root,".khsh"));
         }
     }
 
-  need_counts = 0;
-  for (v = 0; v < (1 << ntabs); v++)
-    filter[v] = 0;
-  for (i = 0; i < nass; i++)
-    { int *table = A[i]->filter;
-      for (v = 0; v < (1 << ntabs); v++)
-        filter[v] |= table[v];
-      if ( ! A[i]->logical)
-        need_counts = 1;
-    }
-
   if (DO_TABLE)
     { out = Malloc(sizeof(FILE *)*nass,"Allocating thread working memory");
       for (i = 0; i < nass; i++)
@@ -893,99 +1217,86 @@ static void *merge_thread(void *args)
     { hist = Malloc(sizeof(int64 *)*nass,"Allocating thread working memory");
       for (i = 0; i < nass; i++)
         { hist[i] = Malloc(sizeof(int64)*((HIST_HGH-HIST_LOW)+1),"Allocating histogram");
+          bzero(hist[i],sizeof(int64)*((HIST_HGH-HIST_LOW)+1));
           hist[i] -= HIST_LOW;
         }
     }
 
-  for (c = 0; c < ntabs; c++)
-    { ptr[c] = GoTo_Kmer_Index(T[c],begs[c]);
-      cnt[c] = 0;
-    }
+  bzero(cnt,sizeof(int)*ntabs*EVAL_BATCH);
+  bzero(sets,sizeof(uint64)*Nword*EVAL_BATCH);
+  M = Open_Kmer_Merge(ntabs,T,begs,ends);
 
-  while (1)
-    { for (c = 0; c < ntabs; c++)
-        if (T[c]->cidx < ends[c])
-          break;
-      if (c >= ntabs)
-        break;
-      itop  = 1;
-      in[0] = c;
-      bp    = ptr[c];
-      v = (1 << c);
-      for (c++; c < ntabs; c++)
-        { if (T[c]->cidx >= ends[c])
-            continue;
-          x = mycmp(ptr[c],bp,kbyte);
-          if (x == 0)
-            { in[itop++] = c;
-              v |= (1 << c);
-            }
-          else if (x < 0)
-            { itop  = 1;
-              in[0] = c;
-              bp    = ptr[c];
-              v = (1 << c);
+  nb   = 0;
+  ncl  = 0;
+  last = 0;
+  while ( ! last)
+
+    { //  Take the next k-mer of the merge, recording it in the nb'th entry of the batch: the
+      //    k-mer in kmrs, the set of tables containing it in set, and their counts in column
+      //    nb of cnt
+
+      n = Next_Kmer_Merge(M);
+      if (n == 0)
+        last = 1;
+      else
+        { memcpy(kmrs + nb*kbyte,M->kmer,kbyte);
+          set = sets + nb*Nword;
+          for (v = 0; v < n; v++)
+            { c = M->in[v];
+              set[c>>6] |= (1llu << (c&0x3f));
+              x = c*EVAL_BATCH + nb;
+              cnt[x] = M->cnt[v];
+              clr[ncl++] = x;
             }
         }
 
-      if (filter[v])
-        { if (need_counts)
-            { for (c = 0; c < itop; c++)
-                { x = in[c];
-                  cnt[x] = COUNT_OF(ptr[x]);
-                }
-            }
+      if ( ! last)
+        nb += 1;
+      if (nb < EVAL_BATCH && ! last)
+        continue;
+
+      //  Evaluate each assignment over the batch and output the k-mers it accepts
 
-          for (i = 0; i < nass; i++)
-            if (A[i]->filter[v])
-              { if (A[i]->logical)
+      for (i = 0; i < nass; i++)
+        if (A[i]->logical)
+          { for (b = 0; b < nb; b++)
+              if (eval_logic(A[i]->logic,A[i]->llen,sets+b*Nword,stack))
+                { if (DO_TABLE)
+                    { fwrite(kmrs+b*kbyte,kbyte,1,out[i]);
+                      fwrite(&one,sizeof(short),1,out[i]);
+                      nels[i] += 1;
+                    }
+                  if (hgram)
+                    hist[i][HIST_LOW] += 1;
+                }
+          }
+        else
+          { res = eval_code(A[i]->code,A[i]->clen,cnt,nb,cstack,scratch);
+            for (b = 0; b < nb; b++)
+              { v = res[b];
+                if (v > 0 && eval_logic(A[i]->logic,A[i]->llen,sets+b*Nword,stack))
                   { if (DO_TABLE)
-                      { fwrite(bp,kbyte,1,out[i]);
-                        fwrite(&one,sizeof(short),1,out[i]);
+                      { fwrite(kmrs+b*kbyte,kbyte,1,out[i]);
+                        fwrite(&v,sizeof(short),1,out[i]);
                         nels[i] += 1;
                       }
                     if (hgram)
-                      hist[i][HIST_LOW] += 1;
-                  }
-                else
-                  { v = eval_expression(A[i]->expr,cnt);
-                    if (v > 0)
-                      { if (DO_TABLE)
-                          { fwrite(bp,kbyte,1,out[i]);
-                            fwrite(&v,sizeof(short),1,out[i]);
-// print_seq(stdout,bp,kmer);
-// printf(" %d %d %d\n",v,i,kbyte);
-                            nels[i] += 1;
-                          }
-                        if (hgram)
-                          { if (v < HIST_LOW)
-                              hist[i][HIST_LOW] += v;
-                            else if (v > HIST_HGH)
-                              hist[i][HIST_HGH] += v;
-                            else
-                              hist[i][v] += v;
-                          }
+                      { if (v < HIST_LOW)
+                          hist[i][HIST_LOW] += v;
+                        else if (v > HIST_HGH)
+                          hist[i][HIST_HGH] += v;
+                        else
+                          hist[i][v] += v;
                       }
                   }
               }
-
-          if (need_counts)
-            for (c = 0; c < itop; c++)
-              { x = in[c];
-                cnt[x] = 0;
-                ptr[x] = Next_Kmer_Entry(T[x]);
-              }
-          else
-            for (c = 0; c < itop; c++)
-              { x = in[c];
-                ptr[x] = Next_Kmer_Entry(T[x]);
-              }
-        }
-      else
-        for (c = 0; c < itop; c++)
-          { x = in[c];
-            ptr[x] = Next_Kmer_Entry(T[x]);
           }
+
+      for (x = 0; x < ncl; x++)
+        cnt[clr[x]] = 0;
+      bzero(sets,sizeof(uint64)*Nword*nb);
+      nb  = 0;
+      ncl = 0;
     }
 
   if (DO_TABLE)
@@ -998,23 +1309,119 @@ static void *merge_thread(void *args)
       free(out);
     }
 
+  Free_Kmer_Merge(M);
   if (tid != 0)
-    { for (c = 0; c < ntabs; c++) 
-        Free_Kmer_Stream(T[c]);
-      free(T);
-    }
+    Free_Kmer_Streams(ntabs,T);
 
-  free(filter);
   free(nels);
+  free(kmrs);
+  free(sets);
+  free(clr);
   free(cnt);
-  free(in);
-  free(ptr);
+  free(scratch);
+  free(cstack);
+  free(stack);
 
   parm->hist = hist;
   return (NULL);
 }
 
 
+#ifdef BENCH_EVAL
+
+  //  Time the tree walk eval_expression against the batched byte code eval_code on nvec
+  //  random count vectors over ntabs tables, where each count is 0 half of the time and
+  //  otherwise uniform in [1,100], and check that they agree.
+
+static double seconds_since(struct timespec *beg)
+{ struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC,&end);
+  return ((end.tv_sec - beg->tv_sec) + (end.tv_nsec - beg->tv_nsec)/1e9);
+}
+
+static void bench_eval(char *expr, int ntabs, int nvec)
+{ Node  *tree;
+  Code  *code;
+  int    clen;
+  int   *aos, *soa, *tres, *cres;
+  int  **stack, *scratch, *res;
+  int    v, c, b, n, bad;
+  int64  tsum, csum;
+  double ttime, ctime;
+  struct timespec beg;
+
+  tree = parse_expression(expr);
+  for (c = ntabs; c < MAX_TABS; c++)
+    if (Used[c])
+      { fprintf(stderr,"%s: Expression refers to tables not given\n",Prog_Name);
+        exit (1);
+      }
+  code = compile_code(tree,&clen);
+
+  nvec = ((nvec-1)/EVAL_BATCH+1)*EVAL_BATCH;
+  aos     = Malloc(sizeof(int)*nvec*ntabs,"Allocating count vectors");
+  soa     = Malloc(sizeof(int)*nvec*ntabs,"Allocating count vectors");
+  tres    = Malloc(sizeof(int)*nvec,"Allocating results");
+  cres    = Malloc(sizeof(int)*nvec,"Allocating results");
+  stack   = Malloc(sizeof(int *)*clen,"Allocating evaluation stack");
+  scratch = Malloc(sizeof(int)*clen*EVAL_BATCH,"Allocating evaluation stack");
+  if (aos == NULL || soa == NULL || tres == NULL || cres == NULL || stack == NULL || scratch == NULL)
+    exit (1);
+
+  srandom(1);
+  for (v = 0; v < nvec; v++)
+    { b = v % EVAL_BATCH;
+      n = (v - b) * ntabs;
+      for (c = 0; c < ntabs; c++)
+        { if (random() & 0x1)
+            aos[v*ntabs+c] = 0;
+          else
+            aos[v*ntabs+c] = 1 + random() % 100;
+          soa[n + c*EVAL_BATCH + b] = aos[v*ntabs+c];
+        }
+    }
+
+  clock_gettime(CLOCK_MONOTONIC,&beg);
+  tsum = 0;
+  for (v = 0; v < nvec; v++)
+    tsum += (tres[v] = eval_expression(tree,aos+v*ntabs));
+  ttime = seconds_since(&beg);
+
+  clock_gettime(CLOCK_MONOTONIC,&beg);
+  csum = 0;
+  for (v = 0; v < nvec; v += EVAL_BATCH)
+    { res = eval_code(code,clen,soa+v*ntabs,EVAL_BATCH,stack,scratch);
+      for (b = 0; b < EVAL_BATCH; b++)
+        csum += (cres[v+b] = res[b]);
+    }
+  ctime = seconds_since(&beg);
+
+  bad = 0;
+  for (v = 0; v < nvec; v++)
+    if (tres[v] != cres[v])
+      bad += 1;
+
+  printf("\n  %d vectors over %d tables, %d instructions\n\n",nvec,ntabs,clen);
+  printf("    Tree:      %7.2f ns/vector (sum %lld)\n",1e9*ttime/nvec,tsum);
+  printf("    Byte code: %7.2f ns/vector (sum %lld)\n",1e9*ctime/nvec,csum);
+  printf("    Speedup:   %7.2fx\n",ttime/ctime);
+  if (bad > 0)
+    printf("\n    %d results disagree!\n",bad);
+  printf("\n");
+
+  free(scratch);
+  free(stack);
+  free(cres);
+  free(tres);
+  free(soa);
+  free(aos);
+  free(code);
+  free_tree(tree);
+}
+
+#endif
+
 /****************************************************************************************
  *
  *  Main
@@ -1081,6 +1488,15 @@ int main(int argc, char *argv[])
         argv[j++] = argv[i];
     argc = j;
 
+#ifdef BENCH_EVAL
+    if (argc != 4)
+      { fprintf(stderr,"\nUsage: %s <expr> <ntabs:int> <nvec:int>\n",Prog_Name);
+        exit (1);
+      }
+    bench_eval(argv[1],atoi(argv[2]),atoi(argv[3]));
+    exit (0);
+#endif
+
     if (argc < 2)
       { fprintf(stderr,"\nUsage: %s %s\n",Prog_Name,Usage[0]);
         fprintf(stderr,"       %*s %s\n",(int) strlen(Prog_Name),"",Usage[1]);
@@ -1112,13 +1528,15 @@ int main(int argc, char *argv[])
         exit (1);
       }
 
-    A = Malloc(sizeof(Kmer_Stream *)*nass,"Allocating assignment pointers");
+    Nword = (narg+63) >> 6;
+
+    A = Malloc(sizeof(Assignment *)*nass,"Allocating assignment pointers");
     S = Malloc(sizeof(Kmer_Stream *)*narg,"Allocating table pointers");
     if (A == NULL || S == NULL)
       exit (1);
 
     for (c = 1; c <= nass; c++)
-      { Assignment *a = parse_assignment(argv[c],narg);
+      { Assignment *a = parse_assignment(argv[c]);
         if (a == NULL)
           exit (1);
         if (DO_TABLE)
@@ -1166,24 +1584,26 @@ int main(int argc, char *argv[])
       }
   }
 
-  { int c, varg;
-
-    varg = 0;
-    for (c = 0; c < nass; c++) 
-      varg |= A[c]->varg;
+  { int c;
 
-    if (varg >= (1 << narg))
+    for (c = narg; c < MAX_TABS; c++)
+      if (Used[c])
+        break;
+    if (c < MAX_TABS)
       { if (nass == 1)
           fprintf(stderr,"%s: Expression refers to tables not given\n",Prog_Name);
         else
           fprintf(stderr,"%s: Expressions refer to tables not given\n",Prog_Name);
         exit (1);
       }
-    if (varg < (1 << (narg-1)))
+    if ( ! Used[narg-1])
       { fprintf(stderr,"%s: There are tables not referred to by an expression\n",Prog_Name);
         exit (1);
       }
-    if (varg != (1 << narg)-1)
+    for (c = 0; c < narg; c++)
+      if ( ! Used[c])
+        break;
+    if (c < narg)
       { if (nass == 1)
           fprintf(stderr,"%s: Expression does not refer ta all the tables\n",Prog_Name);
         else
@@ -1205,18 +1625,15 @@ int main(int argc, char *argv[])
     for (t = 1; t < NTHREADS; t++)
       { p = (S[0]->nels*t)/NTHREADS; 
         GoTo_Kmer_Index(S[0],p);
-        printf(" %lld: %s\n",p,Current_Kmer(S[0]));
         range[t][0] = p;
         for (a = 1; a < narg; a++)
           { GoTo_Kmer_String(S[a],S[0]->celm);
-            printf(" %lld: %s\n",S[a]->cidx,Current_Kmer(S[a]));
             range[t][a] = S[a]->cidx;
           }
       }
 
     for (t = 0; t < NTHREADS; t++)
       { parm[t].tid  = t;
-        parm[t].arg  = argv+nass;
         parm[t].S    = S;
         parm[t].narg = narg;
         parm[t].A    = A;
@@ -1246,17 +1663,17 @@ int main(int argc, char *argv[])
               { histt = parm[t].hist[i];
                 for (a = HIST_LOW; a <= HIST_HGH; a++)
                   histi[a] += histt[a];
-                free(histt);
+                free(histt+HIST_LOW);
               }
 
             f = fopen(Catenate(A[i]->path,"/",A[i]->root,".hist"),"w");
             fwrite(&(S[0]->kmer),sizeof(int),1,f);
             fwrite(&HIST_LOW,sizeof(int),1,f);
             fwrite(&HIST_HGH,sizeof(int),1,f);
-            fwrite(histi,sizeof(int64),(HIST_HGH-HIST_LOW)+1,f);
+            fwrite(histi+HIST_LOW,sizeof(int64),(HIST_HGH-HIST_LOW)+1,f);
             fclose(f);
 
-            free(histi);
+            free(histi+HIST_LOW);
           }
 
         for (t = 0; t < NTHREADS; t++)
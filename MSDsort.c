@@ -189,8 +189,23 @@ static inline void invert_kmers(uint8 *array, int64 asize, Range *rng)
   for (k = KMER_BYTES; k < asize; k += RSIZE)
     *((uint16 *) (array + k)) = cnt;
 
-  for (k = RSIZE-1; k < asize; k += RSIZE)
-    khist[array[k]] += 1;
+  if (PRO_SELECT)                     //  k-mers with an index of all 1's are not profiled
+    { int i;
+
+      for (k = RSIZE-1; k < asize; k += RSIZE)
+        { if (array[k] == 0xff)
+            { for (i = k-1; i > k-KMAX_BYTES; i--)
+                if (array[i] != 0xff)
+                  break;
+              if (i <= k-KMAX_BYTES)
+                continue;
+            }
+          khist[array[k]] += 1;
+        }
+    }
+  else
+    for (k = RSIZE-1; k < asize; k += RSIZE)
+      khist[array[k]] += 1;
 
   *array = 1;
 }
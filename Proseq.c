@@ -0,0 +1,432 @@
+/*********************************************************************************************\
+ *
+ *  Produce the k-mer count profiles of the sequences in a FASTA or FASTQ file with respect
+ *    to an existing k-mer table, in the .prof format produced by FastK -p
+ *
+ *********************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#undef DEBUG_THREADS
+
+#include "libfastk.h"
+
+static char *Usage = "[-T<int(4)>] [-N<path_name>] <source_root>[.ktab] <seqs:fast[aq]|->";
+
+#define BLOCK_BASES 0x1000000   //  Read this many bases (or a bit more) per block
+
+static int NTHREADS;
+
+/****************************************************************************************
+ *
+ *  Read the sequences of a FASTA file, or of a 4-line per entry FASTQ file, a block of
+ *    about BLOCK_BASES bases at a time
+ *
+ *****************************************************************************************/
+
+typedef struct
+  { FILE   *in;
+    int     fastq;   //  Input is FASTQ
+    char   *line;    //  The current line (a header) and its length, or -1 at the end
+    size_t  lmax;
+    int64   len;
+  } Parser;
+
+typedef struct
+  { int64  nseq;     //  # of sequences in the block
+    int64  nbase;    //  total # of bases in the block
+    char  *bases;    //  bases[0..nbase) holds the sequences one after the other,
+    int64  bmax;
+    int64 *boff;     //    sequence i at bases[boff[i]..boff[i+1])
+    int64  smax;
+  } Block;
+
+static void trim_line(Parser *P)
+{ while (P->len > 0 && (P->line[P->len-1] == '\n' || P->line[P->len-1] == '\r'))
+    P->len -= 1;
+  P->line[P->len] = '\0';
+}
+
+static void next_line(Parser *P)
+{ P->len = getline(&P->line,&P->lmax,P->in);
+  if (P->len >= 0)
+    trim_line(P);
+}
+
+static void add_bases(Block *B, char *seq, int64 len)
+{ if (B->nbase + len > B->bmax)
+    { B->bmax  = 1.2*(B->nbase+len) + BLOCK_BASES;
+      B->bases = Realloc(B->bases,B->bmax,"Reallocating sequence block");
+      if (B->bases == NULL)
+        exit (1);
+    }
+  memcpy(B->bases+B->nbase,seq,len);
+  B->nbase += len;
+}
+
+  //  Fill B with the next block of sequences, returning 0 if there are none
+
+static int next_block(Parser *P, Block *B)
+{ B->nseq  = 0;
+  B->nbase = 0;
+  B->boff[0] = 0;
+  while (P->len >= 0 && B->nbase < BLOCK_BASES)
+    { if (P->line[0] != (P->fastq ? '@' : '>'))
+        { fprintf(stderr,"%s: Expecting a %s header, not '%.20s'\n",
+                         Prog_Name,P->fastq?"FASTQ":"FASTA",P->line);
+          exit (1);
+        }
+
+      if (P->fastq)
+        { next_line(P);
+          if (P->len < 0)
+            break;
+          add_bases(B,P->line,P->len);
+          next_line(P);
+          if (P->len < 0 || P->line[0] != '+')
+            { fprintf(stderr,"%s: FASTQ entry is not 4 lines\n",Prog_Name);
+              exit (1);
+            }
+          next_line(P);
+          next_line(P);
+        }
+      else
+        for (next_line(P); P->len >= 0 && P->line[0] != '>'; next_line(P))
+          add_bases(B,P->line,P->len);
+
+      if (B->nseq+1 >= B->smax)
+        { B->smax = 1.2*B->nseq + 1024;
+          B->boff = Realloc(B->boff,(B->smax+1)*sizeof(int64),"Reallocating sequence block");
+          if (B->boff == NULL)
+            exit (1);
+        }
+      B->nseq += 1;
+      B->boff[B->nseq] = B->nbase;
+    }
+  return (B->nseq > 0);
+}
+
+/****************************************************************************************
+ *
+ *  Each thread profiles a contiguous range of the sequences of a block and compresses
+ *    the profiles into its own buffer in the encoding of the .prof files
+ *
+ *****************************************************************************************/
+
+typedef struct
+  { Kmer_Table *T;
+    Block      *B;
+    int64       beg, end;   //  Profile sequences [beg,end) of B
+    uint16     *prof;       //  Profile buffer
+    int64       pmax;
+    uint8      *obuf;       //  Compressed profiles are placed in obuf[0..olen)
+    int64       olen;
+    int64       omax;
+    int64      *ends;       //  ends[i-beg] = end offset in obuf of the profile of sequence i
+    int64       emax;
+  } TP;
+
+  //  Compress prof[0..n) into o as a first count followed by 1st differences and runs
+  //    of no change, exactly as in the merge of profile fragments by FastK
+
+static int64 compress_profile(uint16 *prof, int64 n, uint8 *o)
+{ uint8  *s = o;
+  uint16  d, x;
+  int64   i;
+  int     run;
+
+  if (n == 0)
+    return (0);
+
+  d = prof[0];
+  if (d < 128)
+    *o++ = d;
+  else
+    { *o++ = (d >> 8) | 0x80;
+      *o++ = d & 0xff;
+    }
+
+  run = 0;
+  for (i = 1; i < n; i++)
+    { x = prof[i] - d;
+      if (x == 0)
+        { if (++run == 0x3f)
+            { *o++ = run;
+              run  = 0;
+            }
+          continue;
+        }
+      if (run > 0)
+        { *o++ = run;
+          run  = 0;
+        }
+      if (x > 0xffe1 || x < 32)
+        *o++ = 0x40 | (x & 0x3f);
+      else
+        { *o++ = ((x >> 8) & 0x7f) | 0x80;
+          *o++ = x & 0xff;
+        }
+      d = prof[i];
+    }
+  if (run > 0)
+    *o++ = run;
+
+  return (o-s);
+}
+
+static void *profile_thread(void *args)
+{ TP    *parm = (TP *) args;
+  Block *B    = parm->B;
+  int64  i, len, n;
+
+  if (parm->end - parm->beg > parm->emax)
+    { parm->emax = 1.2*(parm->end-parm->beg) + 1024;
+      parm->ends = Realloc(parm->ends,parm->emax*sizeof(int64),"Reallocating profile buffer");
+      if (parm->ends == NULL)
+        exit (1);
+    }
+
+  parm->olen = 0;
+  for (i = parm->beg; i < parm->end; i++)
+    { len = B->boff[i+1] - B->boff[i];
+      if (len > parm->pmax)
+        { parm->pmax = 1.2*len + 1024;
+          parm->prof = Realloc(parm->prof,parm->pmax*sizeof(uint16),
+                               "Reallocating profile buffer");
+          if (parm->prof == NULL)
+            exit (1);
+        }
+      if (parm->olen + 2*len + 2 > parm->omax)
+        { parm->omax = 1.2*(parm->olen + 2*len + 2) + BLOCK_BASES;
+          parm->obuf = Realloc(parm->obuf,parm->omax,"Reallocating profile buffer");
+          if (parm->obuf == NULL)
+            exit (1);
+        }
+
+      n = Profile_Sequence(parm->T,B->bases+B->boff[i],len,parm->prof);
+      parm->olen += compress_profile(parm->prof,n,parm->obuf+parm->olen);
+      parm->ends[i-parm->beg] = parm->olen;
+    }
+
+  return (NULL);
+}
+
+
+/****************************************************************************************
+ *
+ *  Main
+ *
+ *****************************************************************************************/
+
+int main(int argc, char *argv[])
+{ Kmer_Table *T;
+  char       *OUT_NAME;
+  char       *dir, *root;
+
+  { int    i, j, k;
+    int    flags[128];
+    char  *eptr;
+
+    (void) flags;
+
+    ARG_INIT("Proseq");
+
+    NTHREADS = 4;
+    OUT_NAME = NULL;
+
+    j = 1;
+    for (i = 1; i < argc; i++)
+      if (argv[i][0] == '-' && argv[i][1] != '\0')
+        switch (argv[i][1])
+        { default:
+            ARG_FLAGS("")
+            break;
+          case 'N':
+            OUT_NAME = argv[i]+2;
+            break;
+          case 'T':
+            ARG_POSITIVE(NTHREADS,"Number of threads")
+            break;
+        }
+      else
+        argv[j++] = argv[i];
+    argc = j;
+
+    if (argc != 3)
+      { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage);
+        fprintf(stderr,"\n");
+        fprintf(stderr,"      -N: Use given path for output directory and root name prefix.\n");
+        fprintf(stderr,"      -T: Use -T threads.\n");
+        exit (1);
+      }
+
+    if (OUT_NAME == NULL)
+      { if (strcmp(argv[2],"-") == 0)
+          { fprintf(stderr,"%s: -N must be given when reading the standard input\n",Prog_Name);
+            exit (1);
+          }
+        dir  = PathTo(argv[2]);
+        root = Root(argv[2],NULL);
+      }
+    else
+      { dir  = PathTo(OUT_NAME);
+        root = Root(OUT_NAME,".prof");
+      }
+  }
+
+  T = Load_Kmer_Table(argv[1],1);
+  if (T == NULL)
+    { fprintf(stderr,"%s: Cannot open %s\n",Prog_Name,argv[1]);
+      exit (1);
+    }
+
+  //  Build the search accelerator of T before the threads share it
+
+  Find_Kmers(T,0,NULL,NULL);
+
+  { Parser    P;
+    Block     B;
+    TP        parm[NTHREADS];
+#ifndef DEBUG_THREADS
+    pthread_t threads[NTHREADS];
+#endif
+    char     *fname;
+    int       f, g, t;
+    int64     nreads, offset, zero;
+    int64     i, s, h;
+
+    if (strcmp(argv[2],"-") == 0)
+      P.in = stdin;
+    else
+      { P.in = fopen(argv[2],"r");
+        if (P.in == NULL)
+          { fprintf(stderr,"%s: Cannot open %s\n",Prog_Name,argv[2]);
+            exit (1);
+          }
+      }
+    P.line = NULL;
+    P.lmax = 0;
+    next_line(&P);
+    P.fastq = (P.len > 0 && P.line[0] == '@');
+
+    B.bmax  = BLOCK_BASES + 1024;
+    B.smax  = 1024;
+    B.bases = Malloc(B.bmax,"Allocating sequence block");
+    B.boff  = Malloc((B.smax+1)*sizeof(int64),"Allocating sequence block");
+    if (B.bases == NULL || B.boff == NULL)
+      exit (1);
+
+    for (t = 0; t < NTHREADS; t++)
+      { parm[t].T    = T;
+        parm[t].B    = &B;
+        parm[t].pmax = 0;
+        parm[t].prof = NULL;
+        parm[t].omax = 0;
+        parm[t].obuf = NULL;
+        parm[t].emax = 0;
+        parm[t].ends = NULL;
+      }
+
+    //  Write the stub and open the single index and profile part
+
+    fname = Malloc(strlen(dir)+strlen(root)+20,"Allocating file names");
+    if (fname == NULL)
+      exit (1);
+
+    sprintf(fname,"%s/%s.prof",dir,root);
+    f = open(fname,O_WRONLY|O_CREAT|O_TRUNC,S_IRWXU|S_IRWXG|S_IRWXO);
+    if (f == -1)
+      { fprintf(stderr,"%s: Cannot open %s for writing\n",Prog_Name,fname);
+        exit (1);
+      }
+    t = 1;
+    write(f,&(T->kmer),sizeof(int));
+    write(f,&t,sizeof(int));
+    close(f);
+
+    sprintf(fname,"%s/.%s.pidx.1",dir,root);
+    f = open(fname,O_WRONLY|O_CREAT|O_TRUNC,S_IRWXU|S_IRWXG|S_IRWXO);
+    sprintf(fname,"%s/.%s.prof.1",dir,root);
+    g = open(fname,O_WRONLY|O_CREAT|O_TRUNC,S_IRWXU|S_IRWXG|S_IRWXO);
+    if (f == -1 || g == -1)
+      { fprintf(stderr,"%s: Cannot open the hidden files of %s/%s.prof for writing\n",
+                       Prog_Name,dir,root);
+        exit (1);
+      }
+    zero = 0;
+    write(f,&(T->kmer),sizeof(int));
+    write(f,&zero,sizeof(int64));
+    write(f,&zero,sizeof(int64));
+
+    //  For each block, split its sequences into NTHREADS ranges of about equal numbers
+    //    of bases, profile them in parallel, and append the results in order
+
+    nreads = 0;
+    offset = 0;
+    while (next_block(&P,&B))
+      { s = 0;
+        for (t = 0; t < NTHREADS; t++)
+          { h = (B.nbase*(t+1))/NTHREADS;
+            parm[t].beg = s;
+            while (s < B.nseq && (t == NTHREADS-1 || B.boff[s+1] <= h))
+              s += 1;
+            parm[t].end = s;
+          }
+
+#ifdef DEBUG_THREADS
+        for (t = 0; t < NTHREADS; t++)
+          profile_thread(parm+t);
+#else
+        for (t = 1; t < NTHREADS; t++)
+          pthread_create(threads+t,NULL,profile_thread,parm+t);
+        profile_thread(parm);
+        for (t = 1; t < NTHREADS; t++)
+          pthread_join(threads[t],NULL);
+#endif
+
+        for (t = 0; t < NTHREADS; t++)
+          { s = parm[t].end - parm[t].beg;
+            for (i = 0; i < s; i++)
+              parm[t].ends[i] += offset;
+            write(f,parm[t].ends,s*sizeof(int64));
+            write(g,parm[t].obuf,parm[t].olen);
+            offset += parm[t].olen;
+          }
+        nreads += B.nseq;
+      }
+
+    lseek(f,sizeof(int)+sizeof(int64),SEEK_SET);
+    write(f,&nreads,sizeof(int64));
+    close(f);
+    close(g);
+
+    for (t = 0; t < NTHREADS; t++)
+      { free(parm[t].ends);
+        free(parm[t].obuf);
+        free(parm[t].prof);
+      }
+    free(B.boff);
+    free(B.bases);
+    free(P.line);
+    free(fname);
+    if (P.in != stdin)
+      fclose(P.in);
+  }
+
+  free(root);
+  free(dir);
+  Free_Kmer_Table(T);
+
+  Catenate(NULL,NULL,NULL,NULL);
+  Numbered_Suffix(NULL,0,NULL);
+  free(Prog_Name);
+
+  exit (0);
+}
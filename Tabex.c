@@ -16,7 +16,308 @@
 
 #include "libfastk.h"
 
-static char *Usage = "[-t<int>] <source_root>[.ktab] (LIST|CHECK|(k-mer:string>) ...";
+static char *Usage[] = { "[-m[p]] [-t<int>] [-h] [-T<int(4)>] [-q<query:file>] [-b]",
+                         "  <source_root>[.ktab] (LIST|CHECK|(k-mer:string>) ..."
+                       };
+
+/****************************************************************************************
+ *
+ *  Bulk queries.  The k-mers of a file, one per line, or all the k-mers of the sequences of
+ *    a FASTA file, are packed QUERY_BLOCK at a time and then looked up with
+ *    Query_Packed_Kmers, which sorts them and searches them with NTHREADS threads.  The
+ *    counts are reported in input order as text or as binary 16-bit counts (0 if absent).
+ *
+ *****************************************************************************************/
+
+#define QUERY_BLOCK 0x100000
+
+static int NTHREADS;
+static int BINARY;
+
+static int Code[256];
+
+static void setup_code_table()
+{ int i;
+
+  for (i = 0; i < 256; i++)
+    Code[i] = -1;
+  Code['a'] = Code['A'] = 0;
+  Code['c'] = Code['C'] = 1;
+  Code['g'] = Code['G'] = 2;
+  Code['t'] = Code['T'] = 3;
+}
+
+  //  Shift base c (0-3) onto the right end of the packed k-mer f
+
+static inline void roll_kmer(uint8 *f, int kmer, int kbyte, int c)
+{ int i;
+
+  for (i = 0; i < kbyte-1; i++)
+    f[i] = (uint8) ((f[i] << 2) | (f[i+1] >> 6));
+  f[kbyte-1] <<= 2;
+  f[(kmer-1) >> 2] |= (uint8) (c << (6 - 2*((kmer-1) & 0x3)));
+}
+
+static inline int count_of(Kmer_Table *T, int64 idx)
+{ if (idx < 0)
+    return (0);
+  return (Fetch_Count(T,idx));
+}
+
+  //  Is every symbol of the string s one of a, c, g, or t (of either case)?
+
+static int is_acgt(char *s)
+{ for ( ; *s != '\0'; s++)
+    if (Code[(uint8) *s] < 0)
+      return (0);
+  return (1);
+}
+
+  //  Report the count of the k-mer on each line.  As for the command line, a line of the wrong
+  //    length is not a k-mer, and a k-mer with a symbol other than a, c, g, or t is not found.
+
+#define NOT_KMER   0
+#define NON_ACGT   1
+#define ACGT_KMER  2
+
+static void query_lines(Kmer_Table *T, FILE *in, char *line, int64 len, size_t *lmax)
+{ int    kmer  = T->kmer;
+  int    kbyte = T->kbyte;
+  uint8  *kmers, *ok;
+  int64  *idx;
+  uint16 *cnt;
+  char   *text;
+  int64  *toff;
+  int64   tmax, n, i;
+  int     j, x;
+
+  kmers = Malloc(QUERY_BLOCK*kbyte,"Allocating query block");
+  ok    = Malloc(QUERY_BLOCK,"Allocating query block");
+  idx   = Malloc(QUERY_BLOCK*sizeof(int64),"Allocating query block");
+  cnt   = Malloc(QUERY_BLOCK*sizeof(uint16),"Allocating query block");
+  toff  = Malloc((QUERY_BLOCK+1)*sizeof(int64),"Allocating query block");
+  tmax  = QUERY_BLOCK*(kmer+1);
+  text  = Malloc(tmax,"Allocating query block");
+  if (kmers == NULL || ok == NULL || idx == NULL || cnt == NULL || toff == NULL || text == NULL)
+    exit (1);
+
+  n = 0;
+  toff[0] = 0;
+  while (len >= 0)
+    { while (len > 0 && isspace(line[len-1]))
+        len -= 1;
+      line[len] = '\0';
+
+      if (len > 0)
+        { uint8 *f = kmers + n*kbyte;
+
+          bzero(f,kbyte);
+          ok[n] = NOT_KMER;
+          if (len == kmer)
+            { for (j = 0; j < kmer; j++)
+                { x = Code[(uint8) line[j]];
+                  if (x < 0)
+                    break;
+                  roll_kmer(f,kmer,kbyte,x);
+                }
+              ok[n] = (j >= kmer ? ACGT_KMER : NON_ACGT);
+            }
+
+          if (toff[n] + len + 1 > tmax)
+            { tmax = 1.2*(toff[n]+len+1) + QUERY_BLOCK;
+              text = Realloc(text,tmax,"Reallocating query block");
+              if (text == NULL)
+                exit (1);
+            }
+          memcpy(text+toff[n],line,len+1);
+          toff[n+1] = toff[n] + (len+1);
+          n += 1;
+        }
+
+      len = getline(&line,lmax,in);
+
+      if (n >= QUERY_BLOCK || (len < 0 && n > 0))
+        { Query_Packed_Kmers(T,n,kmers,idx,NTHREADS);
+
+          if (BINARY)
+            { for (i = 0; i < n; i++)
+                cnt[i] = (ok[i] == ACGT_KMER ? count_of(T,idx[i]) : 0);
+              fwrite(cnt,sizeof(uint16),n,stdout);
+            }
+          else
+            for (i = 0; i < n; i++)
+              if (ok[i] == NOT_KMER)
+                printf("%*s: Not a %d-mer\n",kmer,text+toff[i],kmer);
+              else if (ok[i] == NON_ACGT || idx[i] < 0)
+                printf("%*s: Not found\n",kmer,text+toff[i]);
+              else
+                printf("%*s: %5d\n",kmer,text+toff[i],Fetch_Count(T,idx[i]));
+          n = 0;
+        }
+    }
+
+  free(line);
+  free(text);
+  free(toff);
+  free(cnt);
+  free(idx);
+  free(ok);
+  free(kmers);
+}
+
+  //  Report the counts of the k-mers of seq[0..slen) with FASTA header name, where the
+  //    count of a k-mer containing a non-ACGT symbol is 0
+
+static void query_sequence(Kmer_Table *T, char *name, char *seq, int64 slen, uint8 *kmers,
+                           uint8 *ok, int64 *idx, uint16 *cnt)
+{ int    kmer  = T->kmer;
+  int    kbyte = T->kbyte;
+  uint8  f[kbyte];
+  int64  nk, b, i, n, bad;
+  int    x;
+
+  nk = slen - (kmer-1);
+  if (nk < 0)
+    nk = 0;
+
+  if (BINARY)
+    fwrite(&nk,sizeof(int64),1,stdout);
+  else
+    printf("\n%s:\n",name);
+
+  //  bad is the position of the last non-ACGT symbol seen, which is rolled in as an a, so
+  //    the k-mer starting at p is valid only if bad < p
+
+  bad = -1;
+  bzero(f,kbyte);
+  for (i = 0; i < kmer-1 && i < slen; i++)
+    { x = Code[(uint8) seq[i]];
+      if (x < 0)
+        { bad = i;
+          x   = 0;
+        }
+      roll_kmer(f,kmer,kbyte,x);
+    }
+
+  for (b = 0; b < nk; b += n)
+    { n = nk-b;
+      if (n > QUERY_BLOCK)
+        n = QUERY_BLOCK;
+      for (i = 0; i < n; i++)
+        { x = Code[(uint8) seq[b+i+(kmer-1)]];
+          if (x < 0)
+            { bad = b+i+(kmer-1);
+              x   = 0;
+            }
+          roll_kmer(f,kmer,kbyte,x);
+          memcpy(kmers+i*kbyte,f,kbyte);
+          ok[i] = (bad < b+i);
+        }
+      Query_Packed_Kmers(T,n,kmers,idx,NTHREADS);
+      for (i = 0; i < n; i++)
+        if (!ok[i])
+          idx[i] = -1;
+
+      if (BINARY)
+        { for (i = 0; i < n; i++)
+            cnt[i] = count_of(T,idx[i]);
+          fwrite(cnt,sizeof(uint16),n,stdout);
+        }
+      else
+        for (i = 0; i < n; i++)
+          printf(" %5lld: %5d\n",b+i,count_of(T,idx[i]));
+    }
+}
+
+static void query_fasta(Kmer_Table *T, FILE *in, char *line, int64 len, size_t *lmax)
+{ int     kbyte = T->kbyte;
+  uint8  *kmers, *ok;
+  int64  *idx;
+  uint16 *cnt;
+  char   *name, *seq;
+  int64   smax, slen;
+
+  kmers = Malloc(QUERY_BLOCK*kbyte,"Allocating query block");
+  ok    = Malloc(QUERY_BLOCK,"Allocating query block");
+  idx   = Malloc(QUERY_BLOCK*sizeof(int64),"Allocating query block");
+  cnt   = Malloc(QUERY_BLOCK*sizeof(uint16),"Allocating query block");
+  smax  = QUERY_BLOCK;
+  seq   = Malloc(smax,"Allocating sequence buffer");
+  if (kmers == NULL || ok == NULL || idx == NULL || cnt == NULL || seq == NULL)
+    exit (1);
+
+  name = NULL;
+  slen = 0;
+  while (len >= 0)
+    { while (len > 0 && isspace(line[len-1]))
+        len -= 1;
+      line[len] = '\0';
+
+      if (line[0] == '>')
+        { if (name != NULL)
+            { query_sequence(T,name,seq,slen,kmers,ok,idx,cnt);
+              free(name);
+            }
+          name = Strdup(line+1,"Allocating header");
+          if (name == NULL)
+            exit (1);
+          slen = 0;
+        }
+      else if (name != NULL)
+        { if (slen + len > smax)
+            { smax = 1.2*(slen+len) + QUERY_BLOCK;
+              seq  = Realloc(seq,smax,"Reallocating sequence buffer");
+              if (seq == NULL)
+                exit (1);
+            }
+          memcpy(seq+slen,line,len);
+          slen += len;
+        }
+
+      len = getline(&line,lmax,in);
+    }
+  if (name != NULL)
+    { query_sequence(T,name,seq,slen,kmers,ok,idx,cnt);
+      free(name);
+    }
+
+  free(line);
+  free(seq);
+  free(cnt);
+  free(idx);
+  free(ok);
+  free(kmers);
+}
+
+static void query_file(Kmer_Table *T, char *path)
+{ FILE  *in;
+  char  *line;
+  int64  len;
+  size_t lmax;
+
+  if (strcmp(path,"-") == 0)
+    in = stdin;
+  else
+    { in = fopen(path,"r");
+      if (in == NULL)
+        { fprintf(stderr,"%s: Cannot open query file %s\n",Prog_Name,path);
+          exit (1);
+        }
+    }
+
+  //  The file is FASTA if its first line is a header, otherwise a list of k-mers
+
+  line = NULL;
+  lmax = 0;
+  len  = getline(&line,&lmax,in);
+  if (len > 0 && line[0] == '>')
+    query_fasta(T,in,line,len,&lmax);
+  else
+    query_lines(T,in,line,len,&lmax);
+
+  if (in != stdin)
+    fclose(in);
+}
 
 /****************************************************************************************
  *
@@ -26,52 +327,141 @@ static char *Usage = "[-t<int>] <source_root>[.ktab] (LIST|CHECK|(k-mer:string>)
 
 int main(int argc, char *argv[])
 { Kmer_Table *T;
+  Kmer_Hash  *H;
   int         CUT;
+  int         MAP, POPULATE;
+  int         HASH;
+  char       *QUERY;
 
   { int    i, j, k;
     int    flags[128];
     char  *eptr;
 
-    (void) flags;
-
     ARG_INIT("Tabex");
 
-    CUT = 1;
+    CUT      = 1;
+    NTHREADS = 4;
+    QUERY    = NULL;
 
     j = 1;
     for (i = 1; i < argc; i++)
       if (argv[i][0] == '-')
         switch (argv[i][1])
         { default:
-            ARG_FLAGS("")
+            ARG_FLAGS("mphb")
             break;
           case 't':
             ARG_POSITIVE(CUT,"Cutoff for k-mer table")
             break;
+          case 'T':
+            ARG_POSITIVE(NTHREADS,"Number of threads")
+            break;
+          case 'q':
+            QUERY = argv[i]+2;
+            break;
         }
       else
         argv[j++] = argv[i];
     argc = j;
 
-    if (argc < 3)
-      { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage);
+    POPULATE = flags['p'];
+    MAP      = flags['m'] || POPULATE;
+    HASH     = flags['h'];
+    BINARY   = flags['b'];
+
+    if (argc < 3 && (argc < 2 || QUERY == NULL))
+      { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage[0]);
+        fprintf(stderr,"       %*s %s\n",(int) strlen(Prog_Name),"",Usage[1]);
+        fprintf(stderr,"\n");
+        fprintf(stderr,"      -t: Trim table to k-mers with counts >= level specified\n");
+        fprintf(stderr,"      -m: Map a single part, uncompressed table into memory rather than\n");
+        fprintf(stderr,"            loading it (e.g. after Tabpart <table> 1 and Tabzip -u)\n");
+        fprintf(stderr,"      -p: Fault all of a mapped table into memory immediately\n");
+        fprintf(stderr,"      -h: Look up k-mers with a perfect hash, building it if not present\n");
+        fprintf(stderr,"      -T: Use -T threads to build a hash or look up queries\n");
+        fprintf(stderr,"      -q: Look up the k-mers, or those of the FASTA sequences, in the file\n");
+        fprintf(stderr,"            (- for the standard input)\n");
+        fprintf(stderr,"      -b: Output the counts of -q queries in binary\n");
+        exit (1);
+      }
+    if (QUERY != NULL && *QUERY == '\0')
+      { fprintf(stderr,"%s: -q requires a file name or - for the standard input\n",Prog_Name);
+        exit (1);
+      }
+    if (QUERY != NULL && HASH)
+      { fprintf(stderr,"%s: Queries from a file (-q) cannot be hashed (-h)\n",Prog_Name);
+        exit (1);
+      }
+    if (MAP && CUT > 1)
+      { fprintf(stderr,"%s: A mapped table cannot be trimmed (-t)\n",Prog_Name);
+        exit (1);
+      }
+    if (HASH && CUT > 1)
+      { fprintf(stderr,"%s: A hashed table cannot be trimmed (-t)\n",Prog_Name);
         exit (1);
       }
   }
 
-  T = Load_Kmer_Table(argv[1],CUT);
+  if (MAP)
+    T = Map_Kmer_Table(argv[1],POPULATE);
+  else
+    T = Load_Kmer_Table(argv[1],CUT);
   if (T == NULL)
     { fprintf(stderr,"%s: Cannot open %s\n",Prog_Name,argv[1]);
       exit (1);
     } 
 
+  //  Map_Kmer_Table loads a table of several parts or a compressed table, so say so
+
+  if (MAP && ! T->mapped)
+    { fprintf(stderr,"%s: Warning: %s is in several parts or compressed, so it was loaded\n",
+                     Prog_Name,argv[1]);
+      fprintf(stderr,"%*s  rather than mapped.  To map it, first run \"Tabpart %s 1\"\n",
+                     (int) strlen(Prog_Name),"",argv[1]);
+      fprintf(stderr,"%*s  (and \"Tabzip -u %s\" if it is compressed).\n",
+                     (int) strlen(Prog_Name),"",argv[1]);
+    }
+
   fprintf(stderr,"Loaded %d-mer table with ",T->kmer);
   Print_Number(T->nels,0,stderr);
   fprintf(stderr," entries\n");
   fflush(stderr);
 
-  { int c, cnt;
+  setup_code_table();
+
+  { int    c, n;
+    char **kseqs;
+    int64 *idx;
+
+    //  Look up all the k-mer arguments in one batch, then report in argument order
+
+    kseqs = Malloc(sizeof(char *)*argc,"Allocating query list");
+    idx   = Malloc(sizeof(int64)*argc,"Allocating query list");
+    if (kseqs == NULL || idx == NULL)
+      exit (1);
+
+    n = 0;
+    for (c = 2; c < argc; c++)
+      if (strcmp(argv[c],"LIST") != 0 && strcmp(argv[c],"CHECK") != 0
+                                      && (int) strlen(argv[c]) == T->kmer && is_acgt(argv[c]))
+        kseqs[n++] = argv[c];
+    if (HASH)
+      { H = Load_Kmer_Hash(T,argv[1]);
+        if (H == NULL)
+          { H = Make_Kmer_Hash(T,NTHREADS);
+            if (Write_Kmer_Hash(H,argv[1]))
+              fprintf(stderr,"%s: Warning: could not save the hash for %s\n",Prog_Name,argv[1]);
+            else
+              fprintf(stderr,"Built and saved a perfect hash for the table\n");
+          }
+        for (c = 0; c < n; c++)
+          idx[c] = Hash_Kmer(H,kseqs[c]);
+        Free_Kmer_Hash(H);
+      }
+    else
+      Find_Kmers(T,n,kseqs,idx);
 
+    n = 0;
     for (c = 2; c < argc; c++)
       if (strcmp(argv[c],"LIST") == 0)
         List_Kmer_Table(T,stdout);
@@ -82,16 +472,21 @@ int main(int argc, char *argv[])
       else
         { if ((int) strlen(argv[c]) != T->kmer)
             printf("%*s: Not a %d-mer\n",T->kmer,argv[c],T->kmer);
+          else if (! is_acgt(argv[c]))
+            printf("%*s: Not found\n",T->kmer,argv[c]);
+          else if (idx[n++] < 0)
+            printf("%*s: Not found\n",T->kmer,argv[c]);
           else
-            { cnt = Find_Kmer(T,argv[c]);
-              if (cnt == 0)
-                printf("%*s: Not found\n",T->kmer,argv[c]);
-              else
-                printf("%*s: %5d\n",T->kmer,argv[c],cnt);
-            }
+            printf("%*s: %5d\n",T->kmer,argv[c],Fetch_Count(T,idx[n-1]));
         }
+
+    free(idx);
+    free(kseqs);
   }
 
+  if (QUERY != NULL)
+    query_file(T,QUERY);
+
   Free_Kmer_Table(T);
 
   Catenate(NULL,NULL,NULL,NULL);
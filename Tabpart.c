@@ -0,0 +1,107 @@
+/*********************************************************************************************\
+ *
+ *  Rewrite a k-mer count table produced by FastK as a given number of parts, either of
+ *    equal size or split at given k-mer prefixes
+ *
+ *********************************************************************************************/
+ 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+
+#include "libfastk.h"
+
+static char *Usage = "[-T<int(4)>] <source_root>[.ktab] ( <parts:int> | <prefix:string> ... )";
+
+int main(int argc, char *argv[])
+{ int    NTHREADS;
+  int    NPARTS;
+  char **BOUNDS;
+
+  { int    i, j, k;
+    int    flags[128];
+    char  *eptr;
+
+    ARG_INIT("Tabpart");
+
+    NTHREADS = 4;
+
+    j = 1;
+    for (i = 1; i < argc; i++)
+      if (argv[i][0] == '-')
+        switch (argv[i][1])
+        { default:
+            ARG_FLAGS("")
+            break;
+          case 'T':
+            ARG_POSITIVE(NTHREADS,"Number of threads")
+            break;
+        }
+      else
+        argv[j++] = argv[i];
+    argc = j;
+
+    (void) flags;
+
+    if (argc < 3)
+      { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage);
+        fprintf(stderr,"\n");
+        fprintf(stderr,"      -T: Use -T threads\n");
+        exit (1);
+      }
+  }
+
+  //  A single integer argument gives the number of equal parts, otherwise each argument is
+  //    a prefix at which a new part begins.
+
+  { char *eptr, *s;
+    int   c;
+
+    NPARTS = strtol(argv[2],&eptr,10);
+    if (argc == 3 && *eptr == '\0')
+      { if (NPARTS <= 0)
+          { fprintf(stderr,"%s: Number of parts must be positive\n",Prog_Name);
+            exit (1);
+          }
+        BOUNDS = NULL;
+      }
+    else
+      { NPARTS = argc-1;
+        BOUNDS = argv+2;
+        for (c = 2; c < argc; c++)
+          { for (s = argv[c]; *s != '\0'; s++)
+              { *s = tolower(*s);
+                if (*s != 'a' && *s != 'c' && *s != 'g' && *s != 't')
+                  { fprintf(stderr,"%s: Prefix %s is not a DNA string\n",Prog_Name,argv[c]);
+                    exit (1);
+                  }
+              }
+            if (c > 2 && strcmp(argv[c-1],argv[c]) > 0)
+              { fprintf(stderr,"%s: Prefixes must be given in sorted order\n",Prog_Name);
+                exit (1);
+              }
+          }
+      }
+  }
+
+  { int ret;
+
+    ret = Reshard_Kmer_Table(argv[1],NPARTS,BOUNDS,NTHREADS);
+    if (ret == 1)
+      { fprintf(stderr,"%s: Cannot open %s\n",Prog_Name,argv[1]);
+        exit (1);
+      }
+    if (ret == 2)
+      { fprintf(stderr,"%s: %s has fewer k-mers than %d parts\n",Prog_Name,argv[1],NPARTS);
+        exit (1);
+      }
+  }
+
+  Catenate(NULL,NULL,NULL,NULL);
+  Numbered_Suffix(NULL,0,NULL);
+  free(Prog_Name);
+
+  exit (0);
+}
@@ -0,0 +1,392 @@
+/*********************************************************************************************\
+ *
+ *  Merge any number of k-mer count tables produced by FastK into a single table whose
+ *    counts are the sums of the counts in the inputs, along with its histogram
+ *
+ *********************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <math.h>
+#include <pthread.h>
+
+#undef DEBUG_THREADS
+
+#include "libfastk.h"
+
+static char *Usage = "[-h] [-T<int(4)>] [-t<int(1)>] <target>[.ktab] <source>[.ktab] ...";
+
+#define MAX_COUNT 0x7fff   //  Counts saturate at this value
+
+static int NTHREADS;
+static int CUT;
+static int HSUM;
+
+/****************************************************************************************
+ *
+ *  Each thread merges the entries of the tables in its range [begs[c],ends[c]) of each
+ *    table c, writing those k-mers whose summed count is not less than CUT to its part of
+ *    the target table, and accumulating the histogram of the summed counts of all of them.
+ *
+ *****************************************************************************************/
+
+typedef struct
+  { int           tid;
+    Kmer_Stream **S;      //  The source tables (threads other than 0 open their own copies)
+    int           ntabs;
+    int64        *begs;
+    int64        *ends;
+    char         *part;   //  Name of the target table part to write
+    int64         nels;   //  # of k-mers written
+    int64        *hist;   //  hist[i] = # of k-mer instances with summed count i (as FastK)
+  } TP;
+
+static void *sum_thread(void *args)
+{ TP           *parm  = (TP *) args;
+  int           ntabs = parm->ntabs;
+  Kmer_Stream **T     = parm->S;
+  int64        *hist  = parm->hist;
+
+  int         kbyte = T[0]->kbyte;
+  int         kmer  = T[0]->kmer;
+  Kmer_Merge *M;
+  int64       nels;
+  FILE       *out;
+  int         i, n, v;
+  uint16      x;
+
+#ifdef DEBUG_THREADS
+  printf("Doing %d:",parm->tid);
+  for (i = 0; i < ntabs; i++)
+    printf(" [%lld-%lld]",parm->begs[i],parm->ends[i]);
+  printf("\n");
+#endif
+
+  if (parm->tid != 0)
+    { T = Clone_Kmer_Streams(ntabs,T);
+      if (T == NULL)
+        { fprintf(stderr,"%s: Cannot reopen the source tables\n",Prog_Name);
+          exit (1);
+        }
+    }
+
+  out = fopen(parm->part,"w");
+  if (out == NULL)
+    { fprintf(stderr,"%s: Cannot open %s for writing\n",Prog_Name,parm->part);
+      exit (1);
+    }
+  nels = 0;
+  fwrite(&kmer,sizeof(int),1,out);
+  fwrite(&nels,sizeof(int64),1,out);
+
+  //  Sum the counts of each k-mer over the tables containing it
+
+  M = Open_Kmer_Merge(ntabs,T,parm->begs,parm->ends);
+  while ((n = Next_Kmer_Merge(M)) > 0)
+    { v = 0;
+      for (i = 0; i < n; i++)
+        v += M->cnt[i];
+      if (v > MAX_COUNT)
+        v = MAX_COUNT;
+      hist[v] += v;
+      if (v >= CUT)
+        { x = v;
+          fwrite(M->kmer,kbyte,1,out);
+          fwrite(&x,sizeof(uint16),1,out);
+          nels += 1;
+        }
+    }
+  Free_Kmer_Merge(M);
+
+  rewind(out);
+  fwrite(&kmer,sizeof(int),1,out);
+  fwrite(&nels,sizeof(int64),1,out);
+  fclose(out);
+  parm->nels = nels;
+
+  if (parm->tid != 0)
+    Free_Kmer_Streams(ntabs,T);
+
+  return (NULL);
+}
+
+
+/****************************************************************************************
+ *
+ *  Main
+ *
+ *****************************************************************************************/
+
+int main(int argc, char *argv[])
+{ Kmer_Stream **S;
+  char         *dir, *root;
+  int           ntabs, kmer, minval;
+  int           oparts;
+
+  { int    i, j, k;
+    int    flags[128];
+    char  *eptr;
+
+    ARG_INIT("Tabsum");
+
+    NTHREADS = 4;
+    CUT      = 1;
+
+    j = 1;
+    for (i = 1; i < argc; i++)
+      if (argv[i][0] == '-')
+        switch (argv[i][1])
+        { default:
+            ARG_FLAGS("h")
+            break;
+          case 't':
+            ARG_POSITIVE(CUT,"Cutoff for k-mer table")
+            if (CUT > MAX_COUNT)
+              { fprintf(stderr,"%s: Cutoff %d is more than the largest count %d\n",
+                               Prog_Name,CUT,MAX_COUNT);
+                exit (1);
+              }
+            break;
+          case 'T':
+            ARG_POSITIVE(NTHREADS,"Number of threads")
+            break;
+        }
+      else
+        argv[j++] = argv[i];
+    argc = j;
+
+    HSUM = flags['h'];
+
+    if (argc < 3)
+      { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage);
+        fprintf(stderr,"\n");
+        fprintf(stderr,"      -h: Sum the histograms of the sources (e.g. shards of a FastK run)\n");
+        fprintf(stderr,"      -t: Keep only k-mers whose summed count is >= level specified\n");
+        fprintf(stderr,"      -T: Use -T threads\n");
+        exit (1);
+      }
+  }
+
+  //  Open the source tables and check the target is not one of them
+
+  dir   = PathTo(argv[1]);
+  root  = Root(argv[1],".ktab");
+  ntabs = argc-2;
+
+  S = Malloc(sizeof(Kmer_Stream *)*ntabs,"Allocating table pointers");
+  if (S == NULL)
+    exit (1);
+
+  { char *d, *r;
+    int   c;
+
+    kmer   = 0;
+    minval = MAX_COUNT;
+    for (c = 0; c < ntabs; c++)
+      { S[c] = Open_Kmer_Stream(argv[c+2]);
+        if (S[c] == NULL)
+          { fprintf(stderr,"%s: Cannot open table %s\n",Prog_Name,argv[c+2]);
+            exit (1);
+          }
+        if (c == 0)
+          kmer = S[c]->kmer;
+        else if (S[c]->kmer != kmer)
+          { fprintf(stderr,"%s: K-mer tables do not involve the same K\n",Prog_Name);
+            exit (1);
+          }
+        if (S[c]->minval < minval)
+          minval = S[c]->minval;
+
+        d = PathTo(argv[c+2]);
+        r = Root(argv[c+2],".ktab");
+        if (strcmp(d,dir) == 0 && strcmp(r,root) == 0)
+          { fprintf(stderr,"%s: Target %s is also a source table\n",Prog_Name,argv[1]);
+            exit (1);
+          }
+        free(r);
+        free(d);
+      }
+    if (CUT > minval)
+      minval = CUT;
+  }
+
+  { FILE *f;
+    int   x, yes;
+
+    oparts = 0;
+    f = fopen(Catenate(dir,"/",root,".ktab"),"r");
+    if (f != NULL)
+      { if (fread(&x,sizeof(int),1,f) != 1 || fread(&oparts,sizeof(int),1,f) != 1)
+          oparts = 0;
+        fclose(f);
+        printf("Output table %s already exists, continue? ",Catenate(dir,"/",root,".ktab"));
+        fflush(stdout);
+        yes = 0;
+        while ((x = getc(stdin)) != '\n' && x != EOF)
+          if (x == 'y' || x == 'Y')
+            yes = 1;
+          else if (x == 'n' || x == 'N')
+            yes = 0;
+        if (!yes)
+          exit (1);
+      }
+  }
+
+  //  Partition the k-mers of the largest table into NTHREADS ranges and find the
+  //    corresponding ranges of the other tables, merge each range in a thread writing
+  //    part t+1 of the target, and then sum the threads' histograms
+
+  { int64     range[NTHREADS+1][ntabs];
+    pthread_t threads[NTHREADS];
+    TP        parm[NTHREADS];
+    int64    *hist;
+    FILE     *f;
+    int       t, c, m;
+    int64     p;
+
+    m = 0;
+    for (c = 1; c < ntabs; c++)
+      if (S[c]->nels > S[m]->nels)
+        m = c;
+
+    for (c = 0; c < ntabs; c++)
+      { range[0][c] = 0;
+        range[NTHREADS][c] = S[c]->nels;
+      }
+    for (t = 1; t < NTHREADS; t++)
+      { p = (S[m]->nels*t)/NTHREADS;
+        if (p >= S[m]->nels)
+          { for (c = 0; c < ntabs; c++)
+              range[t][c] = S[c]->nels;
+            continue;
+          }
+        GoTo_Kmer_Index(S[m],p);
+        for (c = 0; c < ntabs; c++)
+          if (c == m)
+            range[t][c] = p;
+          else
+            { GoTo_Kmer_String(S[c],S[m]->celm);
+              range[t][c] = S[c]->cidx;
+            }
+      }
+
+    hist = Malloc(sizeof(int64)*(MAX_COUNT+1)*NTHREADS,"Allocating histograms");
+    if (hist == NULL)
+      exit (1);
+    bzero(hist,sizeof(int64)*(MAX_COUNT+1)*NTHREADS);
+
+    for (t = 0; t < NTHREADS; t++)
+      { parm[t].tid   = t;
+        parm[t].S     = S;
+        parm[t].ntabs = ntabs;
+        parm[t].begs  = range[t];
+        parm[t].ends  = range[t+1];
+        parm[t].hist  = hist + t*(MAX_COUNT+1);
+        parm[t].part  = Strdup(Catenate(dir,"/.",root,Numbered_Suffix(".ktab.",t+1,"")),
+                               "Allocating part name");
+        if (parm[t].part == NULL)
+          exit (1);
+      }
+
+#ifdef DEBUG_THREADS
+    for (t = 0; t < NTHREADS; t++)
+      sum_thread(parm+t);
+#else
+    for (t = 1; t < NTHREADS; t++)
+      pthread_create(threads+t,NULL,sum_thread,parm+t);
+    sum_thread(parm);
+    for (t = 1; t < NTHREADS; t++)
+      pthread_join(threads[t],NULL);
+#endif
+
+    for (t = 0; t < NTHREADS; t++)
+      free(parm[t].part);
+
+    f = fopen(Catenate(dir,"/",root,".ktab"),"w");
+    if (f == NULL)
+      { fprintf(stderr,"%s: Cannot open %s/%s.ktab for writing\n",Prog_Name,dir,root);
+        exit (1);
+      }
+    fwrite(&kmer,sizeof(int),1,f);
+    fwrite(&NTHREADS,sizeof(int),1,f);
+    fwrite(&minval,sizeof(int),1,f);
+    fclose(f);
+
+    //  Remove any parts of a prior target beyond the new ones and its now stale search files
+
+    for (t = NTHREADS+1; t <= oparts; t++)
+      unlink(Catenate(dir,"/.",root,Numbered_Suffix(".ktab.",t,"")));
+    unlink(Catenate(dir,"/.",root,".kidx"));
+    unlink(Catenate(dir,"/.",root,".khsh"));
+
+    for (t = 1; t < NTHREADS; t++)
+      for (c = 1; c <= MAX_COUNT; c++)
+        hist[c] += hist[t*(MAX_COUNT+1)+c];
+
+    //  With -h the histogram is instead the sum of those of the sources, which for tables
+    //    with disjoint k-mers, such as the shards of a FastK run (-B), also counts the
+    //    k-mers their -t cutoff left out of them
+
+    if (HSUM)
+      { Histogram *H;
+        char      *d, *r;
+        int        x;
+
+        bzero(hist,sizeof(int64)*(MAX_COUNT+1));
+        for (c = 0; c < ntabs; c++)
+          { d = PathTo(argv[c+2]);
+            r = Root(argv[c+2],".ktab");
+            H = Load_Histogram(Catenate(d,"/",r,".hist"));
+            if (H == NULL)
+              { fprintf(stderr,"%s: Cannot open histogram %s/%s.hist\n",Prog_Name,d,r);
+                exit (1);
+              }
+            if (H->kmer != kmer)
+              { fprintf(stderr,"%s: Histogram %s/%s.hist is not for %d-mers\n",
+                               Prog_Name,d,r,kmer);
+                exit (1);
+              }
+            for (x = H->low; x <= H->high; x++)
+              if (x >= 1 && x <= MAX_COUNT)
+                hist[x] += H->hist[x];
+            Free_Histogram(H);
+            free(r);
+            free(d);
+          }
+      }
+
+    f = fopen(Catenate(dir,"/",root,".hist"),"w");
+    if (f == NULL)
+      { fprintf(stderr,"%s: Cannot open %s/%s.hist for writing\n",Prog_Name,dir,root);
+        exit (1);
+      }
+    c = 1;
+    fwrite(&kmer,sizeof(int),1,f);
+    fwrite(&c,sizeof(int),1,f);
+    c = MAX_COUNT;
+    fwrite(&c,sizeof(int),1,f);
+    fwrite(hist+1,sizeof(int64),MAX_COUNT,f);
+    fclose(f);
+
+    free(hist);
+  }
+
+  { int c;
+
+    for (c = 0; c < ntabs; c++)
+      Free_Kmer_Stream(S[c]);
+    free(S);
+  }
+
+  free(root);
+  free(dir);
+
+  Catenate(NULL,NULL,NULL,NULL);
+  Numbered_Suffix(NULL,0,NULL);
+  free(Prog_Name);
+
+  exit (0);
+}
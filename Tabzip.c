@@ -0,0 +1,75 @@
+/*********************************************************************************************\
+ *
+ *  Convert k-mer count tables produced by FastK to or from the compressed encoding,
+ *    or the indices of profiles to or from the compact encoding
+ *
+ *********************************************************************************************/
+ 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <math.h>
+
+#include "libfastk.h"
+
+static char *Usage = "[-u] [-p] [-T<int(4)>] <source_root>[.ktab|.prof] ...";
+
+int main(int argc, char *argv[])
+{ int UNZIP;
+  int PROFILE;
+  int NTHREADS;
+
+  { int    i, j, k;
+    int    flags[128];
+    char  *eptr;
+
+    ARG_INIT("Tabzip");
+
+    NTHREADS = 4;
+
+    j = 1;
+    for (i = 1; i < argc; i++)
+      if (argv[i][0] == '-')
+        switch (argv[i][1])
+        { default:
+            ARG_FLAGS("up")
+            break;
+          case 'T':
+            ARG_POSITIVE(NTHREADS,"Number of threads")
+            break;
+        }
+      else
+        argv[j++] = argv[i];
+    argc = j;
+
+    UNZIP   = flags['u'];
+    PROFILE = flags['p'];
+
+    if (argc < 2)
+      { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage);
+        fprintf(stderr,"\n");
+        fprintf(stderr,"      -u: Convert a compressed table back to the plain encoding\n");
+        fprintf(stderr,"      -p: Convert the index of a profile instead of a table\n");
+        fprintf(stderr,"      -T: Use -T threads\n");
+        exit (1);
+      }
+  }
+
+  { int c;
+
+    for (c = 1; c < argc; c++)
+      if (PROFILE ? Convert_Profile_Index(argv[c],!UNZIP,NTHREADS)
+                  : Convert_Kmer_Table(argv[c],!UNZIP,NTHREADS))
+        { fprintf(stderr,"%s: Cannot open %s\n",Prog_Name,argv[c]);
+          exit (1);
+        }
+  }
+
+  Catenate(NULL,NULL,NULL,NULL);
+  Numbered_Suffix(NULL,0,NULL);
+  free(Prog_Name);
+
+  exit (0);
+}
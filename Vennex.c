@@ -14,12 +14,14 @@
 #include <math.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #undef DEBUG_PARTITION
+#undef DEBUG_THREADS
 
 #include "libfastk.h"
 
-static char *Usage = "[-h[<int(1)>:]<int(100)>] <source_1>[.ktab] <source_2>[.ktab] ...";
+static char *Usage = "[-T<int(4)>] [-h[<int(1)>:]<int(100)>] <source_1>[.ktab] <source_2>[.ktab] ...";
 
 /****************************************************************************************
  *
@@ -40,14 +42,30 @@ static inline int mycmp(uint8 *a, uint8 *b, int n)
 
 /****************************************************************************************
  *
- *  Find Venn Histograms
+ *  Find Venn Histograms.  Each thread merges the entries [begs[c],ends[c]) of each table c,
+ *    where the ranges of the threads partition the k-mer space, into its own histograms.
  *
  *****************************************************************************************/
 
 static int HIST_LOW, HIST_HGH;
-
-void Venn2(Kmer_Stream **Tv, int64 **comb)
-{ int kbyte = Tv[0]->kbyte;
+static int NTHREADS;
+
+typedef struct
+  { int           tid;
+    Kmer_Stream **T;      //  The tables (threads other than 0 open their own copies)
+    int           nway;
+    int64        *begs;
+    int64        *ends;
+    int64       **comb;   //  comb[v-1] = histogram of k-mers in exactly the tables in bit set v
+  } TP;
+
+static void *Venn2(void *args)
+{ TP *parm = (TP *) args;
+  Kmer_Stream **Tv   = parm->T;
+  int64       **comb = parm->comb;
+  int64        iend  = parm->ends[0];
+  int64        jend  = parm->ends[1];
+  int          kbyte = Tv[0]->kbyte;
 
   Kmer_Stream *T, *U;
   int64       *Inter, *AminB, *BminA;
@@ -63,16 +81,17 @@ void Venn2(Kmer_Stream **Tv, int64 **comb)
   BminA = comb[1];
   Inter = comb[2];
 
-  iptr = First_Kmer_Entry(T);
-  jptr = First_Kmer_Entry(U);
+  iptr = GoTo_Kmer_Index(T,parm->begs[0]);
+  jptr = GoTo_Kmer_Index(U,parm->begs[1]);
   while (1)
-    { if (iptr == NULL)
+    { if (T->cidx >= iend)
         { T = U;
           iptr = jptr;
+          iend = jend;
           AminB = BminA;
           break;
         }
-      if (jptr == NULL)
+      if (U->cidx >= jend)
         break;
       v = mycmp(iptr,jptr,kbyte);
       if (v == 0)
@@ -102,7 +121,7 @@ void Venn2(Kmer_Stream **Tv, int64 **comb)
         h[c] += 1;
     }
 
-  while (iptr != NULL)
+  while (T->cidx < iend)
     { c = COUNT_OF(iptr);
       iptr = Next_Kmer_Entry(T);
       if (c <= HIST_LOW)
@@ -112,30 +131,39 @@ void Venn2(Kmer_Stream **Tv, int64 **comb)
       else
         AminB[c] += 1;
     }
+
+  return (NULL);
 }
 
-void Venn(Kmer_Stream **T, int64 **comb, int nway)
-{ int kbyte = T[0]->kbyte;
+  //  As for Venn2, the count of a k-mer in several tables is its least count
+
+static void *Venn(void *args)
+{ TP *parm = (TP *) args;
+  Kmer_Stream **T    = parm->T;
+  int64       **comb = parm->comb;
+  int64        *ends = parm->ends;
+  int           nway = parm->nway;
+  int           kbyte = T[0]->kbyte;
 
   uint8 *ptr[nway];
   int    itop, in[nway], imin;
-  int    c, v, x;
+  int    c, d, v, x;
+  int64 *h;
 
   for (c = 0; c < nway; c++)
-    ptr[c] = First_Kmer_Entry(T[c]);
+    ptr[c] = GoTo_Kmer_Index(T[c],parm->begs[c]);
   while (1)
     { for (c = 0; c < nway; c++)
-        if (ptr[c] != NULL)
+        if (T[c]->cidx < ends[c])
           break;
       if (c >= nway)
         break;
       itop = 0;
       in[itop++] = imin = c;
       for (c++; c < nway; c++)
-        { if (ptr[c] == NULL)
+        { if (T[c]->cidx >= ends[c])
             continue;
           v = mycmp(ptr[c],ptr[imin],kbyte);
-          v = mycmp(ptr[c],ptr[imin],kbyte);
           if (v == 0)
             in[itop++] = c;
           else if (v < 0)
@@ -145,13 +173,49 @@ void Venn(Kmer_Stream **T, int64 **comb, int nway)
         }
 
       v = 0;
+      d = 0x7fff;
       for (c = 0; c < itop; c++)
         { x = in[c];
           v |= (1 << x); 
+          if (COUNT_OF(ptr[x]) < d)
+            d = COUNT_OF(ptr[x]);
           ptr[x] = Next_Kmer_Entry(T[x]);
         }
-      comb[v-1] += 1;
+      h = comb[v-1];
+      if (d <= HIST_LOW)
+        h[HIST_LOW] += 1;
+      else if (d >= HIST_HGH)
+        h[HIST_HGH] += 1;
+      else
+        h[d] += 1;
+    }
+
+  return (NULL);
+}
+
+  //  Set up the streams and histograms of a thread, and then merge its ranges
+
+static void *venn_thread(void *args)
+{ TP *parm = (TP *) args;
+  int nway = parm->nway;
+
+  if (parm->tid != 0)
+    { parm->T = Clone_Kmer_Streams(nway,parm->T);
+      if (parm->T == NULL)
+        { fprintf(stderr,"%s: Cannot reopen the k-mer tables\n",Prog_Name);
+          exit (1);
+        }
     }
+
+  if (nway == 2)
+    Venn2(parm);
+  else
+    Venn(parm);
+
+  if (parm->tid != 0)
+    Free_Kmer_Streams(nway,parm->T);
+
+  return (NULL);
 }
 
 
@@ -174,6 +238,7 @@ int main(int argc, char *argv[])
 
     HIST_LOW    = 1;
     HIST_HGH    = 100;
+    NTHREADS    = 4;
 
     j = 1;
     for (i = 1; i < argc; i++)
@@ -208,6 +273,9 @@ int main(int argc, char *argv[])
               }
             fprintf(stderr,"%s: Syntax of -h option invalid -h[<int(1)>:]<int>\n",Prog_Name);
             exit (1);
+          case 'T':
+            ARG_POSITIVE(NTHREADS,"Number of threads")
+            break;
         }
       else
         argv[j++] = argv[i];
@@ -225,20 +293,23 @@ int main(int argc, char *argv[])
     char        *low[nway];
     int64      **comb;
     char        *name;
-    int          kmer, ncomb;
+    int          kmer, ncomb, hlen;
 
     { int64 *hist;
       int    i;
 
       ncomb = (1 << nway) - 1;
-      hist  = Malloc(sizeof(int64)*((HIST_HGH-HIST_LOW)+1),"Allocating histograms");
-      comb  = Malloc(sizeof(int64 *)*ncomb,"Allocating histograms");
+      hlen  = (HIST_HGH-HIST_LOW) + 1;
+      hist  = Malloc(sizeof(int64)*hlen*ncomb*NTHREADS,"Allocating histograms");
+      comb  = Malloc(sizeof(int64 *)*ncomb*NTHREADS,"Allocating histograms");
+      if (hist == NULL || comb == NULL)
+        exit (1);
 
       comb[0] = hist-HIST_LOW;
-      for (i = 1; i < ncomb; i++)
-        comb[i] = comb[i-1] + (HIST_HGH-HIST_LOW) + 1;
+      for (i = 1; i < ncomb*NTHREADS; i++)
+        comb[i] = comb[i-1] + hlen;
 
-      bzero(hist,sizeof(int64)*((HIST_HGH-HIST_LOW)+1));
+      bzero(hist,sizeof(int64)*hlen*ncomb*NTHREADS);
     }
 
     { int c;
@@ -260,35 +331,84 @@ int main(int argc, char *argv[])
     }
 
     { int   nlen;
-      char *p, *n;
+      char *p, *n, *r;
       int   c, j;
 
       nlen = nway + 10;
       for (c = 0; c < nway; c++)
-        { n = argv[c+1];
-          p = index(n,'.');
+        { r = Root(argv[c+1],".ktab");
+          p = index(r,'.');
           if (p != NULL)
             *p = '\0';
-          nlen += strlen(n);
+          nlen += strlen(r);
 
-          n = upp[c] = Strdup(n,"Allocating upper case name");
+          n = upp[c] = Strdup(r,"Allocating upper case name");
           for (j = 0; n[j] != '\0'; j++)
             n[j] = toupper(n[j]); 
 
-          n = low[c] = Strdup(n,"Allocating lower case name");
+          n = low[c] = Strdup(r,"Allocating lower case name");
           for (j = 0; n[j] != '\0'; j++)
             n[j] = tolower(n[j]); 
 
-          if (p != NULL)
-            *p = '.';
+          free(r);
         }
       name = Malloc(nlen,"Allocating name string");
     }
 
-    if (nway == 2)
-      Venn2(T,comb);
-    else
-      Venn(T,comb,nway);
+    //  Partition the k-mers of the first table into NTHREADS ranges and find the
+    //    corresponding ranges of the other tables, merge each range in a thread, and
+    //    then sum the threads' histograms
+
+    { int64     range[NTHREADS+1][nway];
+      pthread_t threads[NTHREADS];
+      TP        parm[NTHREADS];
+      int       t, c, i, x;
+      int64     p;
+
+      for (c = 0; c < nway; c++)
+        { range[0][c] = 0;
+          range[NTHREADS][c] = T[c]->nels;
+        }
+      for (t = 1; t < NTHREADS; t++)
+        { p = (T[0]->nels*t)/NTHREADS;
+          range[t][0] = p;
+          if (p >= T[0]->nels)
+            { for (c = 1; c < nway; c++)
+                range[t][c] = T[c]->nels;
+              continue;
+            }
+          GoTo_Kmer_Index(T[0],p);
+          for (c = 1; c < nway; c++)
+            { GoTo_Kmer_String(T[c],T[0]->celm);
+              range[t][c] = T[c]->cidx;
+            }
+        }
+
+      for (t = 0; t < NTHREADS; t++)
+        { parm[t].tid  = t;
+          parm[t].T    = T;
+          parm[t].nway = nway;
+          parm[t].begs = range[t];
+          parm[t].ends = range[t+1];
+          parm[t].comb = comb + t*ncomb;
+        }
+
+#ifdef DEBUG_THREADS
+      for (t = 0; t < NTHREADS; t++)
+        venn_thread(parm+t);
+#else
+      for (t = 1; t < NTHREADS; t++)
+        pthread_create(threads+t,NULL,venn_thread,parm+t);
+      venn_thread(parm);
+      for (t = 1; t < NTHREADS; t++)
+        pthread_join(threads[t],NULL);
+#endif
+
+      for (t = 1; t < NTHREADS; t++)
+        for (i = 0; i < ncomb; i++)
+          for (x = HIST_LOW; x <= HIST_HGH; x++)
+            comb[i][x] += comb[t*ncomb+i][x];
+    }
 
     { int   i, b, f, c;
       char *a;
@@ -296,7 +416,7 @@ int main(int argc, char *argv[])
       for (i = 1; i <= ncomb; i++)
         { a = name;
           b = 1;
-          for (c = 0; c < nway; c++)
+          for (c = 0; c < nway; c++, b <<= 1)
             { if (c != 0)
                 a = stpcpy(a,"_");
               if (b & i)
@@ -310,7 +430,7 @@ int main(int argc, char *argv[])
           write(f,&kmer,sizeof(int));
           write(f,&HIST_LOW,sizeof(int));
           write(f,&HIST_HGH,sizeof(int));
-          write(f,comb[i-1]+HIST_LOW,sizeof(int64)*((HIST_HGH-HIST_LOW)+1));
+          write(f,comb[i-1]+HIST_LOW,sizeof(int64)*hlen);
           close(f);
         }
     }
@@ -324,7 +444,8 @@ int main(int argc, char *argv[])
         }
       for (c = 0; c < nway; c++)
         Free_Kmer_Stream(T[c]);
-      free(comb[0]);
+      free(comb[0]+HIST_LOW);
+      free(comb);
     }
   }
 
@@ -310,13 +310,126 @@ static void *supermer_list_thread(void *arg)
 }
 
 
+/*******************************************************************************************
+ *
+ * static void *select_thread(Select_Arg *arg)
+ *     If only a selection of the reads is to be profiled, then each thread marks with a 2
+ *     the lead entry of every group of equal super-mers none of whose copies is from a
+ *     selected read, and counts the k-mers of the remaining groups and the selected copies
+ *     from each input thread.  Unmarked groups get k-mer indices and profiles as usual.
+ *
+ ********************************************************************************************/
+
+typedef struct
+  { uint8    *sort;
+    int64    *parts;
+    int       beg;
+    int       end;
+    int64     off;
+    int64    *rbase;    //  rbase[t] = first super-mer id of input thread t
+    int64    *tcopy;    //  tcopy[t] = # of selected super-mers from input thread t
+    int64     ncopy;    //  # of selected super-mers
+    int64     nkmer;    //  # of k-mers in groups with a selected super-mer
+  } Select_Arg;
+
+  //  Is super-mer id rid from a selected read?
+
+static inline int rid_selected(int64 rid)
+{ int64 l, r, m;
+
+  l = 0;
+  r = SEL_NUM;
+  while (l < r)
+    { m = (l+r) >> 1;
+      if (SEL_RANGE[3*m+1] <= rid)
+        l = m+1;
+      else
+        r = m;
+    }
+  return (l < SEL_NUM && SEL_RANGE[3*l] <= rid);
+}
+
+static inline int64 get_rid(uint8 *rptr)
+{ int64 rid;
+  int   i;
+
+  rid = *rptr++ & 0x7f;
+  for (i = 1; i < RUN_BYTES; i++)
+    rid = (rid << 8) | *rptr++;
+  return (rid);
+}
+
+static void *select_thread(void *arg)
+{ Select_Arg  *data   = (Select_Arg *) arg;
+  int          beg    = data->beg;
+  int          end    = data->end;
+  int64       *part   = data->parts;
+  int64       *rbase  = data->rbase;
+  int64       *tcopy  = data->tcopy;
+
+  int       STOT = SMER_BYTES + SLEN_BYTES;
+
+  uint8    *sptr, *send, *lptr, *asp;
+  int64     rid, nkmer, ncopy;
+  int       i, t, x, sel;
+
+  int   sln = 0;
+#if __ORDER_LITTLE_ENDIAN__ == __BYTE_ORDER__
+  uint8  *sb = ((uint8 *) &sln) - 1;
+#else
+  uint8  *sb = ((uint8 *) &sln) + (sizeof(int)-SLEN_BYTES);
+#endif
+
+  for (t = 0; t < ITHREADS; t++)
+    tcopy[t] = 0;
+  nkmer = ncopy = 0;
+
+  sptr = data->sort + data->off;
+  for (x = beg; x < end; x++)
+    for (send = sptr + part[x]; sptr < send; sptr = lptr)
+      { asp = sptr + SMER_BYTES;
+#if __ORDER_LITTLE_ENDIAN__ == __BYTE_ORDER__
+        for (i = SLEN_BYTES; i > 0; i--)
+          sb[i] = *asp++;
+#else
+        for (i = 0; i < SLEN_BYTES; i++)
+          sb[i] = *asp++;
+#endif
+
+        sel  = 0;
+        lptr = sptr;
+        do
+          { rid = get_rid(lptr+STOT);
+            if (rid_selected(rid))
+              { for (t = ITHREADS-1; rbase[t] > rid; t--)
+                  continue;
+                tcopy[t] += 1;
+                ncopy    += 1;
+                sel = 1;
+              }
+            lptr += SMER_WORD;
+          }
+        while (*lptr == 0);
+
+        if (sel)
+          nkmer += sln+1;
+        else
+          *sptr = 2;
+      }
+
+  data->ncopy = ncopy;
+  data->nkmer = nkmer;
+  return (NULL);
+}
+
+
 /*******************************************************************************************
  *
  * static void *kmer_list_thread(Klist_Arg *arg)
  *     Each thread takes the now sorted super-mers, counts the # of each unique super-mer,
  *     and places the canonical k-mers of each with weights in an array for sorting.
  *     If the -p option is set then each k-mer entry also has the ordinal number of the
- *     k-mer in order of generation.
+ *     k-mer in order of generation, or all 1's if its super-mer is not to be profiled.
  *
  ********************************************************************************************/
 
@@ -350,7 +463,7 @@ static void *kmer_list_thread(void *arg)
   int       KCLIP  = kclip[KMER&0x3];
 
   uint8    *sptr, *send, *lptr;
-  int       x, ct, sbytes;
+  int       x, ct, sbytes, sel;
   uint8    *asp, *fill;
 
 #ifdef DEBUG_KLIST
@@ -422,6 +535,7 @@ static void *kmer_list_thread(void *arg)
             ct   += 1;
           }
 
+        sel    = (*sptr != 2);
         *sptr  = x;
         sbytes = (KMp3 + sln) >> 2;
 
@@ -509,14 +623,20 @@ static void *kmer_list_thread(void *arg)
             *((uint16 *) fill) = ct;
             fill += 2;
             if (DO_PROFILE)
+              { if (!sel)
+                  for (i = 0; i < KMAX_BYTES; i++)
+                    *fill++ = 0xff;
+                else
+                  {
 #if __ORDER_LITTLE_ENDIAN__ == __BYTE_ORDER__
-              { for (i = KMAX_BYTES; i > 0; i--)
-                  *fill++ = ib[i];
+                    for (i = KMAX_BYTES; i > 0; i--)
+                      *fill++ = ib[i];
 #else
-              { for (i = 0; i < KMAX_BYTES; i++)
-                  *fill++ = ib[i];
+                    for (i = 0; i < KMAX_BYTES; i++)
+                      *fill++ = ib[i];
 #endif
-                idx  += 1;
+                    idx  += 1;
+                  }
               }
 
 #ifdef DEBUG_KLIST
@@ -530,7 +650,7 @@ static void *kmer_list_thread(void *arg)
 #endif
           }
 
-        *sptr = 1;
+        *sptr = 1+!sel;
       }
 
   data->overflow = overflow;
@@ -608,7 +728,8 @@ static void *table_write_thread(void *arg)
  * static void *cmer_list_thread(Clist_Arg *arg)
  *     Each thread takes the now sorted weighted k-mers entries and reduces each to
  *     an entry containg the count and k-mer ordinal index, in preparation for the
- *     first of two "inverting" sorts to realize the -p option.
+ *     first of two "inverting" sorts to realize the -p option.  Entries of k-mers that
+ *     are not to be profiled (index of all 1's) are dropped.
  *
  ********************************************************************************************/
 
@@ -629,6 +750,7 @@ static void *cmer_list_thread(void *arg)
   uint8      **fours  = data->fours;
 
   int KM1 = KMER_WORD-1;
+  int KIB = KMER_WORD-KMAX_BYTES;
 
   int    x, d, k;
   uint8 *kptr, *kend;
@@ -638,6 +760,13 @@ static void *cmer_list_thread(void *arg)
   for (x = beg; x < end; x++)
     for (kend = kptr + part[x]; kptr < kend; kptr += KMER_WORD)
       { d = kptr[KM1];
+        if (PRO_SELECT && d == 0xff)
+          { for (k = KIB; k < KM1; k++)
+              if (kptr[k] != 0xff)
+                break;
+            if (k >= KM1)
+              continue;
+          }
         fill = fours[d];
         for (k = KMER_BYTES; k < KM1; k++)
           *fill++ = kptr[k];
@@ -712,7 +841,14 @@ static void *profile_list_thread(void *arg)
   for (x = beg; x < end; x++)
     for (send = sptr + part[x]; sptr < send; )
 
-      { asp = sptr + SMER_BYTES;
+      { if (*sptr == 2)                  //  No copy is from a selected read
+          { do
+              sptr += SMER_WORD;
+            while (*sptr == 0);
+            continue;
+          }
+
+        asp = sptr + SMER_BYTES;
 #if __ORDER_LITTLE_ENDIAN__ == __BYTE_ORDER__
         for (i = SLEN_BYTES; i > 0; i--)
           sb[i] = *asp++;
@@ -806,7 +942,11 @@ static void *profile_list_thread(void *arg)
 #endif
 
         do
-          { if (sptr[STOT] & 0x80)
+          { if (PRO_SELECT && ! rid_selected(get_rid(sptr+STOT)))
+              { sptr += SMER_WORD;
+                continue;
+              }
+            if (sptr[STOT] & 0x80)
               { *((uint64 *) fill) = (pidx<<1) | 0x1;
                 sptr[STOT] &= 0x7f;
 #ifdef SHOW_RUN
@@ -1120,6 +1260,7 @@ void Sorting(char *dpwd, char *dbrt)
     Twrite_Arg *parmt = Malloc(sizeof(Twrite_Arg)*NTHREADS,"Allocating sort controls");
     Plist_Arg  *parmp = Malloc(sizeof(Plist_Arg)*NTHREADS,"Allocating sort controls");
     Pwrite_Arg *parmw = Malloc(sizeof(Pwrite_Arg)*ITHREADS,"Allocating sort controls");
+    Select_Arg *parmx = NULL;
 
     int   *Table_Split = Malloc(sizeof(int)*NTHREADS,"Allocating sort controls");
     int64 *Sparts      = Malloc(sizeof(int64)*256,"Allocating sort controls");
@@ -1143,6 +1284,8 @@ void Sorting(char *dpwd, char *dbrt)
     int64  kmers;
     int64  nmers;
     int64  skmers;
+    int64  pkmers;   //  # of k-mers and super-mers to be profiled (all unless PRO_SELECT)
+    int64  pmers;
     int    t, p;
 
     s_sort = NULL;
@@ -1161,6 +1304,19 @@ void Sorting(char *dpwd, char *dbrt)
       exit (1);
 #endif
 
+    if (PRO_SELECT)
+      { parmx = Malloc(sizeof(Select_Arg)*NTHREADS,"Allocating sort controls");
+        if (parmx == NULL)
+          exit (1);
+        parmx[0].rbase = Malloc(sizeof(int64)*ITHREADS*(NTHREADS+1),"Allocating sort controls");
+        if (parmx[0].rbase == NULL)
+          exit (1);
+        for (t = 0; t < NTHREADS; t++)
+          { parmx[t].rbase = parmx[0].rbase;
+            parmx[t].tcopy = parmx[0].rbase + ITHREADS*(t+1);
+          }
+      }
+
 #ifndef DEVELOPER
     if (DO_PROFILE)
       { KMER_WORD += KMAX_BYTES;
@@ -1293,18 +1449,48 @@ void Sorting(char *dpwd, char *dbrt)
 
         Supermer_Sort(s_sort,nmers,SMER_WORD,SMER_BYTES+SLEN_BYTES,Sparts,NTHREADS,Panels);
 
+        //  If profiling a selection of the reads, mark the super-mers not in a selected read
+
+        pmers = nmers;
+        if (PRO_SELECT)
+          { for (t = 0; t < ITHREADS; t++)
+              parmx[0].rbase[t] = parms[t].nbase;
+            for (t = 0; t < NTHREADS; t++)
+              { parmx[t].sort  = s_sort;
+                parmx[t].parts = Sparts;
+                parmx[t].beg   = Panels[t].beg;
+                parmx[t].end   = Panels[t].end;
+                parmx[t].off   = Panels[t].off;
+              }
+
+            for (t = 1; t < NTHREADS; t++)
+              pthread_create(threads+t,NULL,select_thread,parmx+t);
+            select_thread(parmx);
+            for (t = 1; t < NTHREADS; t++)
+              pthread_join(threads[t],NULL);
+
+            pmers = 0;
+            for (t = 0; t < NTHREADS; t++)
+              pmers += parmx[t].ncopy;
+          }
+
         //  Allocate and fill in weighted k-mer list from sorted supermer list
 
         { int64 o, x;
           int   j;
 
+          pkmers = 0;
           if (DO_PROFILE)
             { o = 0;
               for (t = 0; t < NTHREADS; t++)
                 { parmk[t].kidx = o;
-                  for (j = 0; j < 256; j++)
-                    o += Panels[t].khist[j];
+                  if (PRO_SELECT)
+                    o += parmx[t].nkmer;
+                  else
+                    for (j = 0; j < 256; j++)
+                      o += Panels[t].khist[j];
                 }
+              pkmers = o;
             }
 
           o = 0;
@@ -1498,29 +1684,38 @@ void Sorting(char *dpwd, char *dbrt)
             bytes[x++] = i;
           bytes[x] = -1;
 
-          i_sort = LSD_Sort(skmers,i_sort,k_sort,CMER_WORD,bytes);
+          i_sort = LSD_Sort(pkmers,i_sort,k_sort,CMER_WORD,bytes);
 
           if (ODD_PASS)
-            i_sort = Realloc(i_sort,skmers*CMER_WORD,"Pruning count list");
+            i_sort = Realloc(i_sort,pkmers*CMER_WORD+1,"Pruning count list");
           else
-            i_sort = Realloc(k_sort,skmers*CMER_WORD,"Pruning count list");
+            i_sort = Realloc(k_sort,pkmers*CMER_WORD+1,"Pruning count list");
         }
 
         //  Use i_sort & k_sort again to build list of compressed profile fragments
         //    in place in i_sort, and build reference list
 
-        p_sort = Malloc(nmers*PROF_BYTES*2,"Allocating profile link array");
+        p_sort = Malloc(pmers*PROF_BYTES*2+1,"Allocating profile link array");
 
-        for (t = 0; t < NTHREADS; t++)
-          { parmp[t].sort   = s_sort;
-            parmp[t].parts  = Sparts;
-            parmp[t].beg    = parmk[t].beg;
-            parmp[t].end    = parmk[t].end;
-            parmp[t].off    = parmk[t].off;
-            parmp[t].prol   = i_sort;
-            parmp[t].cnts   = parmk[t].kidx;
-            parmp[t].fill   = p_sort + (parmk[t].off / SMER_WORD) * PROF_BYTES;
-          }
+        { int64 o;
+
+          o = 0;
+          for (t = 0; t < NTHREADS; t++)
+            { parmp[t].sort   = s_sort;
+              parmp[t].parts  = Sparts;
+              parmp[t].beg    = parmk[t].beg;
+              parmp[t].end    = parmk[t].end;
+              parmp[t].off    = parmk[t].off;
+              parmp[t].prol   = i_sort;
+              parmp[t].cnts   = parmk[t].kidx;
+              if (PRO_SELECT)
+                { parmp[t].fill = p_sort + o*PROF_BYTES;
+                  o += parmx[t].ncopy;
+                }
+              else
+                parmp[t].fill = p_sort + (parmk[t].off / SMER_WORD) * PROF_BYTES;
+            }
+        }
 
 #if defined(DEBUG_PLIST) || defined(SHOW_RUN)
         for (t = 0; t < NTHREADS; t++)
@@ -1543,19 +1738,24 @@ void Sorting(char *dpwd, char *dbrt)
             bytes[x++] = i;
           bytes[x] = -1;
 
-          a_sort = LSD_Sort(nmers,p_sort,p_sort+nmers*PROF_BYTES,PROF_BYTES,bytes);
+          a_sort = LSD_Sort(pmers,p_sort,p_sort+pmers*PROF_BYTES,PROF_BYTES,bytes);
         }
 
         //  Output profile fragments in order of a_sort links
 
         { int64 o;
+          int   k;
 
           sprintf(fname,"%s/%s.%d.P",SORT_PATH,dbrt,p);
           o = 0;
           for (t = 0; t < ITHREADS; t++)
             { parmw[t].sort  = a_sort;
               parmw[t].beg   = o;
-              o += parms[t].nmers;
+              if (PRO_SELECT)
+                for (k = 0; k < NTHREADS; k++)
+                  o += parmx[k].tcopy[t];
+              else
+                o += parms[t].nmers;
               parmw[t].end   = o;
               parmw[t].nidxs = parms[t].nidxs;
 #ifdef DEBUG_PWRITE
@@ -1634,6 +1834,10 @@ void Sorting(char *dpwd, char *dbrt)
     free(Sparts);
     free(Table_Split);
 
+    if (PRO_SELECT)
+      { free(parmx[0].rbase);
+        free(parmx);
+      }
     free(parmw);
     free(parmp);
     free(parmt);
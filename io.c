@@ -39,6 +39,7 @@
 #include "LIBDEFLATE/libdeflate.h"
 #include "HTSLIB/htslib/hts.h"
 #include "HTSLIB/htslib/hfile.h"
+#include "HTSLIB/htslib/thread_pool.h"
 #include "HTSLIB/cram/cram.h"
 
 #undef    DEBUG_FIND
@@ -91,11 +92,14 @@ typedef struct
                        //  Fasta/q and Cram specific:
     int64   zsize;  //    Size of zip index (in blocks)
     int64     *zoffs;  //    zoffs[i] = offset to compressed block i
+                       //  Cram specific:
+    int64     *zrecs;  //    zrecs[i] = # of records before container i
                        //  Fasta/q specific:
-    int        zipd;   //    Is file VGPzip'd (has paired .vzi file)
+    int        zipd;   //    Is file VGPzip'd (1 = has paired .vzi file, 2 = is BGZF)
     int        recon;  //    Is file an uncompressed regular zip-file?
     int        DB_all; //  Trim parameters for Dazzler DB's
     int        DB_cut;
+    double     dense;  //  Estimated # of bases per byte of fsize
   } File_Object;
 
 typedef struct
@@ -120,6 +124,8 @@ typedef struct
     DATA_BLOCK   block;  //  block buffer for this thread
     int          thread_id;  //  thread index (in [0,NTHREAD-1]
     void *     (*output_thread)(void *);  //  output routine for file type
+    int64        masked; //  # of bases masked for low quality (-q)
+    int64        dropped; // # of unmasked bases dropped in runs shorter than KMER (-q)
 
     DEPRESS     *decomp; //    decompressor
                          //  fasta/q specific:
@@ -139,9 +145,10 @@ static void do_nothing(Thread_Arg *parm)
 
   //  Open and get info about each input file
 
-static int64 *genes_cram_index(char *path, int64 fsize, int64 *zsize);
+static int64 *genes_cram_index(char *path, int64 fsize, int64 *zsize, int64 **zrecs);
 static void   read_DB_stub(char *path, int *cut, int *all);
 static int64 *get_dazz_offsets(FILE *idx, int64 *zsize);
+static int64 *bgzf_index(int fid, int64 *zsize);
 
 static void Fetch_File(char *arg, File_Object *input)
 { static char *suffix[] = { ".cram", ".bam", ".sam", ".db", ".dam",
@@ -154,13 +161,13 @@ static void Fetch_File(char *arg, File_Object *input)
                             ".fq.gz",  ".fa.gz", ".fq.gz", ".fa.gz" };
   static char *sufidx[] = { "", "", "", "", "",
                             "", "", "", "",
-                            ".fastq.vzi", ".fasta.vzi", ".fastq.vzi", ".fastq.vzi"
+                            ".fastq.vzi", ".fasta.vzi", ".fastq.vzi", ".fasta.vzi",
                             ".fq.vzi", ".fa.vzi", ".fq.vzi", ".fa.vzi"};
 
   struct stat stats;
   char  *pwd, *root, *path;
   int    fid, i;
-  int64  fsize, zsize, *zoffs;
+  int64  fsize, zsize, *zoffs, *zrecs;
   int    ftype, zipd, recon;
 
   pwd = PathTo(arg);
@@ -191,12 +198,17 @@ static void Fetch_File(char *arg, File_Object *input)
   path = Strdup(Catenate(pwd,"/",root,extend[i]),"Allocating full path name");
 
   zoffs = NULL;
+  zrecs = NULL;
   recon = 0;
   if (zipd)
     { int idx;
 
       idx = open(Catenate(pwd,"/",root,sufidx[i]),O_RDONLY);
-      if (idx < 0)
+      if (idx < 0 && (zoffs = bgzf_index(fid,&zsize)) != NULL)
+        { zipd  = 2;
+          fsize = IO_BLOCK*zsize;   //  An estimate only, upper bound
+        }
+      else if (idx < 0)
         { if (VERBOSE)
             fprintf(stderr,"  File %s not VGPzip'd, decompressing\n",arg);
           system(Catenate("gunzip -k ",path,"",""));
@@ -256,7 +268,7 @@ static void Fetch_File(char *arg, File_Object *input)
         }
       fsize = stats.st_size;
       if (ftype == CRAM)
-        zoffs = genes_cram_index(path,fsize,&zsize);
+        zoffs = genes_cram_index(path,fsize,&zsize,&zrecs);
       else
         zsize = (fsize-1)/IO_BLOCK+1;
     }
@@ -277,12 +289,111 @@ static void Fetch_File(char *arg, File_Object *input)
   input->recon = recon;
   input->zsize = zsize;
   input->zoffs = zoffs;
+  input->zrecs = zrecs;
+}
+
+  //  If the gzip file open on fid is BGZF (every member carries a 'BC' extra field
+  //    giving its size), then build an index of its blocks on the fly.  As a BGZF
+  //    member never holds more than 64KB compressed or uncompressed, BGZF_GROUP
+  //    consecutive members form a unit that fits in an IO_BLOCK buffer.  Return
+  //    NULL if the file is not BGZF.
+
+#define BGZF_GROUP  (IO_BLOCK/0x10000)
+
+static int64 *bgzf_index(int fid, int64 *zsize)
+{ uint8  head[1024];
+  int64  fpos, *zoffs;
+  int64  nblk, zmax;
+  int    xlen, bsize, j;
+
+  zmax  = 1024;
+  zoffs = (int64 *) Malloc(sizeof(int64)*(zmax+1),"Allocating BGZF index");
+  if (zoffs == NULL)
+    exit (1);
+
+  nblk = 0;
+  fpos = 0;
+  while (pread(fid,head,12,fpos) == 12)
+    { if (head[0] != 31 || head[1] != 139 || head[2] != 8 || (head[3] & 0x4) == 0)
+        break;
+      xlen = head[10] | (head[11] << 8);
+      if (xlen > 1012 || pread(fid,head+12,xlen,fpos+12) != xlen)
+        break;
+
+      bsize = 0;
+      for (j = 12; j+4 <= 12+xlen; j += 4 + (head[j+2] | (head[j+3] << 8)))
+        if (head[j] == 'B' && head[j+1] == 'C' && head[j+2] == 2 && head[j+3] == 0)
+          { bsize = (head[j+4] | (head[j+5] << 8)) + 1;
+            break;
+          }
+      if (bsize == 0)
+        break;
+
+      if (nblk % BGZF_GROUP == 0)
+        { int64 z = nblk/BGZF_GROUP;
+          if (z >= zmax)
+            { zmax  = 1.2*zmax + 1024;
+              zoffs = (int64 *) Realloc(zoffs,sizeof(int64)*(zmax+1),"Reallocating BGZF index");
+              if (zoffs == NULL)
+                exit (1);
+            }
+          zoffs[z] = fpos;
+        }
+      nblk += 1;
+      fpos += bsize;
+    }
+
+  if (nblk == 0 || fpos != lseek(fid,0,SEEK_END))
+    { free(zoffs);
+      return (NULL);
+    }
+
+  *zsize = (nblk-1)/BGZF_GROUP + 1;
+  zoffs[*zsize] = fpos;
+  return (zoffs);
+}
+
+  //  Decompress unit blk of zip'd file inp (open on fid and positioned at its start)
+  //    into buf, returning the number of bytes decompressed.  A VGPzip unit is a single
+  //    gzip member, a BGZF unit is a run of them.
+
+static int unzip_block(int fid, File_Object *inp, int64 blk, uint8 *zuf, uint8 *buf,
+                       DEPRESS *decomp)
+{ int64 *zoffs = inp->zoffs;
+  uint32 dlen;
+  size_t x, y;
+
+  dlen = zoffs[blk+1]-zoffs[blk];
+  read(fid,zuf,dlen);
+  if (inp->zipd == 1)
+    { if (libdeflate_gzip_decompress(decomp,zuf,dlen,buf,IO_BLOCK,&x) != 0)
+        { fprintf(stderr,"\n%s: Decompression not OK!\n",Prog_Name);
+          exit (1);
+        }
+      return ((int) x);
+    }
+  else
+    { uint8 *zp  = zuf;
+      uint8 *bp  = buf;
+
+      while (dlen > 0)
+        { if (libdeflate_gzip_decompress_ex(decomp,zp,dlen,bp,IO_BLOCK-(bp-buf),&x,&y) != 0)
+            { fprintf(stderr,"\n%s: BGZF decompression not OK!\n",Prog_Name);
+              exit (1);
+            }
+          zp   += x;
+          dlen -= x;
+          bp   += y;
+        }
+      return ((int) (bp-buf));
+    }
 }
 
 static void Free_File(File_Object *input)
 { if (input->recon)
     unlink(input->path);
   free(input->zoffs);
+  free(input->zrecs);
   free(input->path);
   free(input->root);
   free(input->pwd);
@@ -346,6 +457,47 @@ static int Add_Data_Block(DATA_BLOCK *dset, int len, char *seq)
   return (r);
 }
 
+  //  Return the length of the next segment of a read of length len to add to a data block
+  //    starting at or after *beg, setting *beg to its start, or 0 if there is none.  If not
+  //    masking or there are no qualities (qvs = NULL) this is the remainder of the read,
+  //    otherwise it is the next run of KMER or more bases whose qualities are all at least
+  //    qmin.  Bases passed over for low quality are added to *masked, and those of shorter
+  //    runs, or of a read with no qualities shorter than KMER, are added to *dropped.
+
+static int next_segment(uint8 *qvs, int len, int qmin, int *beg, int64 *masked,
+                        int64 *dropped)
+{ int i, k;
+
+  i = *beg;
+  if (QUAL_MIN == 0)
+    return (len-i);
+  if (qvs == NULL)
+    { if (len-i >= KMER)
+        return (len-i);
+      *dropped += len-i;
+      *beg = len;
+      return (0);
+    }
+
+  while (i < len)
+    { for (k = i; k < len; k++)
+        if (qvs[k] < qmin)
+          break;
+      if (k-i >= KMER)
+        { *beg = i;
+          return (k-i);
+        }
+      *dropped += k-i;
+      if (k < len)
+        { *masked += 1;
+          k += 1;
+        }
+      i = k;
+    }
+  *beg = len;
+  return (0);
+}
+
 #if defined(DEBUG_OUT) || defined(DEBUG_TRAIN)
 
 static void Print_Block(DATA_BLOCK *dset, int tid)
@@ -466,20 +618,9 @@ static void fast_nearest(Thread_Arg *data)
       fprintf(stderr,"  Loading block %lld: @%lld",blk,lseek(fid,0,SEEK_CUR));
 #endif
       if (inp->zipd)
-        { uint32 dlen, tlen;
-          int    rez;
-          size_t x;
-
-          dlen = zoffs[blk+1]-zoffs[blk];
-          tlen = IO_BLOCK;
-          read(fid,zuf,dlen);
-          if ((rez = libdeflate_gzip_decompress(decomp,zuf,dlen,buf,tlen,&x)) != 0)
-            { fprintf(stderr,"\n%s: Decompression not OK!\n",Prog_Name);
-              exit (1);
-            }
-          slen = (int) x;
+        { slen = unzip_block(fid,inp,blk,zuf,buf,decomp);
 #ifdef DEBUG_FIND
-          fprintf(stderr," %d ->",dlen);
+          fprintf(stderr," %lld ->",zoffs[blk+1]-zoffs[blk]);
 #endif
         }
       else
@@ -587,7 +728,7 @@ else                                                                      \
 { line[olen++] = lastc = '\0';							\
   dset->boff[++dset->nreads] = olen;						\
   if (olen > omax-DT_MINIM || dset->nreads >= dset->maxrds)			\
-    { DUMP(notyet,close)							\
+    { DUMP(notyet,fast_close)							\
       Reset_Data_Block(dset,0);							\
       olen = 0;									\
     }										\
@@ -599,7 +740,7 @@ else                                                                      \
         { line[olen++] = '\0';							\
           dset->boff[++dset->nreads] = olen;					\
           dset->rem  = 1;							\
-          DUMP(slen-b,close)							\
+          DUMP(slen-b,fast_close)							\
           dset->rem  = 0;							\
           Reset_Data_Block(dset,1);						\
           olen = KMER-1;							\
@@ -608,6 +749,27 @@ else                                                                      \
     }										\
 }
 
+  //  At the end of a fastq quality line, add the segments of the read in rseq that are
+  //    not masked by the qualities in rqvs
+
+#define MASK_SEQ(notyet)							\
+{ int p, n, j;									\
+										\
+  while (qlen < rlen)								\
+    rqvs[qlen++] = qmin;							\
+  p = 0;									\
+  while ((n = next_segment(rqvs,rlen,qmin,&p,&parm->masked,			\
+                           &parm->dropped)) > 0)					\
+    { for (j = p; j < p+n; j++)							\
+        ADD(rseq[j])								\
+      END_SEQ(notyet)								\
+      p += n;									\
+    }										\
+  rlen = qlen = 0;								\
+}
+
+#define fast_close(fid)  { close(fid); free(rseq); }
+
   //  Write fast records in relevant partition
 
 static void *fast_output_thread(void *arg)
@@ -619,7 +781,8 @@ static void *fast_output_thread(void *arg)
   int          action = parm->action;
   DATA_BLOCK  *dset   = &parm->block;
   int          tid    = parm->thread_id;
-  int          fastq  = (fobj->ftype == FASTQ);    //  Is the same for all files (already checked)
+  int          fastq  = (fobj->ftype == FASTQ);    //  Files are all of one type, or mixed
+                                                   //    ones are passed here one at a time
 
   File_Object *inp;
   int          f, fid;
@@ -632,6 +795,12 @@ static void *fast_output_thread(void *arg)
   int   omax, olen;
   char *line;
 
+  int    qmask;                 //  Masking bases by quality, in which case each read is
+  int    qmin;                  //    held in rseq/rqvs until its quality line is seen
+  int    rmax, rlen, qlen;
+  char  *rseq;
+  uint8 *rqvs;
+
   int64 estbps, cumbps, nxtbps, pct1;
   int   CLOCK;
 
@@ -646,6 +815,22 @@ static void *fast_output_thread(void *arg)
   else
     CLOCK = 0;
 
+  qmask = (fastq && QUAL_MIN > 0);
+  qmin  = QUAL_MIN + 33;
+  rlen  = qlen = 0;
+  if (qmask)
+    { rmax = 75000;
+      rseq = Malloc(2*rmax,"Allocating read buffer");
+      if (rseq == NULL)
+        exit (1);
+      rqvs = (uint8 *) (rseq + rmax);
+    }
+  else
+    { rmax = 0;
+      rseq = NULL;
+      rqvs = NULL;
+    }
+
   //  Do relevant section of each file assigned to this thread in sequence
 
   omax = dset->maxbps;
@@ -681,7 +866,7 @@ static void *fast_output_thread(void *arg)
         lseek(fid,blk*IO_BLOCK,SEEK_SET);
 
       state = QAT;
-      olen  = 0;
+      olen  = dset->boff[dset->nreads];
       lastc = 0;
 
 #ifdef DEBUG_IO
@@ -695,20 +880,9 @@ static void *fast_output_thread(void *arg)
           fprintf(stderr,"  Loading block %lld: @%lld",blk,lseek(fid,0,SEEK_CUR));
 #endif
           if (inp->zipd)
-            { uint32 dlen, tlen;
-              int    rez;
-              size_t x;
-
-              dlen = zoffs[blk+1]-zoffs[blk];
-              tlen = IO_BLOCK;
-              read(fid,zuf,dlen);
-              if ((rez = libdeflate_gzip_decompress(decomp,zuf,dlen,buf,tlen,&x)) != 0)
-                { fprintf(stderr,"\n%s: Decompression not OK!\n",Prog_Name);
-                  exit (1);
-                }
-              slen = (int) x;
+            { slen = unzip_block(fid,inp,blk,zuf,buf,decomp);
 #ifdef DEBUG_IO
-              fprintf(stderr," %d ->",dlen);
+              fprintf(stderr," %lld ->",zoffs[blk+1]-zoffs[blk]);
 #endif
             }
           else
@@ -742,11 +916,22 @@ static void *fast_output_thread(void *arg)
                   break;
                   
                 case QSEQ:
-                  if (c != '\n')
+                  if (c == '\n')
+                    { if (!qmask)
+                        END_SEQ(slen-b)
+                      state = QPLS;
+                    }
+                  else if (!qmask)
                     ADD(c)
                   else
-                    { END_SEQ(slen-b)
-                      state = QPLS;
+                    { if (rlen >= rmax)
+                        { rmax = 1.2*rlen + 1000;
+                          rseq = Realloc(rseq,2*rmax,"Reallocating read buffer");
+                          if (rseq == NULL)
+                            exit (1);
+                          rqvs = (uint8 *) (rseq + rmax);
+                        }
+                      rseq[rlen++] = c;
                     }
                   break;
 
@@ -757,7 +942,12 @@ static void *fast_output_thread(void *arg)
 
                 case QSKP:
                   if (c == '\n')
-                    state = QAT;
+                    { if (qmask)
+                        MASK_SEQ(slen-b)
+                      state = QAT;
+                    }
+                  else if (qmask && qlen < rlen)
+                    rqvs[qlen++] = c;
                   break;
 
                 case AEOL:
@@ -785,6 +975,7 @@ static void *fast_output_thread(void *arg)
         END_SEQ(0)
       close(fid);
     }
+  free(rseq);
 
   dset->totlen = dset->boff[dset->nreads] - dset->nreads;
   if (action == SAMPLE)
@@ -1484,7 +1675,6 @@ static int sam_record_scan(BAM_FILE *sf, samRecord *theR)
 
     theR->header = q;
 
-    p = index(p+1,'\t');
     flags = strtol(q=p+1,&p,0);
     CHECK( p == q, "Cannot parse flags")
 
@@ -1523,7 +1713,7 @@ static int sam_record_scan(BAM_FILE *sf, samRecord *theR)
     p = index(p,'\t');
     CHECK( p == NULL, "No auxilliary tags in SAM record, file corrupted?")
 
-    if (*q == '*')
+    if (*q == '*' && p == q+1)     //  '*' alone means no qualities
       return (0);
     qlen = p-q;
     seq = theR->qvs;
@@ -1556,9 +1746,10 @@ static void *bam_output_thread(void *arg)
 
   int64        epos;
   uint32       eoff;
-  int          isbam;
+  int          isbam, hasqv;
   int          f, fid;
   int64        totread, fbeg;
+  int          p, n;
 
   int64 estbps, cumbps, nxtbps, pct1;
   int   CLOCK;
@@ -1631,46 +1822,51 @@ static void *bam_output_thread(void *arg)
             break;
 
           if (isbam)
-            bam_record_scan(bam,theR);
+            hasqv = bam_record_scan(bam,theR);
           else
-            sam_record_scan(bam,theR);
+            hasqv = sam_record_scan(bam,theR);
 
           if (theR->len <= 0)
             continue;
 
 #ifdef DEBUG_BAM_RECORD
           fprintf(stderr,"S = '%s'\n",theR->seq);
-          if (hasQV)
+          if (hasqv)
             fprintf(stderr,"Q = '%.*s'\n",theR->len,theR->qvs);
 #endif
 
-          while (Add_Data_Block(dset,theR->len,theR->seq))
-            { if (action == SAMPLE)
-                if (isbam)
-                  { int unused = (bam->blen - (bam->bptr + bam->bsize))
-                               - bam->loc.boff * ((1.*bam->bsize) / bam->ssize);
-                    dset->ratio = (1.*parm->work)
-                                / ((totread+lseek(fid,0,SEEK_CUR))-(unused+fbeg+dset->rem));
-                    close(fid);
-                    return (NULL);
-                  }
-                else
-                  { dset->ratio = (1.*parm->work) / (totread+bam->loc.fpos-dset->rem);
-                    close(fid);
-                    return (NULL);
-                  }
-              else
-                { CALL_BACK(dset,tid);
-                  if (CLOCK)
-                    { cumbps += dset->totlen;
-                      if (cumbps >= nxtbps)
-                        { fprintf(stderr,"\r  %3d%%",(int) ((100.*cumbps)/estbps));
-                          fflush(stderr);
-                          nxtbps = cumbps+pct1;
+          p = 0;
+          while ((n = next_segment(hasqv ? (uint8 *) theR->qvs : NULL,theR->len,QUAL_MIN+33,
+                                   &p,&parm->masked,&parm->dropped)) > 0)
+            { while (Add_Data_Block(dset,n,theR->seq+p))
+                { if (action == SAMPLE)
+                    if (isbam)
+                      { int unused = (bam->blen - (bam->bptr + bam->bsize))
+                                   - bam->loc.boff * ((1.*bam->bsize) / bam->ssize);
+                        dset->ratio = (1.*parm->work)
+                                    / ((totread+lseek(fid,0,SEEK_CUR))-(unused+fbeg+dset->rem));
+                        close(fid);
+                        return (NULL);
+                      }
+                    else
+                      { dset->ratio = (1.*parm->work) / (totread+bam->loc.fpos-dset->rem);
+                        close(fid);
+                        return (NULL);
+                      }
+                  else
+                    { CALL_BACK(dset,tid);
+                      if (CLOCK)
+                        { cumbps += dset->totlen;
+                          if (cumbps >= nxtbps)
+                            { fprintf(stderr,"\r  %3d%%",(int) ((100.*cumbps)/estbps));
+                              fflush(stderr);
+                              nxtbps = cumbps+pct1;
+                            }
                         }
+                      Reset_Data_Block(dset,0);
                     }
-                  Reset_Data_Block(dset,0);
                 }
+              p += n;
             }
         }
 
@@ -1773,7 +1969,7 @@ static int int32_decode(hFILE *fp, int32 *val)
 
 // reading cram block, header is a block so wrapped.
 
-static int64 scan_container(cram_fd *fd)
+static int64 scan_container(cram_fd *fd, int32 *nrec)
 { int     i, len;
   int32   nslice;
   hFILE  *fp = fd->fp;
@@ -1783,7 +1979,7 @@ static int64 scan_container(cram_fd *fd)
   scan_itf8(fp);                                //  ref seq id
   scan_itf8(fp);                                //  start pos on ref
   scan_itf8(fp);                                //  align span
-  scan_itf8(fp);                                //  # of records
+  itf8_decode(fd,nrec);                         //  # of records
   if (CRAM_MAJOR_VERS(fd->version) > 1)
     { if (CRAM_MAJOR_VERS(fd->version) >= 3)    //  record counter
         scan_ltf8(fp);
@@ -1800,51 +1996,71 @@ static int64 scan_container(cram_fd *fd)
   return (htell(fp));
 }
 
-static int64 *genes_cram_index(char *path, int64 fsize, int64 *zsize)
+  //  Scan the container headers of a cram file, returning the offset of each container
+  //    and, in *zrecs, the number of records that precede each container.  The
+  //    trailing EOF container is not counted in *zsize.
+
+static int64 *genes_cram_index(char *path, int64 fsize, int64 *zsize, int64 **zrecs)
 { cram_fd *fd;
-  int64    cash[10], *zoff;
+  int64   *zoff, *zrec;
   int64    s, e;
-  int      i, j;
+  int32    nrec;
+  int      i;
  
   fd = cram_open(path,"r");
 
-  cash[0] = htell(fd->fp);
-  for (i = 1; i < 10; i++)
-    { cash[i] = s = scan_container(fd);
-      if (s == fsize)
-        { zoff = Malloc(sizeof(int64)*i,"Allocating cram index"); 
-          if (zoff == NULL)
-            exit (1);
-          for (j = 0; j < i; i++)
-            zoff[j] = cash[i];
-          *zsize = i-1;
-          return (zoff);
-        }
-    }
-
-  e = ((fsize-(cash[0]+38))/(cash[9]-cash[0])+1)*9 + 100;
+  e = 100;
   zoff = Malloc(sizeof(int64)*e,"Allocating cram index"); 
-  if (zoff == NULL)
+  zrec = Malloc(sizeof(int64)*e,"Allocating cram index"); 
+  if (zoff == NULL || zrec == NULL)
     exit (1);
-  for (j = 0; j < i; j++)
-    zoff[j] = cash[j];
 
+  i = 0;
+  zoff[0] = s = htell(fd->fp);
+  zrec[0] = 0;
   while (s != fsize)
-    { zoff[i++] = s = scan_container(fd);
+    { s = scan_container(fd,&nrec);
+      if (s < 0)
+        { fprintf(stderr,"\n%s: Cram file %s is truncated or malformed\n",Prog_Name,path);
+          exit (1);
+        }
+      i += 1;
       if (i >= e)
         { e = ((fsize-(zoff[0]+38.))/(zoff[i-1]-zoff[0]))*(i-1) + 100;
           zoff = Realloc(zoff,sizeof(int64)*e,"Allocating cram index"); 
-          if (zoff == NULL)
+          zrec = Realloc(zrec,sizeof(int64)*e,"Allocating cram index"); 
+          if (zoff == NULL || zrec == NULL)
             exit (1);
         }
+      zoff[i] = s;
+      zrec[i] = zrec[i-1] + nrec;
     }
 
   cram_close(fd);
 
-  *zsize = i-2;
+  *zsize = i-1;
+  *zrecs = zrec;
   return (zoff);
 }       
 
+  //  Return the index of the first container that starts at or after pos
+
+static int64 container_index(File_Object *inp, int64 pos)
+{ int64 *zoffs = inp->zoffs;
+  int64  l, r, m;
+
+  l = 0;
+  r = inp->zsize;
+  while (l < r)
+    { m = (l+r)/2;
+      if (zoffs[m] < pos)
+        l = m+1;
+      else
+        r = m;
+    }
+  return (l);
+}
+
 static void cram_nearest(Thread_Arg *data)
 { File_Object *inp   = data->fobj + data->bidx;
   int64       *zoffs = inp->zoffs;
@@ -1861,6 +2077,16 @@ static void cram_nearest(Thread_Arg *data)
     data->beg.fpos = zoffs[i];
 }
 
+  //  Containers are decoded ahead of the consuming input thread by a pool shared by all
+  //    the input threads when one has been set up by Scan_All_Input.  As read-ahead moves
+  //    the file pointer past the records being consumed, the end of a thread's range is
+  //    determined by counting records rather than by file position.
+
+#define CRAM_MEMORY 1000000000ll   //  Budget for decoded containers in flight
+#define CRAM_EXPAND          4ll   //  Rough expansion of a container on decoding
+
+static htsThreadPool cram_pool = { NULL, 0 };
+
 static void *cram_output_thread(void *arg)
 { Thread_Arg  *parm   = (Thread_Arg *) arg;
   File_Object *fobj   = parm->fobj;
@@ -1872,6 +2098,7 @@ static void *cram_output_thread(void *arg)
   int          f;
   cram_fd     *fid;
   int64        bpos, epos;
+  int64        nrec;
   int64        totread;
   char        *line;
   int          o, omax;
@@ -1905,6 +2132,9 @@ static void *cram_output_thread(void *arg)
         bpos  = inp->zoffs[0];
       else
         bpos  = parm->beg.fpos;
+      nrec = inp->zrecs[container_index(inp,epos)] - inp->zrecs[container_index(inp,bpos)];
+      if (action != SAMPLE && cram_pool.pool != NULL)
+        cram_set_option(fid,CRAM_OPT_THREAD_POOL,&cram_pool);
       hseek(fid->fp,bpos,SEEK_SET);
 
 #ifdef DEBUG_IO
@@ -1912,46 +2142,59 @@ static void *cram_output_thread(void *arg)
       fflush(stderr);
 #endif
 
-      o = 0;
+      o = dset->boff[dset->nreads];
       while (1)
         { cram_record *rec;
           char        *seq;
+          uint8       *qvs;
           int          len, ovl;
+          int          p, n;
 
+          if (nrec-- <= 0)
+            break;
           rec = cram_get_seq(fid);
           if (rec == NULL)
             break;
 
-          if (htell(fid->fp) > epos)
-            break;
-
-          seq = (char *) (rec->s->seqs_blk->data+rec->seq);
-          if (COMPRESS)
-            len = homo_compress(seq,rec->len);
-          else
-            len = rec->len;
-
-          while (o+len > omax)
-            { ovl = omax-o;
-              memcpy(line+o,seq,ovl);
-              line[omax] = '\0';
-              dset->boff[++dset->nreads] = omax+1;
-              dset->rem = 1;
-              DUMP((bpos-htell(fid->fp))+(len-ovl),cram_close)
-              dset->rem = 0;
-              Reset_Data_Block(dset,1);
-              o = KMER-1;
-              len -= ovl;
-              seq += ovl; 
+          qvs = NULL;
+          if (rec->len > 0 && rec->s->qual_blk->data != NULL)
+            { qvs = (uint8 *) (rec->s->qual_blk->data+rec->qual);
+              if (qvs[0] == 0xff)                    //  Qualities were not recorded
+                qvs = NULL;
             }
-          memcpy(line+o,seq,len);
-          o += len;
-          line[o++] = '\0';
-          dset->boff[++dset->nreads] = o;
-          if (o > omax-DT_MINIM || dset->nreads >= dset->maxrds)
-            { DUMP(bpos-htell(fid->fp),cram_close)
-              Reset_Data_Block(dset,0);
-              o = 0;
+
+          p = 0;
+          while ((n = next_segment(qvs,rec->len,QUAL_MIN,&p,
+                                   &parm->masked,&parm->dropped)) > 0)
+            { seq = (char *) (rec->s->seqs_blk->data+rec->seq) + p;
+              p  += n;
+              if (COMPRESS)
+                len = homo_compress(seq,n);
+              else
+                len = n;
+
+              while (o+len > omax)
+                { ovl = omax-o;
+                  memcpy(line+o,seq,ovl);
+                  line[omax] = '\0';
+                  dset->boff[++dset->nreads] = omax+1;
+                  dset->rem = 1;
+                  DUMP((bpos-htell(fid->fp))+(len-ovl),cram_close)
+                  dset->rem = 0;
+                  Reset_Data_Block(dset,1);
+                  o = KMER-1;
+                  len -= ovl;
+                  seq += ovl; 
+                }
+              memcpy(line+o,seq,len);
+              o += len;
+              line[o++] = '\0';
+              dset->boff[++dset->nreads] = o;
+              if (o > omax-DT_MINIM || dset->nreads >= dset->maxrds)
+                { DUMP(bpos-htell(fid->fp),cram_close)
+                  Reset_Data_Block(dset,0);
+                  o = 0;
+                }
             }
         }
 
@@ -2230,7 +2473,7 @@ static void *dazz_output_thread(void *arg)
       fflush(stderr);
 #endif
 
-      o = 0;
+      o = dset->boff[dset->nreads];
       while (r < epos)
         { len = zoffs[r++];
           if (len < 0)
@@ -2308,6 +2551,595 @@ static void *dazz_output_thread(void *arg)
 }
 
 
+/*******************************************************************************************
+ *
+ *  STREAMED FASTA / FASTQ INPUT
+ *
+ *    A single fasta or fastq source given as - (stdin) or as a named pipe can be read only
+ *    once and its size is unknown.  The start of the stream is held in a training buffer
+ *    from which the first block is sampled, the size of the whole being extrapolated from
+ *    the hint STREAM_SIZE.  Thereafter a single reader parses the training buffer and then
+ *    the rest of the stream into DATA_BLOCKs that it hands through a bounded queue to
+ *    ITHREADS distributing threads.  If profiles are requested then there is a single
+ *    distributor so that the reads keep their order.
+ *
+ ********************************************************************************************/
+
+#define STREAM_QUEUE  4   //  # of blocks in flight per distributing thread
+#define STREAM_GUESS 10   //  If no size hint, guess the stream is this many training buffers
+
+static struct
+  { int     on;       //  The input is a stream
+    int     fid;      //  File descriptor of the stream
+    int     fastq;    //  The stream is fastq (else fasta)
+    uint8  *train;    //  The first ntrain bytes of the stream
+    int64   ntrain;
+    int64   tmax;     //  Size of the train buffer
+    int     eof;      //  The stream ended within the training buffer
+  } Stream;
+
+  //  If arg is - or a named pipe then open it as the single streamed input in input,
+  //    reading its first bytes to determine if it is fasta or fastq.  Return 0 if arg is
+  //    neither.
+
+static int open_stream(char *arg, File_Object *input)
+{ struct stat stats;
+  int64       n;
+
+  if (strcmp(arg,"-") == 0)
+    { Stream.fid = 0;
+      input->root = Strdup("stdin","Allocating root name");
+      input->pwd  = Strdup(".","Allocating path name");
+    }
+  else if (stat(arg,&stats) == 0 && S_ISFIFO(stats.st_mode))
+    { Stream.fid = open(arg,O_RDONLY);
+      if (Stream.fid < 0)
+        { fprintf(stderr,"\n%s: Cannot open pipe %s\n",Prog_Name,arg);
+          exit (1);
+        }
+      input->root = Root(arg,NULL);
+      input->pwd  = PathTo(arg);
+    }
+  else
+    return (0);
+
+  Stream.tmax  = IO_BLOCK;
+  Stream.train = Malloc(Stream.tmax,"Allocating stream buffer");
+  if (Stream.train == NULL)
+    exit (1);
+  Stream.ntrain = 0;
+  Stream.eof    = 0;
+  while (Stream.ntrain < Stream.tmax)
+    { n = read(Stream.fid,Stream.train+Stream.ntrain,Stream.tmax-Stream.ntrain);
+      if (n <= 0)
+        { Stream.eof = 1;
+          break;
+        }
+      Stream.ntrain += n;
+    }
+  if (Stream.ntrain == 0)
+    { fprintf(stderr,"\n%s: Streamed input %s is empty\n",Prog_Name,arg);
+      exit (1);
+    }
+
+  if (Stream.train[0] == '@')
+    Stream.fastq = 1;
+  else if (Stream.train[0] == '>')
+    Stream.fastq = 0;
+  else
+    { fprintf(stderr,"\n%s: Streamed input %s is not (uncompressed) fasta or fastq\n",
+                     Prog_Name,arg);
+      exit (1);
+    }
+  Stream.on = 1;
+
+  input->path   = Strdup(arg,"Allocating full path name");
+  input->fsize  = 0;
+  input->ftype  = Stream.fastq ? FASTQ : FASTA;
+  input->zsize  = 0;
+  input->zoffs  = NULL;
+  input->zrecs  = NULL;
+  input->zipd   = 0;
+  input->recon  = 0;
+  return (1);
+}
+
+  //  Read the stream until the training buffer holds numbp bytes or the stream ends
+
+static void fill_stream(int64 numbp)
+{ int64 n;
+
+  if (numbp > Stream.tmax)
+    { Stream.tmax  = numbp;
+      Stream.train = Realloc(Stream.train,Stream.tmax,"Allocating stream buffer");
+      if (Stream.train == NULL)
+        exit (1);
+    }
+  while (!Stream.eof && Stream.ntrain < numbp)
+    { n = read(Stream.fid,Stream.train+Stream.ntrain,numbp-Stream.ntrain);
+      if (n <= 0)
+        Stream.eof = 1;
+      else
+        Stream.ntrain += n;
+    }
+}
+
+  //  A resumable version of the fasta/q automaton of fast_output_thread
+
+typedef struct
+  { int         fastq;   //  Parsing fastq (else fasta)
+    int         state;   //  Automaton state
+    int         lastc;   //  Last character added (for homopolymer compression)
+    int         olen;    //  # of bytes in the block being filled
+    DATA_BLOCK *dset;    //  The block being filled
+  } Parser;
+
+#define SEND_SEQ							\
+{ line[olen++] = lastc = '\0';						\
+  dset->boff[++dset->nreads] = olen;					\
+  if (olen > omax-DT_MINIM || dset->nreads >= dset->maxrds)		\
+    full = 1;								\
+}
+
+#define SADD(c)								\
+{ if (!COMPRESS || c != lastc)						\
+    { if (olen >= omax)							\
+        { full = 2;							\
+          break;							\
+        }								\
+      line[olen++] = lastc = c;						\
+    }									\
+}
+
+  //  Parse buf[*pos,slen) into ps->dset until either the text is exhausted (return 0),
+  //    or the block is full at the end of a read (return 1), or is full in the middle
+  //    of one (return 2) in which case the last KMER-1 bases must start the next block.
+
+static int stream_parse(Parser *ps, uint8 *buf, int64 *pos, int64 slen)
+{ DATA_BLOCK *dset  = ps->dset;
+  char       *line  = dset->bases;
+  int         omax  = dset->maxbps;
+  int         fastq = ps->fastq;
+  int         state = ps->state;
+  int         lastc = ps->lastc;
+  int         olen  = ps->olen;
+  int         full  = 0;
+  int64       b;
+  int         c;
+
+  for (b = *pos; b < slen; b++)
+    { c = buf[b];
+      switch (state)
+
+      { case QAT:
+          state = HSKP;
+          break;
+
+        case HSKP:
+          if (c == '\n')
+            { if (fastq)
+                state = QSEQ;
+              else
+                state = ASEQ;
+            }
+          break;
+
+        case QSEQ:
+          if (c != '\n')
+            SADD(c)
+          else
+            { SEND_SEQ
+              state = QPLS;
+            }
+          break;
+
+        case QPLS:
+          if (c == '\n')
+            state = QSKP;
+          break;
+
+        case QSKP:
+          if (c == '\n')
+            state = QAT;
+          break;
+
+        case AEOL:
+          if (c == '>')
+            { SEND_SEQ
+              state = HSKP;
+            }
+          else if (c != '\n')
+            { SADD(c)
+              state = ASEQ;
+            }
+          break;
+
+        case ASEQ:
+          if (c == '\n')
+            state = AEOL;
+          else
+            SADD(c)
+      }
+      if (full)
+        break;
+    }
+
+  if (full == 1)
+    b += 1;
+  else if (full == 2)
+    { line[olen++] = '\0';
+      dset->boff[++dset->nreads] = olen;
+    }
+  if (full)
+    { dset->totlen = dset->boff[dset->nreads] - dset->nreads;
+      dset->rem    = (full == 2);
+    }
+
+  *pos      = b;
+  ps->state = state;
+  ps->lastc = lastc;
+  ps->olen  = olen;
+  return (full);
+}
+
+  //  Start filling block dset after ps->dset, carrying over the last KMER-1 bases if roll
+
+static void stream_next(Parser *ps, DATA_BLOCK *dset, int roll)
+{ DATA_BLOCK *last = ps->dset;
+
+  if (roll)
+    { memcpy(dset->bases,last->bases+(last->boff[last->nreads]-KMER),KMER-1);
+      ps->olen = KMER-1;
+    }
+  else
+    ps->olen = 0;
+  dset->nreads  = 0;
+  dset->boff[0] = 0;
+  dset->rem     = 0;
+  ps->dset = dset;
+}
+
+  //  The stream has ended, complete the last read of the block being filled
+
+static void stream_finish(Parser *ps)
+{ DATA_BLOCK *dset = ps->dset;
+
+  if (ps->state == AEOL || ps->state == ASEQ)
+    { dset->bases[ps->olen++] = '\0';
+      dset->boff[++dset->nreads] = ps->olen;
+    }
+  dset->totlen = dset->boff[dset->nreads] - dset->nreads;
+  dset->rem    = 0;
+}
+
+  //  Sample the first block from the training buffer
+
+static void stream_sample(DATA_BLOCK *dset, int64 numbp)
+{ Parser ps;
+  int64  pos;
+
+  fill_stream(numbp);
+
+  ps.fastq = Stream.fastq;
+  ps.state = QAT;
+  ps.lastc = 0;
+  ps.dset  = dset;
+  ps.olen  = 0;
+
+  pos = 0;
+  if (stream_parse(&ps,Stream.train,&pos,Stream.ntrain) == 0)
+    stream_finish(&ps);
+
+  if (pos >= Stream.ntrain && Stream.eof)
+    dset->ratio = 1.;
+  else
+    { double est;
+
+      dset->ratio = (1.*Stream.ntrain) / pos;
+      if (Stream.eof)
+        est = 0.;
+      else if (STREAM_SIZE > 0)
+        est = (1.*STREAM_SIZE) / dset->totlen;
+      else
+        { est = STREAM_GUESS * dset->ratio;
+          if (VERBOSE)
+            fprintf(stderr,"  No size given for streamed input, guessing %.1fGbp\n",
+                           (est*dset->totlen)/1.e9);
+        }
+      if (est > dset->ratio)
+        dset->ratio = est;
+    }
+}
+
+  //  Bounded queue of blocks between the reader and the distributing threads
+
+static struct
+  { pthread_mutex_t lock;
+    pthread_cond_t  more;    //  A block was queued or the stream ended
+    pthread_cond_t  less;    //  A block was returned to the free pool
+    DATA_BLOCK    **ring;    //  Queue of blocks ready for distribution
+    int             head;
+    int             nring;
+    DATA_BLOCK    **pool;    //  Stack of free blocks
+    int             npool;
+    int             nblock;  //  Total # of blocks
+    int             done;    //  The reader has finished
+  } Queue;
+
+static DATA_BLOCK *get_free_block()
+{ DATA_BLOCK *dset;
+
+  pthread_mutex_lock(&Queue.lock);
+  while (Queue.npool == 0)
+    pthread_cond_wait(&Queue.less,&Queue.lock);
+  dset = Queue.pool[--Queue.npool];
+  pthread_mutex_unlock(&Queue.lock);
+  return (dset);
+}
+
+static void put_full_block(DATA_BLOCK *dset)
+{ pthread_mutex_lock(&Queue.lock);
+  Queue.ring[(Queue.head+Queue.nring) % Queue.nblock] = dset;
+  Queue.nring += 1;
+  pthread_cond_signal(&Queue.more);
+  pthread_mutex_unlock(&Queue.lock);
+}
+
+static void *stream_distribute_thread(void *arg)
+{ Thread_Arg *parm = (Thread_Arg *) arg;
+  int         tid  = parm->thread_id;
+  DATA_BLOCK *dset;
+
+  while (1)
+    { pthread_mutex_lock(&Queue.lock);
+      while (Queue.nring == 0 && ! Queue.done)
+        pthread_cond_wait(&Queue.more,&Queue.lock);
+      if (Queue.nring == 0)
+        { pthread_mutex_unlock(&Queue.lock);
+          break;
+        }
+      dset = Queue.ring[Queue.head];
+      Queue.head   = (Queue.head+1) % Queue.nblock;
+      Queue.nring -= 1;
+      pthread_mutex_unlock(&Queue.lock);
+
+      CALL_BACK(dset,tid);
+
+      pthread_mutex_lock(&Queue.lock);
+      Queue.pool[Queue.npool++] = dset;
+      pthread_cond_signal(&Queue.less);
+      pthread_mutex_unlock(&Queue.lock);
+    }
+
+  return (NULL);
+}
+
+  //  Parse the whole stream, handing blocks to ITHREADS distributing threads
+
+static void stream_scan(Thread_Arg *parm)
+{ pthread_t   threads[ITHREADS];
+  DATA_BLOCK *blocks;
+  char       *bases;
+  int        *boff;
+  Parser      ps;
+  uint8      *buf;
+  int64       pos, slen;
+  int         i, full;
+
+  Queue.nblock = STREAM_QUEUE*ITHREADS + 1;
+  blocks     = Malloc(sizeof(DATA_BLOCK)*Queue.nblock,"Allocating data blocks");
+  bases      = Malloc(sizeof(char)*(DT_BLOCK+1)*Queue.nblock,"Allocating data blocks");
+  boff       = Malloc(sizeof(int)*(DT_READS+1)*Queue.nblock,"Allocating data blocks");
+  Queue.ring = Malloc(sizeof(DATA_BLOCK *)*2*Queue.nblock,"Allocating data blocks");
+  if (blocks == NULL || bases == NULL || boff == NULL || Queue.ring == NULL)
+    exit (1);
+  Queue.pool = Queue.ring + Queue.nblock;
+
+  for (i = 0; i < Queue.nblock; i++)
+    { blocks[i].bases  = bases + (DT_BLOCK+1)*i;
+      blocks[i].boff   = boff  + (DT_READS+1)*i;
+      blocks[i].maxbps = DT_BLOCK;
+      blocks[i].maxrds = DT_READS;
+      Queue.pool[i] = blocks+i;
+    }
+  Queue.npool = Queue.nblock;
+  Queue.head  = 0;
+  Queue.nring = 0;
+  Queue.done  = 0;
+  pthread_mutex_init(&Queue.lock,NULL);
+  pthread_cond_init(&Queue.more,NULL);
+  pthread_cond_init(&Queue.less,NULL);
+
+  for (i = 0; i < ITHREADS; i++)
+    pthread_create(threads+i,NULL,stream_distribute_thread,parm+i);
+
+  ps.fastq = Stream.fastq;
+  ps.state = QAT;
+  ps.lastc = 0;
+  ps.dset  = NULL;
+  stream_next(&ps,get_free_block(),0);
+
+  //  Parse the training buffer and then reuse it to read the rest of the stream
+
+  buf  = Stream.train;
+  slen = Stream.ntrain;
+  pos  = 0;
+  while (1)
+    { full = stream_parse(&ps,buf,&pos,slen);
+      if (full)
+        { DATA_BLOCK *dset = ps.dset;
+
+          stream_next(&ps,get_free_block(),full == 2);
+          put_full_block(dset);
+          continue;
+        }
+      if (Stream.eof)
+        break;
+      slen = read(Stream.fid,buf,Stream.tmax);
+      if (slen <= 0)
+        break;
+      pos = 0;
+    }
+
+  stream_finish(&ps);
+  if (ps.dset->nreads > 0)
+    put_full_block(ps.dset);
+
+  pthread_mutex_lock(&Queue.lock);
+  Queue.done = 1;
+  pthread_cond_broadcast(&Queue.more);
+  pthread_mutex_unlock(&Queue.lock);
+
+  for (i = 0; i < ITHREADS; i++)
+    pthread_join(threads[i],NULL);
+
+  free(Queue.ring);
+  free(boff);
+  free(bases);
+  free(blocks);
+}
+
+
+/*******************************************************************************************
+ *
+ *  MIXED FILE TYPES
+ *
+ *    The reader routines for each file type.  When the input files are not all of the same
+ *    type, each thread hands each file of its range in turn to the output routine for the
+ *    file's type, and the work is balanced on an estimate of the number of bases in each
+ *    file rather than its size in bytes.
+ *
+ ********************************************************************************************/
+
+static void *(*Output_Thread[6])(void *) =
+  { cram_output_thread, bam_output_thread, bam_output_thread,
+    fast_output_thread, fast_output_thread, dazz_output_thread };
+
+static void (*Scan_Header[6])(Thread_Arg *) =
+  { do_nothing, skip_bam_header, sam_nearest, do_nothing, do_nothing, do_nothing };
+
+static void (*Find_Nearest[6])(Thread_Arg *) =
+  { cram_nearest, bam_nearest, sam_nearest, fast_nearest, fast_nearest, dazz_nearest };
+
+static inline int64 file_work(File_Object *inp)
+{ return ((int64) (inp->fsize * inp->dense)); }
+
+  //  Estimate the # of bases per byte of each file by decoding a small sample from its start
+
+#define PROBE_BPS  1000000
+
+static void estimate_densities(File_Object *fobj, int nfiles)
+{ Thread_Arg probe;
+  uint8     *bf;
+  int        f;
+
+  bf = Malloc(2*IO_BLOCK,"Allocating probe buffer");
+  probe.block.bases = Malloc(PROBE_BPS+1,"Allocating probe buffer");
+  probe.block.boff  = Malloc(sizeof(int)*(PROBE_BPS/100+1),"Allocating probe buffer");
+  if (bf == NULL || probe.block.bases == NULL || probe.block.boff == NULL)
+    exit (1);
+  probe.block.maxbps = PROBE_BPS;
+  probe.block.maxrds = PROBE_BPS/100;
+  probe.buf       = bf;
+  probe.zuf       = bf + IO_BLOCK;
+  probe.decomp    = libdeflate_alloc_decompressor();
+  probe.action    = SAMPLE;
+  probe.work      = 1;
+  probe.thread_id = 0;
+  probe.masked    = 0;
+  probe.dropped   = 0;
+  probe.bidx      = 0;
+  probe.eidx      = 0;
+
+  for (f = 0; f < nfiles; f++)
+    { if (fobj[f].ftype == DAZZ)
+        { fobj[f].dense = 4.;       //  .bps files are 2-bit packed
+          continue;
+        }
+      probe.fobj     = fobj+f;
+      probe.beg.fpos = 0;
+      probe.beg.boff = 0;
+      probe.end.fpos = fobj[f].fsize;
+      probe.end.boff = 0;
+      Reset_Data_Block(&probe.block,0);
+      probe.block.rem = 0;
+
+      Output_Thread[fobj[f].ftype](&probe);
+
+      if (fobj[f].ftype == CRAM)    //  Containers are read whole, so scale by record count
+        fobj[f].dense = ((1.*probe.block.totlen) / probe.block.nreads)
+                      * fobj[f].zrecs[fobj[f].zsize] / fobj[f].fsize;
+      else
+        fobj[f].dense = probe.block.totlen * probe.block.ratio;
+      if (fobj[f].dense < .01)
+        fobj[f].dense = .01;
+
+      if (VERBOSE)
+        fprintf(stderr,"  %s.%s: ~%.2f bases per byte\n",
+                       fobj[f].root,Tstring[fobj[f].ftype],fobj[f].dense);
+    }
+
+  libdeflate_free_decompressor(probe.decomp);
+  free(probe.block.boff);
+  free(probe.block.bases);
+  free(bf);
+}
+
+  //  Has a type specific output routine returned early in SAMPLE mode because the block
+  //    is (nearly) full?
+
+static int block_is_full(DATA_BLOCK *dset)
+{ return (dset->rem > 0 || dset->nreads >= dset->maxrds
+                        || dset->boff[dset->nreads] >= dset->maxbps - DT_MINIM);
+}
+
+static void *mixed_output_thread(void *arg)
+{ Thread_Arg  *parm = (Thread_Arg *) arg;
+  File_Object *fobj = parm->fobj;
+  Thread_Arg   sub;
+  double       used;
+  int          f;
+
+  used = 0.;
+  for (f = parm->bidx; f <= parm->eidx; f++)
+    { sub      = *parm;
+      sub.fobj = fobj+f;
+      sub.bidx = 0;
+      sub.eidx = 0;
+      if (f > parm->bidx)
+        { sub.beg.fpos = 0;
+          sub.beg.boff = 0;
+        }
+      if (f < parm->eidx || parm->end.fpos >= fobj[f].fsize)
+        { sub.end.fpos = fobj[f].fsize;
+          if (fobj[f].ftype == DAZZ)
+            sub.end.boff = fobj[f].zsize;
+          else
+            sub.end.boff = 0;
+        }
+      if (parm->action == SAMPLE)
+        sub.work = 1;
+
+      Output_Thread[fobj[f].ftype](&sub);
+
+      parm->block   = sub.block;
+      parm->masked  = sub.masked;
+      parm->dropped = sub.dropped;
+      if (parm->action == SAMPLE)
+        { used += fobj[f].dense / sub.block.ratio;    //  ratio = 1 / bytes read
+          if (block_is_full(&parm->block))
+            break;
+        }
+      else
+        Reset_Data_Block(&parm->block,0);
+    }
+
+  if (parm->action == SAMPLE)
+    parm->block.ratio = parm->work / used;
+  return (NULL);
+}
+
+
 /****************************************************************************************
  *
  *  The top-level interface
@@ -2319,13 +3151,11 @@ static void *dazz_output_thread(void *arg)
 
 Input_Partition *Partition_Input(int argc, char *argv[])
 { int         nfiles;
-  int         ftype;
+  int         mixed;
   int         need_decon;
   int         need_buf;
   int         need_zuf;
   void *    (*output_thread)(void *);
-  void      (*scan_header)(Thread_Arg *);
-  void      (*find_nearest)(Thread_Arg *);
 
   File_Object *fobj;
   Thread_Arg  *parm;
@@ -2337,6 +3167,42 @@ Input_Partition *Partition_Input(int argc, char *argv[])
   if (parm == NULL || fobj == NULL)
     exit (1);
 
+  //  A single source that is stdin or a named pipe is streamed
+
+  if (nfiles == 1 && open_stream(argv[1],fobj))
+    { int t;
+
+      if (QUAL_MIN > 0)
+        { fprintf(stderr,"\n%s: Quality masking (-q) is not supported for streamed input\n",
+                         Prog_Name);
+          exit (1);
+        }
+      if (DO_PROFILE)
+        ITHREADS = 1;
+      else
+        ITHREADS = NTHREADS;
+      for (t = 0; t < NTHREADS; t++)
+        { parm[t].fobj      = fobj;
+          parm[t].bidx      = 0;
+          parm[t].eidx      = 0;
+          parm[t].thread_id = t;
+          parm[t].action    = SPLIT;
+          parm[t].masked    = 0;
+          parm[t].dropped   = 0;
+          parm[t].buf       = NULL;
+          parm[t].zuf       = NULL;
+          parm[t].decomp    = NULL;
+        }
+      parm[0].work = 0;
+
+      if (VERBOSE)
+        { fprintf(stderr,"\nStreaming .%s input from %s to %d thread%s\n",
+                         Tstring[fobj->ftype],fobj->path,ITHREADS,ITHREADS>1?"s":"");
+          fflush(stderr);
+        }
+      return ((Input_Partition *) parm);
+    }
+
   //  Find partition points dividing data in all files into NTHREADS roughly equal parts
   //    and then in parallel threads produce the output for each part.
 
@@ -2350,66 +3216,43 @@ Input_Partition *Partition_Input(int argc, char *argv[])
     need_decon = 0;
     need_zuf   = 0;
     need_buf   = 0;
-    ftype      = FASTA;
-    output_thread = fast_output_thread;
-    scan_header   = do_nothing;
-    find_nearest  = fast_nearest;
+    mixed      = 0;
 
-    work = 0;
     for (f = 0; f < nfiles; f++)
       { Fetch_File(argv[f+1],fobj+f);
 
-        if (f > 0)
-          { if (fobj[f].ftype != ftype)
-              { fprintf(stderr,"\n%s: All files must be of the same type\n",Prog_Name);
-                exit (1);
-              }
-          }
-        else
-          { ftype = fobj[0].ftype;
-            if (ftype == FASTA || ftype == FASTQ)
-              { output_thread = fast_output_thread;
-                  scan_header   = do_nothing;
-                find_nearest  = fast_nearest;
-              }
-            else if (ftype == BAM)
-              { output_thread = bam_output_thread;
-                scan_header   = skip_bam_header;
-                find_nearest  = bam_nearest;
-              }
-            else if (ftype == SAM)
-              { output_thread = bam_output_thread;
-                scan_header   = sam_nearest;
-                find_nearest  = sam_nearest;
-              }
-            else if (ftype == CRAM)
-              { output_thread = cram_output_thread;
-                scan_header   = do_nothing;
-                find_nearest  = cram_nearest;
-              }
-            else // ftype == DAM or DB
-              { output_thread = dazz_output_thread;
-                scan_header   = do_nothing;
-                find_nearest  = dazz_nearest;
-              }
-          }
-        if (ftype == CRAM || ftype == DAZZ)
-          need_buf = 0;
-        else
+        if (fobj[f].ftype != fobj[0].ftype)
+          mixed = 1;
+        if (fobj[f].ftype != CRAM && fobj[f].ftype != DAZZ)
           need_buf = 1;
-        if (ftype == BAM)
+        if (fobj[f].ftype == BAM)
           need_decon = 1;
         else if (fobj[f].zipd)
           { need_decon = 1;
             need_zuf   = 1;
           }
+        fobj[f].dense = 1.;
+      }
 
-        work += fobj[f].fsize;
+    if (mixed)
+      { if (VERBOSE)
+          fprintf(stderr,"\nEstimating the bases in each file of mixed type\n");
+        estimate_densities(fobj,nfiles);
+        output_thread = mixed_output_thread;
       }
+    else
+      output_thread = Output_Thread[fobj[0].ftype];
+
+    work = 0;
+    for (f = 0; f < nfiles; f++)
+      work += file_work(fobj+f);
     parm[0].work = work;
 
     if (VERBOSE)
-      { if (nfiles > 1)
+      { if (mixed)
+          fprintf(stderr,"\nPartitioning %d files of mixed type into %d parts\n",
+                         nfiles,NTHREADS);
+        else if (nfiles > 1)
           fprintf(stderr,"\nPartitioning %d %s.%s files into %d parts\n",
                          nfiles,fobj->zipd?"compressed ":"",Tstring[fobj->ftype],NTHREADS);
         else
@@ -2445,13 +3288,13 @@ Input_Partition *Partition_Input(int argc, char *argv[])
 
     f = 0;
     t = -1;
-    w = fobj[f].fsize;
+    w = file_work(fobj+f);
     for (i = 0; i < ITHREADS; i++)
       { while (w < (i*work)/ITHREADS - .01*IO_BLOCK)
           { f += 1;
-            w += fobj[f].fsize;
+            w += file_work(fobj+f);
           }
-        b = (i*work)/ITHREADS - (w-fobj[f].fsize); 
+        b = ((i*work)/ITHREADS - (w-file_work(fobj+f))) / fobj[f].dense; 
         if (b < 0)
           b = 0;
 
@@ -2463,6 +3306,8 @@ Input_Partition *Partition_Input(int argc, char *argv[])
         parm[t].output_thread = output_thread;
         parm[t].thread_id     = t;
         parm[t].action        = SPLIT;
+        parm[t].masked        = 0;
+        parm[t].dropped       = 0;
         if (need_buf)
           if (need_zuf)
             { parm[t].buf = bf + 2*t*IO_BLOCK;
@@ -2482,13 +3327,13 @@ Input_Partition *Partition_Input(int argc, char *argv[])
 
             parm[t].beg.fpos = 0;
             parm[t].beg.boff = 0;
-            scan_header(parm+t);
+            Scan_Header[fobj[f].ftype](parm+t);
             parm[t].end = parm[t].beg;
 
             parm[t].beg.fpos = b;
             parm[t].bidx = f;
 
-            find_nearest(parm+t);
+            Find_Nearest[fobj[f].ftype](parm+t);
             close(parm[t].fid);
 
             if (parm[t].beg.fpos < 0)
@@ -2577,20 +3422,22 @@ Input_Partition *Partition_Input(int argc, char *argv[])
 #endif
   }
 
-  if (ftype == DAZZ)
-    { int   f;
-      FILE *idx;
+  { int   f;
+    FILE *idx;
 
-      for (f = 0; f < nfiles; f++)
+    for (f = 0; f < nfiles; f++)
+      if (fobj[f].ftype == DAZZ)
         { strcpy(fobj[f].path+(strlen(fobj[f].path)-3),"idx");
           idx = fopen(fobj[f].path,"r");
           fobj[f].zsize = get_dazz_lengths(idx,fobj[f].zoffs,fobj[f].DB_cut,fobj[f].DB_all);
           fclose(idx);
           strcpy(fobj[f].path+(strlen(fobj[f].path)-3),"bps");
         }
+    if (fobj[nfiles-1].ftype == DAZZ)
       parm[ITHREADS-1].end.boff = fobj[nfiles-1].zsize;
+    if (fobj[0].ftype == DAZZ)
       parm[0].beg.boff = 0;
-    }
+  }
 
   return ((Input_Partition *) parm);
 }
@@ -2615,7 +3462,10 @@ DATA_BLOCK *Get_First_Block(Input_Partition *parts, int64 numbp)
 
   Reset_Data_Block(&cust.block,0);
   cust.block.rem = 0;
-  cust.output_thread(&cust);
+  if (Stream.on)
+    stream_sample(&cust.block,numbp);
+  else
+    cust.output_thread(&cust);
 
 #ifdef DEBUG_TRAIN
   Print_Block(&cust.block,0);
@@ -2661,10 +3511,43 @@ void Scan_All_Input(Input_Partition *parts)
   int   *boff;
   int    i;
 
+  if (Stream.on)
+    { stream_scan(parm);
+      return;
+    }
+
   parm[0].block.ratio = cust.block.ratio * cust.block.totlen;
 
   bases = Malloc(sizeof(char)*(DT_BLOCK+1)*ITHREADS,"Allocating data blocks");
   boff  = Malloc(sizeof(int)*(DT_READS+1)*ITHREADS,"Allocating data blocks");
+  //  If there are cram files, then set up a pool of decoding threads, limiting the
+  //    read-ahead of each input thread so that the decoded containers fit in CRAM_MEMORY
+
+  { File_Object *fobj = parm[0].fobj;
+    int64        cbytes, ncont, qsize;
+    int          f;
+
+    cbytes = ncont = 0;
+    for (f = 0; f <= parm[ITHREADS-1].eidx; f++)
+      if (fobj[f].ftype == CRAM)
+        { cbytes += fobj[f].zoffs[fobj[f].zsize] - fobj[f].zoffs[0];
+          ncont  += fobj[f].zsize;
+        }
+    if (ncont > 0)
+      { qsize = CRAM_MEMORY / (ITHREADS * CRAM_EXPAND * (cbytes/ncont + 1));
+        if (qsize > 2*NTHREADS)
+          qsize = 2*NTHREADS;
+        if (qsize < 1)
+          qsize = 1;
+        cram_pool.pool  = hts_tpool_init(NTHREADS);
+        cram_pool.qsize = qsize;
+        if (cram_pool.pool == NULL)
+          { fprintf(stderr,"\n%s: Could not create cram decoding threads\n",Prog_Name);
+            exit (1);
+          }
+      }
+  }
+
   for (i = 0; i < ITHREADS; i++)
     { parm[i].block.bases  = bases + (DT_BLOCK+1)*i;
       parm[i].block.boff   = boff  + (DT_READS+1)*i;
@@ -2687,6 +3570,11 @@ void Scan_All_Input(Input_Partition *parts)
     pthread_join(threads[i],NULL);
 #endif
 
+  if (cram_pool.pool != NULL)
+    { hts_tpool_destroy(cram_pool.pool);
+      cram_pool.pool = NULL;
+    }
+
 #ifdef DEBUG_OUT
   exit (0);
 #endif
@@ -2694,6 +3582,23 @@ void Scan_All_Input(Input_Partition *parts)
   free(boff);
 }
 
+  //  Return the # of bases masked for low quality by Scan_All_Input, and in *dropped the #
+  //    of the other bases dropped because they are in runs shorter than KMER
+
+int64 Masked_Bases(Input_Partition *parts, int64 *dropped)
+{ Thread_Arg *parm = (Thread_Arg *) parts;
+  int64       masked;
+  int         i;
+
+  masked   = 0;
+  *dropped = 0;
+  for (i = 0; i < ITHREADS; i++)
+    { masked   += parm[i].masked;
+      *dropped += parm[i].dropped;
+    }
+  return (masked);
+}
+
   //  Free an Input_Partition data structure
 
 void Free_Input_Partition(Input_Partition *parts)
@@ -2704,6 +3609,12 @@ void Free_Input_Partition(Input_Partition *parts)
     for (i = 0; i < ITHREADS; i++)
       libdeflate_free_decompressor(parm[i].decomp);
   free(parm[0].buf);
+  if (Stream.on)
+    { if (Stream.fid != 0)
+        close(Stream.fid);
+      free(Stream.train);
+      Stream.on = 0;
+    }
   for (f = 0; f <= parm[ITHREADS-1].eidx; f++)
     Free_File(parm[0].fobj+f);
   free(parm[0].fobj);
@@ -7,6 +7,9 @@
  *
  *******************************************************************************************/
 
+#include <sys/mman.h>
+#include <pthread.h>
+
 #include "libfastk.h"
 
 #include "gene_core.c"
@@ -103,9 +106,18 @@ typedef struct
     int     tbyte;        //  Kmer+count entry in bytes
     int64   nels;         //  # of unique, sorted k-mers in the table
     uint8  *table;        //  The (huge) table in memory
-    void   *index;        //  Accelerator index for searches
+    int     mapped;       //  Non-zero if the table is mapped from its file rather than read
+    int64  *index;        //  Accelerator index for searches on the first pbits of a k-mer
+    uint8  *map;          //  If non-NULL then table is mapped from a file, map[0..msize)
+    int64   msize;
+    uint8  *imap;         //  If non-NULL then index is mapped from a .kidx file, imap[0..imsize)
+    int64   imsize;
+    int     pbits;
   } _Kmer_Table;
 
+static void   map_accelerator(_Kmer_Table *T, char *name);
+static uint64 table_signature(Kmer_Table *T);
+
 /****************************************************************************************
  *
  *  Print & compare utilities
@@ -173,6 +185,160 @@ static inline void mycpy(uint8 *a, uint8 *b, int n)
     *a++ = *b++;
 }
 
+  //  Run thread on parm[0..nthreads), each of size bytes, in parallel
+
+static void run_threads(void *(*thread)(void *), void *parm, int size, int nthreads)
+{ pthread_t threads[nthreads];
+  int       t;
+
+  for (t = 1; t < nthreads; t++)
+    pthread_create(threads+t,NULL,thread,((char *) parm)+t*size);
+  thread(parm);
+  for (t = 1; t < nthreads; t++)
+    pthread_join(threads[t],NULL);
+}
+
+
+/****************************************************************************************
+ *
+ *  Compressed table parts.  A table whose stub has a non-zero 4th integer has parts that
+ *    hold their entries in blocks of ZIP_BLOCK.  A part is the k-mer length & # of entries
+ *    as usual, then the # of blocks nblk, the offsets of the blocks in the file, boff[0..nblk]
+ *    (boff[nblk] = file size), the first k-mer of each block (kbyte bytes each), and then
+ *    the blocks.  A block is a byte giving the # of bits, cbits, used per count, the counts
+ *    packed cbits at a time (low order first), and then for each k-mer after the first, the
+ *    # of leading bytes it shares with its predecessor followed by its remaining bytes.
+ *
+ *****************************************************************************************/
+
+#define ZIP_BLOCK  1024
+
+typedef struct
+  { int64  nblk;    //  # of blocks in the part
+    int64  nels;    //  # of entries in the part
+    int64 *boff;    //  boff[b] = offset of block b in the part file, boff[nblk] = file size
+    uint8 *first;   //  first[b*kbyte..(b+1)*kbyte) = first k-mer of block b
+  } Zip_Part;
+
+  //  Read the directory of a compressed part whose file f is just past its # of entries
+
+static void read_zip_part(int f, int64 nels, int kbyte, Zip_Part *z)
+{ read(f,&(z->nblk),sizeof(int64));
+  z->nels = nels;
+  z->boff = Malloc((z->nblk+1)*sizeof(int64)+z->nblk*kbyte+1,"Allocating block directory");
+  if (z->boff == NULL)
+    exit (1);
+  z->first = (uint8 *) (z->boff + (z->nblk+1));
+  read(f,z->boff,(z->nblk+1)*sizeof(int64));
+  read(f,z->first,z->nblk*kbyte);
+}
+
+  //  Largest number of bytes a block can occupy (plus slack for the count decoder)
+
+static inline int64 zip_block_max(int kbyte)
+{ return (1 + 2*ZIP_BLOCK + ZIP_BLOCK*(kbyte+1) + 8); }
+
+  //  Encode the n entries at in as a block at out, returning its size in bytes
+
+static int64 zip_encode(uint8 *in, int n, int kbyte, int tbyte, uint8 *out)
+{ uint8 *o, *p, *q;
+  int    i, c, cbits, lcp;
+  int64  pos;
+
+  c = 0;
+  for (i = 0; i < n; i++)
+    c |= COUNT_OF(in+i*tbyte);
+  for (cbits = 1; (c >> cbits) != 0; cbits++)
+    ;
+
+  out[0] = cbits;
+  o = out+1;
+  for (i = (n*cbits+7) >> 3; i-- > 0; )
+    o[i] = 0;
+  for (i = 0, pos = 0; i < n; i++, pos += cbits)
+    { c = COUNT_OF(in+i*tbyte) << (pos & 0x7);
+      o[pos>>3]     |= c;
+      o[(pos>>3)+1] |= (c >> 8);
+      o[(pos>>3)+2] |= (c >> 16);
+    }
+  o += (n*cbits+7) >> 3;
+
+  for (i = 1; i < n; i++)
+    { p = in + (i-1)*tbyte;
+      q = p + tbyte;
+      for (lcp = 0; lcp < kbyte && p[lcp] == q[lcp]; lcp++)
+        ;
+      *o++ = lcp;
+      mycpy(o,q+lcp,kbyte-lcp);
+      o += kbyte-lcp;
+    }
+
+  return (o-out);
+}
+
+  //  Decode the block of n entries at in whose first k-mer is first into out
+
+static void zip_decode(uint8 *in, int n, uint8 *first, int kbyte, int tbyte, uint8 *out)
+{ uint8 *o, *cnt;
+  int    i, cbits, mask, lcp;
+  int64  pos;
+  uint32 w;
+
+  cbits = in[0];
+  mask  = (1 << cbits) - 1;
+  cnt   = in+1;
+  in   += 1 + ((n*cbits+7) >> 3);
+
+  memcpy(out,first,kbyte);
+  for (i = 1, o = out+tbyte; i < n; i++, o += tbyte)
+    { lcp = *in++;
+      memcpy(o,o-tbyte,kbyte);
+      memcpy(o+lcp,in,kbyte-lcp);
+      in += kbyte-lcp;
+    }
+
+  for (i = 0, pos = 0, o = out+kbyte; i < n; i++, pos += cbits, o += tbyte)
+    { in = cnt + (pos>>3);
+      w  = in[0] | (in[1] << 8) | (in[2] << 16);
+      *((uint16 *) o) = (w >> (pos & 0x7)) & mask;
+    }
+}
+
+  //  Decode all the blocks of the compressed part f (just past its # of entries) into table
+
+static void read_zip_table(int f, int64 nels, int kbyte, uint8 *table)
+{ int      tbyte = kbyte+2;
+  Zip_Part z;
+  uint8   *zbuf;
+  int64    b;
+  int      n;
+
+  read_zip_part(f,nels,kbyte,&z);
+  zbuf = Malloc(zip_block_max(kbyte),"Allocating block buffer");
+  if (zbuf == NULL)
+    exit (1);
+  lseek(f,z.boff[0],SEEK_SET);
+  for (b = 0; b < z.nblk; b++)
+    { n = ZIP_BLOCK;
+      if (b*ZIP_BLOCK + n > nels)
+        n = nels - b*ZIP_BLOCK;
+      read(f,zbuf,z.boff[b+1]-z.boff[b]);
+      zip_decode(zbuf,n,z.first+b*kbyte,kbyte,tbyte,KMER(b*ZIP_BLOCK));
+    }
+  free(zbuf);
+  free(z.boff);
+}
+
+  //  Return 1 if the stub file f (positioned after its first 3 integers) is of a compressed table
+
+static int is_zip_stub(int f)
+{ int zip;
+
+  if (read(f,&zip,sizeof(int)) != sizeof(int))
+    return (0);
+  return (zip != 0);
+}
+
 
 /****************************************************************************************
  *
@@ -202,7 +368,7 @@ Kmer_Table *Load_Kmer_Table(char *name, int cut_off)
 
   int    f, x;
   char  *dir, *root, *full;
-  int    smer, nthreads;
+  int    smer, nthreads, zip;
 
   setup_fmer_table();
 
@@ -224,6 +390,7 @@ Kmer_Table *Load_Kmer_Table(char *name, int cut_off)
   read(f,&smer,sizeof(int));
   read(f,&nthreads,sizeof(int));
   read(f,&minval,sizeof(int));
+  zip = is_zip_stub(f);
   close(f);
 
   kmer  = smer;
@@ -302,7 +469,10 @@ Kmer_Table *Load_Kmer_Table(char *name, int cut_off)
           f = open(full,O_RDONLY);
           read(f,&kmer,sizeof(int));
           read(f,&n,sizeof(int64));
-          big_read(f,KMER(nels),n*tbyte);
+          if (zip)
+            read_zip_table(f,n,kbyte,KMER(nels));
+          else
+            big_read(f,KMER(nels),n*tbyte);
           nels += n;
           close(f);
         }
@@ -316,7 +486,113 @@ Kmer_Table *Load_Kmer_Table(char *name, int cut_off)
   T->kbyte  = kbyte;
   T->nels   = nels;
   T->table  = table;
+  T->mapped = 0;
+  ((_Kmer_Table *) T)->index = NULL;
+  ((_Kmer_Table *) T)->map   = NULL;
+  ((_Kmer_Table *) T)->imap  = NULL;
+  if (cut_off <= minval)
+    map_accelerator((_Kmer_Table *) T,name);
+
+  return (T);
+}
+
+  //  Map rather than read the table into memory.  If the table is a single part then its
+  //    entries are contiguous in that one file and the table is simply its pages, which are
+  //    shared through the page cache by every process mapping it, so start-up is immediate.
+  //    The pages are faulted in at once if populate is set, otherwise they are faulted in as
+  //    touched.  A table in several parts cannot be presented contiguously without copying,
+  //    nor can a compressed table, and so these are loaded in full as by Load_Kmer_Table,
+  //    which the caller can tell as the mapped field of the result is then 0.
+
+#define TABLE_HEADER  (sizeof(int) + sizeof(int64))   //  k-mer length & # of entries
+
+Kmer_Table *Map_Kmer_Table(char *name, int populate)
+{ Kmer_Table *T;
+  int         kmer, tbyte, kbyte, minval;
+  int64       nels, msize;
+  uint8      *map;
+
+  int    f, flags;
+  char  *dir, *root, *full;
+  int    smer, nthreads, zip;
+
+  setup_fmer_table();
+
+  dir  = PathTo(name);
+  root = Root(name,".ktab");
+  full = Malloc(strlen(dir)+strlen(root)+20,"Table name allocation");
+  if (full == NULL)
+    exit (1);
+  sprintf(full,"%s/%s.ktab",dir,root);
+  f = open(full,O_RDONLY);
+  sprintf(full,"%s/.%s.ktab.1",dir,root);
+  free(root);
+  free(dir);
+  if (f < 0)
+    { free(full);
+      return (NULL);
+    }
+  read(f,&smer,sizeof(int));
+  read(f,&nthreads,sizeof(int));
+  read(f,&minval,sizeof(int));
+  zip = is_zip_stub(f);
+  close(f);
+
+  if (nthreads != 1 || zip)
+    { free(full);
+      return (Load_Kmer_Table(name,minval));
+    }
+
+  f = open(full,O_RDONLY);
+  if (f < 0)
+    { fprintf(stderr,"Table part %s is missing ?\n",full);
+      exit (1);
+    }
+  read(f,&kmer,sizeof(int));
+  read(f,&nels,sizeof(int64));
+  if (kmer != smer)
+    { fprintf(stderr,"Table part %s does not have k-mer length matching stub ?\n",full);
+      exit (1);
+    }
+
+  kbyte = (kmer+3)>>2;
+  tbyte = kbyte+2;
+  msize = TABLE_HEADER + nels*tbyte;
+
+  flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  if (populate)
+    flags |= MAP_POPULATE;
+#endif
+  map = mmap(NULL,msize,PROT_READ,flags,f,0);
+  close(f);
+  if (map == MAP_FAILED)
+    { fprintf(stderr,"Could not map table part %s into memory\n",full);
+      exit (1);
+    }
+  if (populate)
+    madvise(map,msize,MADV_WILLNEED);
+  else
+    madvise(map,msize,MADV_RANDOM);     //  Searches touch pages at random, so no read-ahead
+
+  free(full);
+
+  T = Malloc(sizeof(Kmer_Table),"Allocating table record");
+  if (T == NULL)
+    exit (1);
+
+  T->kmer   = kmer;
+  T->minval = minval;
+  T->tbyte  = tbyte;
+  T->kbyte  = kbyte;
+  T->nels   = nels;
+  T->table  = map + TABLE_HEADER;
+  T->mapped = 1;
   ((_Kmer_Table *) T)->index = NULL;
+  ((_Kmer_Table *) T)->map   = map;
+  ((_Kmer_Table *) T)->msize = msize;
+  ((_Kmer_Table *) T)->imap  = NULL;
+  map_accelerator((_Kmer_Table *) T,name);
 
   return (T);
 }
@@ -370,8 +646,16 @@ int Fetch_Count(Kmer_Table *T, int64 i)
 }
 
 void Free_Kmer_Table(Kmer_Table *T)
-{ free(T->table);
-  free(((_Kmer_Table *) T)->index);
+{ _Kmer_Table *P = (_Kmer_Table *) T;
+
+  if (P->map != NULL)
+    munmap(P->map,P->msize);
+  else
+    free(T->table);
+  if (P->imap != NULL)
+    munmap(P->imap,P->imsize);
+  else
+    free(P->index);
   free(T);
 }
 
@@ -435,35 +719,116 @@ void List_Kmer_Table(Kmer_Table *T, FILE *out)
  *
  *****************************************************************************************/
 
+  //  The accelerator index[v] for v in [0,2^pbits] is the index of the first entry whose
+  //    k-mer's leading pbits bits are not less than v, so that all k-mers with prefix v are
+  //    in [index[v],index[v+1]).  The width pbits is chosen from the size of the table so
+  //    that there are about 16 entries per bucket.  The index may have been saved in a
+  //    hidden .kidx file by FastK in which case it is simply mapped, otherwise it is built
+  //    by a scan of the table on the first search.  The file carries the signature of the
+  //    table so that it is not used for a different table with the same k and size.
+
+#define KIDX_HEADER  (2*sizeof(int) + 2*sizeof(int64))   //  k-mer length, pbits, nels, & sig
+
+#define KIDX_MAX_BITS  24   //  Widest prefix, i.e. an index of at most 128MB
+
+  //  FastK calls these two when it writes a .kidx so the writer and the readers always
+  //    agree on the layout of the index
+
+int Kmer_Prefix_Width(int64 nels, int kmer)
+{ int pbits;
+
+  for (pbits = 0; (1ll << pbits) < nels; pbits++)
+    ;
+  pbits -= 4;
+  if (pbits > KIDX_MAX_BITS)
+    pbits = KIDX_MAX_BITS;
+  if (pbits > 2*kmer)
+    pbits = 2*kmer;
+  if (pbits < 1)
+    pbits = 1;
+  return (pbits);
+}
+
+int64 Kmer_Prefix(uint8 *kmer, int kbyte, int pbits)
+{ uint32 x;
+  int    i;
+
+  x = 0;
+  for (i = 0; i < 4; i++)
+    x = (x << 8) | (i < kbyte ? kmer[i] : 0);
+  return (x >> (32-pbits));
+}
+
+static void map_accelerator(_Kmer_Table *T, char *name)
+{ char  *dir, *root, *full;
+  int    f, kmer, pbits;
+  int64  nels, size;
+  uint64 sig;
+  uint8 *imap;
+
+  dir  = PathTo(name);
+  root = Root(name,".ktab");
+  full = Malloc(strlen(dir)+strlen(root)+20,"Index name allocation");
+  if (full == NULL)
+    exit (1);
+  sprintf(full,"%s/.%s.kidx",dir,root);
+  f = open(full,O_RDONLY);
+  free(full);
+  free(root);
+  free(dir);
+  if (f < 0)
+    return;
+
+  read(f,&kmer,sizeof(int));
+  read(f,&pbits,sizeof(int));
+  read(f,&nels,sizeof(int64));
+  read(f,&sig,sizeof(uint64));
+  size = KIDX_HEADER + sizeof(int64)*((1ll << pbits) + 1);
+  if (kmer != T->kmer || nels != T->nels || pbits < 1 || pbits > 2*kmer
+                      || lseek(f,0,SEEK_END) != size || sig != table_signature((Kmer_Table *) T))
+    { close(f);                     //  Stale or not for this table: build one if needed
+      return;
+    }
+
+  imap = mmap(NULL,size,PROT_READ,MAP_SHARED,f,0);
+  close(f);
+  if (imap == MAP_FAILED)
+    return;
+
+  T->imap   = imap;
+  T->imsize = size;
+  T->index  = (int64 *) (imap + KIDX_HEADER);
+  T->pbits  = pbits;
+}
+
 static void set_up_accelerator(_Kmer_Table *T)
 { int     tbyte = T->tbyte;
+  int     kbyte = T->kbyte;
   int64   nels  = T->nels;
   uint8  *table = T->table;
   int64  *index;
 
-  uint8 *iptr, *nptr;
-  int64  i;
-  int    idx, val;
+  int64  i, idx, val, top;
+  int    pbits;
 
-  index = Malloc(sizeof(uint8 *)*0x1000001,"Allocating acceleraator");
+  pbits = Kmer_Prefix_Width(nels,T->kmer);
+  top   = (1ll << pbits);
+
+  index = Malloc(sizeof(int64)*(top+1),"Allocating accelerator");
   if (index == NULL)
     exit (1);
 
-  idx  = 1;
-  iptr = table;
-  nptr = KMER(nels);
-  index[0] = 0;
-  for (i = 1, iptr += tbyte; iptr < nptr; i++, iptr += tbyte)
-    { if (mycmp(iptr,iptr-tbyte,3) == 0)
-        continue;
-      val = (iptr[0] << 16) | (iptr[1] << 8) | iptr[2];
+  idx = 0;
+  for (i = 0; i < nels; i++)
+    { val = Kmer_Prefix(KMER(i),kbyte,pbits);
       while (idx <= val)
         index[idx++] = i;
     }
-  while (idx <= 0x1000000)
+  while (idx <= top)
     index[idx++] = nels;
 
   T->index = index;
+  T->pbits = pbits;
 }
 
 static uint8 code[128] =
@@ -544,18 +909,18 @@ static void compress_comp(char *s, int len, uint8 *t)
   s2 = s1-1;
   s3 = s2-1;
 
-  c = s0[0];
-  d = s1[0];
-  e = s2[0];
-  s0[0] = s1[0] = s2[0] = 3;
+  c = s1[0];
+  d = s2[0];
+  e = s3[0];
+  s1[0] = s2[0] = s3[0] = 3;
 
   for (i = len-1; i >= 0; i -= 4)
     *t++ = ((comp[(int) s0[i]] << 6) | (comp[(int) s1[i]] << 4)
          |  (comp[(int) s2[i]] << 2) | comp[(int) s3[i]] );
 
-  s0[0] = c;
-  s1[0] = d;
-  s2[0] = e;
+  s1[0] = c;
+  s2[0] = d;
+  s3[0] = e;
 }
 
 int64 Find_Kmer(Kmer_Table *T, char *kseq)
@@ -575,20 +940,15 @@ int64 Find_Kmer(Kmer_Table *T, char *kseq)
   else
     compress_comp(kseq,kmer,cmp);
 
-  if (kbyte >= 3)
-    { int64 *index = ((_Kmer_Table *) T)->index;
-      if (index == NULL)
-        { set_up_accelerator((_Kmer_Table *) T);
-          index = ((_Kmer_Table *) T)->index;
-        }
-      m = (cmp[0] << 16) | (cmp[1] << 8) | cmp[2];
-      l = index[m];
-      r = index[m+1];
-    }
-  else
-    { l = 0;
-      r = nels;
-    }
+  { int64 *index = ((_Kmer_Table *) T)->index;
+    if (index == NULL)
+      { set_up_accelerator((_Kmer_Table *) T);
+        index = ((_Kmer_Table *) T)->index;
+      }
+    m = Kmer_Prefix(cmp,kbyte,((_Kmer_Table *) T)->pbits);
+    l = index[m];
+    r = index[m+1];
+  }
 
   // smallest l s.t. KMER(l) >= (kmer) cmp  (or nels if does not exist)
 
@@ -606,350 +966,2057 @@ int64 Find_Kmer(Kmer_Table *T, char *kseq)
   return (l);
 }
 
-/****************************************************************************************
- *
- *  K-MER STREAM CODE
- *
- *****************************************************************************************/
+  //  Batched searches: the k-mers are canonicalized and then searched for BATCH_SIZE at a
+  //    time, with the binary searches of a batch advanced in lockstep.  The table entry
+  //    each search will probe next is prefetched a full round before it is compared, so
+  //    that the cache misses of a batch overlap rather than each search waiting on its own.
 
-typedef struct
-  { int    kmer;    //  Kmer length
-    int    minval;  //  The minimum count of a k-mer in the stream
-    int    kbyte;   //  Kmer encoding in bytes
-    int    tbyte;   //  Kmer+count entry in bytes
-    int64  nels;    //  # of elements in entire table
-    uint8 *celm;    //  Current entry (in buffer)
-    int64  cidx;    //  Index of current entry (in table as a whole)
+#define BATCH_SIZE  16
 
-    int    copn;    //  File currently open
-    int    part;    //  Thread # of file currently open
-    int    nthr;    //  # of thread parts
-    char  *name;    //  Path name for table parts (only # missing)
-    int    nlen;    //  length of path name
-    uint8 *table;   //  The table memory buffer
-    uint8 *ctop;    //  Ptr top of current table block in buffer
-    int64 *neps;    //  Size of each thread part in elements
-  } _Kmer_Stream;
+static void batch_search(_Kmer_Table *T, int n, uint8 *cmps, int64 *out)
+{ int    tbyte = T->tbyte;
+  int    kbyte = T->kbyte;
+  int    pbits = T->pbits;
+  int64  nels  = T->nels;
+  uint8 *table = T->table;
+  int64 *index = T->index;
 
-#define STREAM_BLOCK 1024
+  int64  l[BATCH_SIZE], r[BATCH_SIZE];
+  int64  m;
+  uint8 *cmp;
+  int    i, live;
 
-/****************************************************************************************
- *
- *  Open a table and return as Kmer_Stream object
- *
- *****************************************************************************************/
+  for (i = 0, cmp = cmps; i < n; i++, cmp += kbyte)
+    { l[i] = Kmer_Prefix(cmp,kbyte,pbits);
+      __builtin_prefetch(index+l[i]);
+    }
 
-static void More_Kmer_Stream(_Kmer_Stream *S)
-{ int    tbyte = S->tbyte;
-  uint8 *table = S->table;
-  int    copn  = S->copn;
-  uint8 *ctop;
-  int64  rels;
-  int    kmer;
+  for (i = 0; i < n; i++)
+    { m = l[i];
+      l[i] = index[m];
+      r[i] = index[m+1];
+      __builtin_prefetch(KMER((l[i]+r[i]) >> 1));
+    }
 
-  if (S->part > S->nthr)
-    return;
-  while (1)
-    { ctop = table + read(copn,table,STREAM_BLOCK*tbyte);
-      if (ctop > table)
-        break;
-      close(copn);
-      S->part += 1;
-      if (S->part > S->nthr)
-        { S->celm = NULL;
-          return;
-        }
-      sprintf(S->name+S->nlen,"%d",S->part);
-      copn = open(S->name,O_RDONLY);
-      read(copn,&kmer,sizeof(int));
-      read(copn,&rels,sizeof(int64));
+  //  smallest l s.t. KMER(l) >= (kmer) cmp  (or nels if does not exist)
+
+  do
+    { live = 0;
+      for (i = 0, cmp = cmps; i < n; i++, cmp += kbyte)
+        if (l[i] < r[i])
+          { m = ((l[i]+r[i]) >> 1);
+            if (mycmp(KMER(m),cmp,kbyte) < 0)
+              l[i] = m+1;
+            else
+              r[i] = m;
+            __builtin_prefetch(KMER((l[i]+r[i]) >> 1));
+            live = 1;
+          }
     }
-  S->celm = table;
-  S->ctop = ctop;
-  S->copn = copn;
+  while (live);
+
+  for (i = 0, cmp = cmps; i < n; i++, cmp += kbyte)
+    if (l[i] >= nels || mycmp(KMER(l[i]),cmp,kbyte) != 0)
+      out[i] = -1;
+    else
+      out[i] = l[i];
 }
 
-Kmer_Stream *Open_Kmer_Stream(char *name)
-{ _Kmer_Stream *S;
-  int           kmer, tbyte, kbyte, minval;
-  int64         nels;
-  int           copn;
+  //  Place the lesser of the packed k-mer s and its reverse complement in t
 
-  int    f;
-  char  *dir, *root, *full;
-  int    smer, nthreads;
-  int    p;
-  int64  n;
+static void canonical_pack(uint8 *s, int kmer, int kbyte, uint8 *t)
+{ uint8 rev[kbyte];
+  int   i, x, shift;
 
-  setup_fmer_table();
+  for (i = 0; i < kbyte; i++)
+    { x = (uint8) ~s[kbyte-1-i];
+      rev[i] = ((x & 0x03) << 6) | ((x & 0x0c) << 2) | ((x & 0x30) >> 2) | ((x & 0xc0) >> 6);
+    }
+  shift = 2*(4*kbyte - kmer);
+  if (shift > 0)
+    { for (i = 0; i < kbyte-1; i++)
+        rev[i] = (rev[i] << shift) | (rev[i+1] >> (8-shift));
+      rev[kbyte-1] <<= shift;
+    }
 
-  //  Open stub file and get # of parts
+  if (mycmp(s,rev,kbyte) <= 0)
+    mycpy(t,s,kbyte);
+  else
+    mycpy(t,rev,kbyte);
+}
 
-  dir  = PathTo(name);
-  root = Root(name,".ktab");
-  full = Malloc(strlen(dir)+strlen(root)+20,"Histogram name allocation");
-  if (full == NULL)
-    exit (1);
-  sprintf(full,"%s/%s.ktab",dir,root);
-  f = open(full,O_RDONLY);
-  sprintf(full,"%s/.%s.ktab.",dir,root);
-  free(root);
-  free(dir);
-  if (f < 0)
-    return (NULL);
-  read(f,&smer,sizeof(int));
-  read(f,&nthreads,sizeof(int));
-  read(f,&minval,sizeof(int));
-  close(f);
+void Find_Kmers(Kmer_Table *T, int64 n, char **kseqs, int64 *out)
+{ int    kmer  = T->kmer;
+  int    kbyte = T->kbyte;
 
-  kbyte   = (smer+3)>>2;
-  tbyte    = kbyte+2;
+  uint8  cmps[BATCH_SIZE*kbyte];
+  uint8 *cmp;
+  int64  b;
+  int    i, k;
+
+  if (((_Kmer_Table *) T)->index == NULL)
+    set_up_accelerator((_Kmer_Table *) T);
+
+  //  each kseqs[i] must be at least kmer bp long
+
+  for (b = 0; b < n; b += BATCH_SIZE)
+    { k = BATCH_SIZE;
+      if (b+k > n)
+        k = n-b;
+      for (i = 0, cmp = cmps; i < k; i++, cmp += kbyte)
+        if (is_minimal(kseqs[b+i],kmer))
+          compress_norm(kseqs[b+i],kmer,cmp);
+        else
+          compress_comp(kseqs[b+i],kmer,cmp);
+      batch_search((_Kmer_Table *) T,k,cmps,out+b);
+    }
+}
 
-  //  Find all parts and accumulate total size
+void Find_Packed_Kmers(Kmer_Table *T, int64 n, uint8 *kmers, int64 *out)
+{ int    kmer  = T->kmer;
+  int    kbyte = T->kbyte;
 
-  S        = Malloc(sizeof(Kmer_Stream),"Allocating table record");
-  S->name  = full;
-  S->nlen  = strlen(full);
-  S->table = Malloc(STREAM_BLOCK*tbyte,"Allocating k-mer table\n");
-  S->neps  = Malloc(nthreads*sizeof(int64),"Allocating parts table of Kmer_Stream");
-  if (S == NULL || S->table == NULL || S->neps == NULL)
+  uint8  cmps[BATCH_SIZE*kbyte];
+  uint8 *cmp;
+  int64  b;
+  int    i, k;
+
+  if (((_Kmer_Table *) T)->index == NULL)
+    set_up_accelerator((_Kmer_Table *) T);
+
+  for (b = 0; b < n; b += BATCH_SIZE)
+    { k = BATCH_SIZE;
+      if (b+k > n)
+        k = n-b;
+      for (i = 0, cmp = cmps; i < k; i++, cmp += kbyte)
+        canonical_pack(kmers+(b+i)*kbyte,kmer,kbyte,cmp);
+      batch_search((_Kmer_Table *) T,k,cmps,out+b);
+    }
+}
+
+  //  Find the n packed k-mers kmers[0..n) (each kbyte bytes) with nthreads threads, placing
+  //    the index of kmers[i] in out[i].  The canonical forms of the k-mers are sorted on
+  //    their first 8 bytes, so that the searches of a batch and of successive batches probe
+  //    neighbouring accelerator buckets and table entries, and each thread searches a
+  //    contiguous range of the sorted queries.
+
+typedef struct
+  { uint64 key;    //  first 8 bytes of the canonical k-mer, big-endian
+    int64  idx;    //  position of the query in kmers
+  } Kmer_Request;
+
+typedef struct
+  { _Kmer_Table  *T;
+    Kmer_Request *reqs;
+    uint8        *cmps;
+    int64         beg, end;
+    int64        *out;
+  } Query_Arg;
+
+static int KREQ_SORT(const void *l, const void *r)
+{ Kmer_Request *x = (Kmer_Request *) l;
+  Kmer_Request *y = (Kmer_Request *) r;
+
+  if (x->key < y->key)
+    return (-1);
+  return (x->key > y->key);
+}
+
+static void *query_thread(void *arg)
+{ Query_Arg    *parm  = (Query_Arg *) arg;
+  _Kmer_Table  *T     = parm->T;
+  Kmer_Request *reqs  = parm->reqs;
+  int           kbyte = T->kbyte;
+
+  uint8  cmps[BATCH_SIZE*kbyte];
+  int64  res[BATCH_SIZE];
+  int64  b;
+  int    i, k;
+
+  for (b = parm->beg; b < parm->end; b += BATCH_SIZE)
+    { k = BATCH_SIZE;
+      if (b+k > parm->end)
+        k = parm->end-b;
+      for (i = 0; i < k; i++)
+        mycpy(cmps+i*kbyte,parm->cmps+reqs[b+i].idx*kbyte,kbyte);
+      batch_search(T,k,cmps,res);
+      for (i = 0; i < k; i++)
+        parm->out[reqs[b+i].idx] = res[i];
+    }
+
+  return (NULL);
+}
+
+void Query_Packed_Kmers(Kmer_Table *T, int64 n, uint8 *kmers, int64 *out, int nthreads)
+{ int           kmer  = T->kmer;
+  int           kbyte = T->kbyte;
+  Kmer_Request *reqs;
+  uint8        *cmps, *cmp;
+  int64         i;
+  int           j, t;
+
+  if (n <= 0)
+    return;
+  if (nthreads > n)
+    nthreads = n;
+  if (nthreads < 1)
+    nthreads = 1;
+
+  if (((_Kmer_Table *) T)->index == NULL)
+    set_up_accelerator((_Kmer_Table *) T);
+
+  reqs = Malloc(n*sizeof(Kmer_Request),"Allocating k-mer requests");
+  cmps = Malloc(n*kbyte,"Allocating k-mer requests");
+  if (reqs == NULL || cmps == NULL)
     exit (1);
 
-  nels = 0;
-  for (p = 1; p <= nthreads; p++)
+  for (i = 0, cmp = cmps; i < n; i++, cmp += kbyte)
+    { canonical_pack(kmers+i*kbyte,kmer,kbyte,cmp);
+      reqs[i].key = 0;
+      for (j = 0; j < 8; j++)
+        reqs[i].key = (reqs[i].key << 8) | (j < kbyte ? cmp[j] : 0);
+      reqs[i].idx = i;
+    }
+  qsort(reqs,n,sizeof(Kmer_Request),KREQ_SORT);
+
+  { Query_Arg parm[nthreads];
+
+    for (t = 0; t < nthreads; t++)
+      { parm[t].T    = (_Kmer_Table *) T;
+        parm[t].reqs = reqs;
+        parm[t].cmps = cmps;
+        parm[t].beg  = (n*t)/nthreads;
+        parm[t].end  = (n*(t+1))/nthreads;
+        parm[t].out  = out;
+      }
+    run_threads(query_thread,(void *) parm,sizeof(Query_Arg),nthreads);
+  }
+
+  free(cmps);
+  free(reqs);
+}
+
+  //  Place the count of each k-mer of seq[0..len) in profile[0..len-kmer] (0 if a k-mer is
+  //    not in the table) and return len-kmer+1, or 0 if len < kmer.  The table encodings of
+  //    the k-mer and its complement are each rolled a base at a time, and the lesser is
+  //    searched for in batches of BATCH_SIZE as by Find_Packed_Kmers.  A k-mer containing a
+  //    symbol other than a, c, g, or t cannot be in a table, so its count is 0.
+
+int64 Profile_Sequence(Kmer_Table *T, char *seq, int64 len, uint16 *profile)
+{ int    kmer  = T->kmer;
+  int    kbyte = T->kbyte;
+  int    tbyte = T->tbyte;
+  uint8 *table = T->table;
+
+  uint8  fwd[kbyte], rev[kbyte];
+  uint8  cmps[BATCH_SIZE*kbyte];
+  int64  res[BATCH_SIZE];
+  uint8  okay[BATCH_SIZE];
+  uint8  last[] = { 0xff, 0xc0, 0xf0, 0xfc };
+  int    fbyt, fsft, lmsk;
+  int64  n, i, p, bad;
+  int    j, k, c;
+
+  if (len < kmer)
+    return (0);
+
+  if (((_Kmer_Table *) T)->index == NULL)
+    set_up_accelerator((_Kmer_Table *) T);
+
+  fbyt = (kmer-1) >> 2;
+  fsft = 6 - 2*((kmer-1) & 0x3);
+  lmsk = last[kmer & 0x3];
+
+  bzero(fwd,kbyte);
+  bzero(rev,kbyte);
+
+  //  bad is the position of the last symbol other than a, c, g, or t, which is rolled in
+  //    as an a, so the k-mer ending at i is valid only if bad <= i-kmer
+
+  n   = len - (kmer-1);
+  k   = 0;
+  bad = -1;
+  for (i = 0; i < len; i++)
+    { c = code[((int) seq[i]) & 0x7f];
+      if (c == 0 && (seq[i] | 0x20) != 'a')
+        bad = i;
+
+      for (j = 0; j < kbyte-1; j++)
+        fwd[j] = (uint8) ((fwd[j] << 2) | (fwd[j+1] >> 6));
+      fwd[kbyte-1] <<= 2;
+      fwd[fbyt] |= (uint8) (c << fsft);
+
+      for (j = kbyte-1; j > 0; j--)
+        rev[j] = (uint8) ((rev[j] >> 2) | (rev[j-1] << 6));
+      rev[0] = (uint8) ((rev[0] >> 2) | ((3-c) << 6));
+      rev[kbyte-1] &= lmsk;
+
+      if (i < kmer-1)
+        continue;
+
+      if (mycmp(fwd,rev,kbyte) <= 0)
+        mycpy(cmps+k*kbyte,fwd,kbyte);
+      else
+        mycpy(cmps+k*kbyte,rev,kbyte);
+      okay[k] = (bad <= i-kmer);
+      k += 1;
+
+      if (k == BATCH_SIZE || i == len-1)
+        { batch_search((_Kmer_Table *) T,k,cmps,res);
+          p = (i - (kmer-1)) - (k-1);
+          for (j = 0; j < k; j++)
+            if (res[j] < 0 || ! okay[j])
+              profile[p+j] = 0;
+            else
+              profile[p+j] = COUNT(res[j]);
+          k = 0;
+        }
+    }
+
+  return (n);
+}
+
+/****************************************************************************************
+ *
+ *  K-MER HASH CODE
+ *
+ *  A minimal perfect hash of the k-mers of a table in the manner of BBHash: a cascade of
+ *    bit vectors where level l has 2 bits per k-mer not yet placed, and a k-mer is placed
+ *    at level l if it is the only one that hashes to its bit there.  The slot of a k-mer
+ *    is the rank of its bit over all the levels, and slot s holds the table index of its
+ *    k-mer in the low 40 bits and a 24-bit fingerprint of that k-mer in the high bits.
+ *    The few k-mers, if any, unplaced after HASH_LEVELS levels are kept in a sorted list.
+ *    Bits are kept in 64-byte blocks of 448 bits preceded by the rank of the block, so that
+ *    finding a slot costs a single cache line per level tried.
+ *
+ *****************************************************************************************/
+
+#define HASH_LEVELS   32
+#define HASH_GAMMA     2
+#define BLOCK_BITS   448
+#define BLOCK_WORDS    8
+#define HASH_HEADER  (2*sizeof(int) + 4*sizeof(int64))   //  kmer, nlevels, nels, nleft, nblocks, sig
+#define HASH_SAMPLES  64                                  //  # of k-mers hashed into sig
+
+#define REC_INDEX  0xffffffffffll
+#define REC_SHIFT  40
+
+typedef struct
+  { Kmer_Table *table;     //  Table whose k-mers are hashed
+    int         nlevels;   //  # of bit vector levels
+    int64       nleft;     //  # of k-mers not placed by a level
+    int64       nblocks;   //  # of 64-byte blocks in bits
+    int64      *lsize;     //  lsize[l] = # of bits in level l
+    int64      *loff;      //  loff[l] = index of first bit of level l in bits
+    uint64     *bits;      //  blocks of level bits, each preceded by its rank
+    uint64     *recs;      //  recs[s] = fingerprint & table index of k-mer in slot s
+    int64      *left;      //  sorted table indices of the nleft unplaced k-mers
+    uint8      *map;       //  If non-NULL then hash is mapped from a file, map[0..msize)
+    int64       msize;
+  } _Kmer_Hash;
+
+static inline uint64 mix64(uint64 x)
+{ x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return (x);
+}
+
+static inline uint64 kmer_hash(uint8 *a, int kbyte)
+{ uint64 h, w;
+  int    i;
+
+  h = kbyte;
+  w = 0;
+  for (i = 0; i < kbyte; i++)
+    { w = (w << 8) | a[i];
+      if ((i & 0x7) == 0x7)
+        { h = mix64(h ^ w);
+          w = 0;
+        }
+    }
+  return (mix64(h ^ w));
+}
+
+static inline int64 level_bit(_Kmer_Hash *H, uint64 h, int l)
+{ return (H->loff[l] + mix64(h + (l+1)*0x9e3779b97f4a7c15ull) % H->lsize[l]); }
+
+  //  The signature of a table hashes a sample of its k-mers including the first and last, so
+  //    that a saved hash or index is not used for a different table with the same number of
+  //    entries.  Kmer_Stream_Signature gives the same value for a table read as a stream.
+
+#define SAMPLE(j,n)  ((((n)-1)*(j))/(HASH_SAMPLES-1))
+
+static uint64 table_signature(Kmer_Table *T)
+{ int    kbyte = T->kbyte;
+  int    tbyte = T->tbyte;
+  uint8 *table = T->table;
+  uint64 sig;
+  int64  j;
+
+  sig = T->nels;
+  if (T->nels > 0)
+    for (j = 0; j < HASH_SAMPLES; j++)
+      sig = mix64(sig ^ kmer_hash(KMER(SAMPLE(j,T->nels)),kbyte));
+  return (sig);
+}
+
+uint64 Kmer_Stream_Signature(Kmer_Stream *S)
+{ uint64 sig;
+  int64  j;
+
+  sig = S->nels;
+  if (S->nels > 0)
+    for (j = 0; j < HASH_SAMPLES; j++)
+      sig = mix64(sig ^ kmer_hash(GoTo_Kmer_Index(S,SAMPLE(j,S->nels)),S->kbyte));
+  return (sig);
+}
+
+static inline uint64 hash_print(uint64 h)
+{ return (mix64(h ^ 0x5851f42d4c957f2dull) >> REC_SHIFT); }
+
+#define BIT_WORD(p)  (H->bits + ((p)/BLOCK_BITS)*BLOCK_WORDS + 1 + ((p)%BLOCK_BITS)/64)
+#define BIT_MASK(p)  (1ull << ((p) & 0x3f))
+
+  //  Return the slot of the k-mer with hash h if it is placed at some level, -1 otherwise
+
+static inline int64 hash_slot(_Kmer_Hash *H, uint64 h)
+{ uint64 *blk, *word;
+  int64   p, s;
+  int     l;
+
+  for (l = 0; l < H->nlevels; l++)
+    { p    = level_bit(H,h,l);
+      word = BIT_WORD(p);
+      if ((*word & BIT_MASK(p)) == 0)
+        continue;
+      blk = H->bits + (p/BLOCK_BITS)*BLOCK_WORDS;
+      s   = blk[0];
+      while (++blk < word)
+        s += __builtin_popcountll(*blk);
+      return (s + __builtin_popcountll(*word & (BIT_MASK(p)-1)));
+    }
+  return (-1);
+}
+
+  //  Building the hash
+
+typedef struct
+  { _Kmer_Hash *hash;
+    int64       beg;    //  Keys [beg,end) of the level (or table indices if keys == NULL)
+    int64       end;
+    int64      *keys;
+    int         level;
+    uint64     *fill;   //  Bit vector of the level under construction
+    uint64     *coll;   //  Bits of the level that more than one key hashes to
+    int64      *next;   //  Keys for the next level
+    int64       nnext;
+  } Hash_Arg;
+
+static void *hash_fill_thread(void *arg)
+{ Hash_Arg   *data  = (Hash_Arg *) arg;
+  _Kmer_Hash *H     = data->hash;
+  Kmer_Table *T     = H->table;
+  int         kbyte = T->kbyte;
+  int         tbyte = T->tbyte;
+  uint8      *table = T->table;
+  int64      *keys  = data->keys;
+  uint64     *fill  = data->fill;
+  uint64     *coll  = data->coll;
+  int64       base  = H->loff[data->level];
+
+  int64  i, p;
+  uint64 m;
+
+  for (i = data->beg; i < data->end; i++)
+    { p = level_bit(H,kmer_hash(KMER(keys == NULL ? i : keys[i]),kbyte),data->level) - base;
+      m = BIT_MASK(p);
+      if (__sync_fetch_and_or(fill+(p>>6),m) & m)
+        __sync_fetch_and_or(coll+(p>>6),m);
+    }
+
+  return (NULL);
+}
+
+static void *hash_sift_thread(void *arg)
+{ Hash_Arg   *data  = (Hash_Arg *) arg;
+  _Kmer_Hash *H     = data->hash;
+  Kmer_Table *T     = H->table;
+  int         kbyte = T->kbyte;
+  int         tbyte = T->tbyte;
+  uint8      *table = T->table;
+  int64      *keys  = data->keys;
+  uint64     *coll  = data->coll;
+  int64      *next  = data->next;
+  int64       base  = H->loff[data->level];
+
+  int64 i, k, n, p;
+
+  n = 0;
+  for (i = data->beg; i < data->end; i++)
+    { k = (keys == NULL ? i : keys[i]);
+      p = level_bit(H,kmer_hash(KMER(k),kbyte),data->level) - base;
+      if (coll[p>>6] & BIT_MASK(p))
+        next[n++] = k;
+    }
+  data->nnext = n;
+
+  return (NULL);
+}
+
+static void *hash_record_thread(void *arg)
+{ Hash_Arg   *data  = (Hash_Arg *) arg;
+  _Kmer_Hash *H     = data->hash;
+  Kmer_Table *T     = H->table;
+  int         kbyte = T->kbyte;
+  int         tbyte = T->tbyte;
+  uint8      *table = T->table;
+  uint64     *recs  = H->recs;
+
+  int64  i, s;
+  uint64 h;
+
+  for (i = data->beg; i < data->end; i++)
+    { h = kmer_hash(KMER(i),kbyte);
+      s = hash_slot(H,h);
+      if (s >= 0)
+        recs[s] = (hash_print(h) << REC_SHIFT) | i;
+    }
+
+  return (NULL);
+}
+
+Kmer_Hash *Make_Kmer_Hash(Kmer_Table *T, int nthreads)
+{ _Kmer_Hash *H;
+  Hash_Arg    parm[nthreads];
+  int64      *keys, *next;
+  int64       nkeys, nbits, nwrds, nones, p, w;
+  uint64     *fill, *coll;
+  int         l, t;
+
+  if (T->nels > REC_INDEX)
+    { fprintf(stderr,"%s: Table is too large to hash (> 2^40 entries)\n",Prog_Name);
+      exit (1);
+    }
+
+  H = Malloc(sizeof(_Kmer_Hash),"Allocating hash object");
+  if (H == NULL)
+    exit (1);
+  H->table   = T;
+  H->map     = NULL;
+  H->nlevels = 0;
+  H->nblocks = 0;
+  H->bits    = NULL;
+  H->lsize   = Malloc(sizeof(int64)*2*HASH_LEVELS,"Allocating hash levels");
+  if (H->lsize == NULL)
+    exit (1);
+  H->loff = H->lsize + HASH_LEVELS;
+
+  keys  = NULL;
+  nkeys = T->nels;
+  for (l = 0; l < HASH_LEVELS && nkeys > 0; l++)
+    { nbits = ((HASH_GAMMA*nkeys + BLOCK_BITS-1) / BLOCK_BITS) * BLOCK_BITS;
+      nwrds = nbits / 64 + 1;
+      H->lsize[l] = nbits;
+      H->loff[l]  = H->nblocks * BLOCK_BITS;
+      H->nlevels  = l+1;
+
+      fill = Malloc(sizeof(uint64)*2*nwrds,"Allocating hash level");
+      next = Malloc(sizeof(int64)*nkeys,"Allocating hash keys");
+      if (fill == NULL || next == NULL)
+        exit (1);
+      coll = fill + nwrds;
+      bzero(fill,sizeof(uint64)*2*nwrds);
+
+      for (t = 0; t < nthreads; t++)
+        { parm[t].hash  = H;
+          parm[t].beg   = (nkeys * t) / nthreads;
+          parm[t].end   = (nkeys * (t+1)) / nthreads;
+          parm[t].keys  = keys;
+          parm[t].level = l;
+          parm[t].fill  = fill;
+          parm[t].coll  = coll;
+          parm[t].next  = next + parm[t].beg;
+        }
+      run_threads(hash_fill_thread,(void *) parm,sizeof(Hash_Arg),nthreads);
+      run_threads(hash_sift_thread,(void *) parm,sizeof(Hash_Arg),nthreads);
+
+      //  Append the level's uncollided bits to the block array, and pack the keys that
+      //    collided into next for the next level
+
+      H->bits = Realloc(H->bits,sizeof(uint64)*BLOCK_WORDS*(H->nblocks+nbits/BLOCK_BITS),
+                        "Allocating hash bits");
+      if (H->bits == NULL)
+        exit (1);
+      bzero(H->bits+H->nblocks*BLOCK_WORDS,sizeof(uint64)*BLOCK_WORDS*(nbits/BLOCK_BITS));
+      for (p = 0; p < nbits; p += 64)
+        { w = p + H->loff[l];
+          *BIT_WORD(w) = fill[p>>6] & ~coll[p>>6];
+        }
+      H->nblocks += nbits/BLOCK_BITS;
+
+      nkeys = 0;
+      for (t = 0; t < nthreads; t++)
+        { memmove(next+nkeys,parm[t].next,sizeof(int64)*parm[t].nnext);
+          nkeys += parm[t].nnext;
+        }
+
+      free(fill);
+      free(keys);
+      keys = next;
+    }
+
+  H->nleft = nkeys;
+  H->left  = keys;
+
+  nones = 0;
+  for (p = 0; p < H->nblocks*BLOCK_WORDS; p += BLOCK_WORDS)
+    { H->bits[p] = nones;
+      for (w = 1; w < BLOCK_WORDS; w++)
+        nones += __builtin_popcountll(H->bits[p+w]);
+    }
+
+  H->recs = Malloc(sizeof(uint64)*(T->nels+1),"Allocating hash records");
+  if (H->recs == NULL)
+    exit (1);
+
+  for (t = 0; t < nthreads; t++)
+    { parm[t].beg = (T->nels * t) / nthreads;
+      parm[t].end = (T->nels * (t+1)) / nthreads;
+    }
+  run_threads(hash_record_thread,(void *) parm,sizeof(Hash_Arg),nthreads);
+
+  { int    kbyte = T->kbyte;
+    int    tbyte = T->tbyte;
+    uint8 *table = T->table;
+    int64  i;
+
+    for (i = 0; i < H->nleft; i++)
+      H->recs[nones+i] = (hash_print(kmer_hash(KMER(H->left[i]),kbyte)) << REC_SHIFT)
+                       | H->left[i];
+  }
+
+  return ((Kmer_Hash *) H);
+}
+
+static inline void big_write(int f, uint8 *buffer, int64 bytes)
+{ while (bytes > 0x70000000)
+    { write(f,buffer,0x70000000);
+      bytes  -= 0x70000000;
+      buffer += 0x70000000;
+    }
+  write(f,buffer,bytes);
+}
+
+int Write_Kmer_Hash(Kmer_Hash *K, char *name)
+{ _Kmer_Hash *H = (_Kmer_Hash *) K;
+  char       *dir, *root, *full;
+  uint64      sig;
+  int         f;
+
+  dir  = PathTo(name);
+  root = Root(name,".ktab");
+  full = Malloc(strlen(dir)+strlen(root)+20,"Hash name allocation");
+  if (full == NULL)
+    exit (1);
+  sprintf(full,"%s/.%s.khsh",dir,root);
+  f = open(full,O_CREAT|O_TRUNC|O_WRONLY,S_IRWXU);
+  free(full);
+  free(root);
+  free(dir);
+  if (f < 0)
+    return (1);
+
+  write(f,&(H->table->kmer),sizeof(int));
+  write(f,&(H->nlevels),sizeof(int));
+  write(f,&(H->table->nels),sizeof(int64));
+  write(f,&(H->nleft),sizeof(int64));
+  write(f,&(H->nblocks),sizeof(int64));
+  sig = table_signature(H->table);
+  write(f,&sig,sizeof(uint64));
+  write(f,H->lsize,sizeof(int64)*H->nlevels);
+  write(f,H->loff,sizeof(int64)*H->nlevels);
+  big_write(f,(uint8 *) H->bits,sizeof(uint64)*BLOCK_WORDS*H->nblocks);
+  big_write(f,(uint8 *) H->recs,sizeof(uint64)*H->table->nels);
+  big_write(f,(uint8 *) H->left,sizeof(int64)*H->nleft);
+  close(f);
+
+  return (0);
+}
+
+Kmer_Hash *Load_Kmer_Hash(Kmer_Table *T, char *name)
+{ _Kmer_Hash *H;
+  char       *dir, *root, *full;
+  int         f, kmer, nlevels;
+  int64       nels, nleft, nblocks, size;
+  uint64      sig;
+  uint8      *map;
+
+  dir  = PathTo(name);
+  root = Root(name,".ktab");
+  full = Malloc(strlen(dir)+strlen(root)+20,"Hash name allocation");
+  if (full == NULL)
+    exit (1);
+  sprintf(full,"%s/.%s.khsh",dir,root);
+  f = open(full,O_RDONLY);
+  free(full);
+  free(root);
+  free(dir);
+  if (f < 0)
+    return (NULL);
+
+  read(f,&kmer,sizeof(int));
+  read(f,&nlevels,sizeof(int));
+  read(f,&nels,sizeof(int64));
+  read(f,&nleft,sizeof(int64));
+  read(f,&nblocks,sizeof(int64));
+  read(f,&sig,sizeof(uint64));
+  size = HASH_HEADER + sizeof(int64)*(2*nlevels + BLOCK_WORDS*nblocks + nels + nleft);
+  if (kmer != T->kmer || nels != T->nels || nlevels < 0 || nlevels > HASH_LEVELS
+                      || lseek(f,0,SEEK_END) != size || sig != table_signature(T))
+    { close(f);                     //  Stale or not for this table
+      return (NULL);
+    }
+
+  map = mmap(NULL,size,PROT_READ,MAP_SHARED,f,0);
+  close(f);
+  if (map == MAP_FAILED)
+    return (NULL);
+
+  H = Malloc(sizeof(_Kmer_Hash),"Allocating hash object");
+  if (H == NULL)
+    exit (1);
+  H->table   = T;
+  H->nlevels = nlevels;
+  H->nleft   = nleft;
+  H->nblocks = nblocks;
+  H->lsize   = (int64 *) (map + HASH_HEADER);
+  H->loff    = H->lsize + nlevels;
+  H->bits    = (uint64 *) (H->loff + nlevels);
+  H->recs    = H->bits + BLOCK_WORDS*nblocks;
+  H->left    = (int64 *) (H->recs + nels);
+  H->map     = map;
+  H->msize   = size;
+
+  return ((Kmer_Hash *) H);
+}
+
+void Free_Kmer_Hash(Kmer_Hash *K)
+{ _Kmer_Hash *H = (_Kmer_Hash *) K;
+
+  if (H->map != NULL)
+    munmap(H->map,H->msize);
+  else
+    { free(H->left);
+      free(H->recs);
+      free(H->bits);
+      free(H->lsize);
+    }
+  free(H);
+}
+
+int64 Hash_Kmer(Kmer_Hash *K, char *kseq)
+{ _Kmer_Hash *H     = (_Kmer_Hash *) K;
+  Kmer_Table *T     = H->table;
+  int         kmer  = T->kmer;
+  int         tbyte = T->tbyte;
+  int         kbyte = T->kbyte;
+  uint8      *table = T->table;
+
+  uint8  cmp[kbyte];
+  uint64 h, r;
+  int64  s, l, m;
+
+  //  kseq must be at least kmer bp long
+
+  if (is_minimal(kseq,kmer))
+    compress_norm(kseq,kmer,cmp);
+  else
+    compress_comp(kseq,kmer,cmp);
+
+  h = kmer_hash(cmp,kbyte);
+  s = hash_slot(H,h);
+  if (s >= 0)
+    { r = H->recs[s];
+      if ((r >> REC_SHIFT) != hash_print(h))
+        return (-1);
+      s = (r & REC_INDEX);
+      if (mycmp(KMER(s),cmp,kbyte) != 0)
+        return (-1);
+      return (s);
+    }
+
+  l = 0;
+  s = H->nleft;
+  while (l < s)
+    { m = ((l+s) >> 1);
+      if (mycmp(KMER(H->left[m]),cmp,kbyte) < 0)
+        l = m+1;
+      else
+        s = m;
+    }
+  if (l >= H->nleft || mycmp(KMER(H->left[l]),cmp,kbyte) != 0)
+    return (-1);
+  return (H->left[l]);
+}
+
+/****************************************************************************************
+ *
+ *  K-MER STREAM CODE
+ *
+ *****************************************************************************************/
+
+typedef struct
+  { int    kmer;    //  Kmer length
+    int    minval;  //  The minimum count of a k-mer in the stream
+    int    kbyte;   //  Kmer encoding in bytes
+    int    tbyte;   //  Kmer+count entry in bytes
+    int64  nels;    //  # of elements in entire table
+    uint8 *celm;    //  Current entry (in buffer)
+    int64  cidx;    //  Index of current entry (in table as a whole)
+
+    int    copn;    //  File currently open
+    int    part;    //  Thread # of file currently open
+    int    nthr;    //  # of thread parts
+    char  *name;    //  Path name for table parts (only # missing)
+    int    nlen;    //  length of path name
+    int    zip;     //  Parts are compressed
+    uint8 *table;   //  The table memory buffer
+    uint8 *ctop;    //  Ptr top of current table block in buffer
+    int64 *neps;    //  Size of each thread part in elements
+
+    Zip_Part *zprt; //  If zip, the block directory of each part,
+    uint8    *zbuf; //    a buffer for a compressed block,
+    int64     cblk; //    and the block of the current part to be decoded next
+  } _Kmer_Stream;
+
+#define STREAM_BLOCK ZIP_BLOCK   //  A compressed block decodes into exactly one buffer load
+
+/****************************************************************************************
+ *
+ *  Open a table and return as Kmer_Stream object
+ *
+ *****************************************************************************************/
+
+  //  Decode the next block of the current compressed part into the buffer and return
+  //    the # of bytes of entries it occupies, or 0 if there are no more blocks in the part
+
+static int64 Next_Zip_Block(_Kmer_Stream *S, int copn)
+{ Zip_Part *z = S->zprt + (S->part-1);
+  int64     b = S->cblk;
+  int64     n;
+
+  if (b >= z->nblk)
+    return (0);
+  n = ZIP_BLOCK;
+  if (b*ZIP_BLOCK + n > z->nels)
+    n = z->nels - b*ZIP_BLOCK;
+  read(copn,S->zbuf,z->boff[b+1]-z->boff[b]);
+  zip_decode(S->zbuf,n,z->first+b*S->kbyte,S->kbyte,S->tbyte,S->table);
+  S->cblk = b+1;
+  return (n*S->tbyte);
+}
+
+static void More_Kmer_Stream(_Kmer_Stream *S)
+{ int    tbyte = S->tbyte;
+  uint8 *table = S->table;
+  int    copn  = S->copn;
+  uint8 *ctop;
+  int64  rels;
+  int    kmer;
+
+  if (S->part > S->nthr)
+    return;
+  while (1)
+    { if (S->zip)
+        ctop = table + Next_Zip_Block(S,copn);
+      else
+        ctop = table + read(copn,table,STREAM_BLOCK*tbyte);
+      if (ctop > table)
+        break;
+      close(copn);
+      S->part += 1;
+      if (S->part > S->nthr)
+        { S->celm = NULL;
+          return;
+        }
+      sprintf(S->name+S->nlen,"%d",S->part);
+      copn = open(S->name,O_RDONLY);
+      read(copn,&kmer,sizeof(int));
+      read(copn,&rels,sizeof(int64));
+      if (S->zip)
+        { lseek(copn,S->zprt[S->part-1].boff[0],SEEK_SET);
+          S->cblk = 0;
+        }
+    }
+  S->celm = table;
+  S->ctop = ctop;
+  S->copn = copn;
+}
+
+Kmer_Stream *Open_Kmer_Stream(char *name)
+{ _Kmer_Stream *S;
+  int           kmer, tbyte, kbyte, minval;
+  int64         nels;
+  int           copn;
+
+  int    f;
+  char  *dir, *root, *full;
+  int    smer, nthreads, zip;
+  int    p;
+  int64  n;
+
+  setup_fmer_table();
+
+  //  Open stub file and get # of parts
+
+  dir  = PathTo(name);
+  root = Root(name,".ktab");
+  full = Malloc(strlen(dir)+strlen(root)+20,"Histogram name allocation");
+  if (full == NULL)
+    exit (1);
+  sprintf(full,"%s/%s.ktab",dir,root);
+  f = open(full,O_RDONLY);
+  sprintf(full,"%s/.%s.ktab.",dir,root);
+  free(root);
+  free(dir);
+  if (f < 0)
+    return (NULL);
+  read(f,&smer,sizeof(int));
+  read(f,&nthreads,sizeof(int));
+  read(f,&minval,sizeof(int));
+  zip = is_zip_stub(f);
+  close(f);
+
+  kbyte   = (smer+3)>>2;
+  tbyte    = kbyte+2;
+
+  //  Find all parts and accumulate total size
+
+  S        = Malloc(sizeof(Kmer_Stream),"Allocating table record");
+  S->name  = full;
+  S->nlen  = strlen(full);
+  S->table = Malloc(STREAM_BLOCK*tbyte,"Allocating k-mer table\n");
+  S->neps  = Malloc(nthreads*sizeof(int64),"Allocating parts table of Kmer_Stream");
+  if (S == NULL || S->table == NULL || S->neps == NULL)
+    exit (1);
+  S->zip = zip;
+  if (zip)
+    { S->zprt = Malloc(nthreads*sizeof(Zip_Part),"Allocating parts table of Kmer_Stream");
+      S->zbuf = Malloc(zip_block_max(kbyte),"Allocating block buffer");
+      if (S->zprt == NULL || S->zbuf == NULL)
+        exit (1);
+    }
+
+  nels = 0;
+  for (p = 1; p <= nthreads; p++)
+    { sprintf(S->name+S->nlen,"%d",p);
+      copn = open(S->name,O_RDONLY);
+      if (copn < 0)
+        { fprintf(stderr,"%s: Table part %s is missing ?\n",Prog_Name,S->name);
+          exit (1);
+        }
+      read(copn,&kmer,sizeof(int));
+      read(copn,&n,sizeof(int64));
+      if (zip)
+        read_zip_part(copn,n,kbyte,S->zprt+(p-1));
+      nels += n;
+      S->neps[p-1] = nels;
+      if (kmer != smer)
+        { fprintf(stderr,"%s: Table part %s does not have k-mer length matching stub ?\n",
+                         Prog_Name,S->name);
+          exit (1);
+        }
+      close(copn);
+    }
+
+  //  Allocate in-memory buffer & establish initial condition
+
+  S->kmer   = kmer;
+  S->minval = minval;
+  S->tbyte  = tbyte;
+  S->kbyte  = kbyte;
+  S->nels   = nels;
+
+  sprintf(S->name+S->nlen,"%d",1);
+  copn = open(S->name,O_RDONLY);
+  read(copn,&kmer,sizeof(int));
+  read(copn,&n,sizeof(int64));
+  if (zip)
+    { lseek(copn,S->zprt[0].boff[0],SEEK_SET);
+      S->cblk = 0;
+    }
+
+  S->copn  = copn;
+  S->part  = 1;
+  S->nthr  = nthreads;
+
+  More_Kmer_Stream(S);
+  S->cidx  = 0;
+
+  return ((Kmer_Stream *) S);
+}
+
+/****************************************************************************************
+ *
+ *  Free, Iterate, and Get Stream Entries
+ *
+ *****************************************************************************************/
+
+inline uint8 *First_Kmer_Entry(Kmer_Stream *_S)
+{ _Kmer_Stream *S = (_Kmer_Stream *) _S;
+
+  if (S->cidx != 0)
+    { if (S->part != 1)
+        { if (S->part <= S->nthr)
+            close(S->copn);
+          sprintf(S->name+S->nlen,"%d",1);
+          S->copn = open(S->name,O_RDONLY);
+          S->part = 1;
+        }
+
+      if (S->zip)
+        { lseek(S->copn,S->zprt[0].boff[0],SEEK_SET);
+          S->cblk = 0;
+        }
+      else
+        lseek(S->copn,sizeof(int)+sizeof(int64),SEEK_SET);
+
+      More_Kmer_Stream(S);
+      S->cidx = 0;
+    }
+
+  return (S->celm);
+}
+
+inline uint8 *GoTo_Kmer_Index(Kmer_Stream *_S, int64 i)
+{ _Kmer_Stream *S = (_Kmer_Stream *) _S;
+  int p;
+
+  if (i < 0 || i >= S->nels)
+    return (NULL);
+
+  if (S->cidx != i)
+    { S->cidx = i;
+
+      p = 0;
+      while (i >= S->neps[p])
+        p += 1;
+      
+      if (p > 0)
+        i -= S->neps[p-1];
+      p += 1;
+
+      if (S->part != p)
+        { if (S->part <= S->nthr)
+            close(S->copn);
+          sprintf(S->name+S->nlen,"%d",p);
+          S->copn = open(S->name,O_RDONLY);
+          S->part = p;
+        }
+
+      if (S->zip)
+        { S->cblk = i / ZIP_BLOCK;
+          lseek(S->copn,S->zprt[p-1].boff[S->cblk],SEEK_SET);
+          More_Kmer_Stream(S);
+          S->celm += (i % ZIP_BLOCK) * S->tbyte;
+        }
+      else
+        { lseek(S->copn,sizeof(int) + sizeof(int64) + i*S->tbyte,SEEK_SET);
+          More_Kmer_Stream(S);
+        }
+    }
+
+  return (S->celm);
+}
+
+  //  For a compressed table find the last block whose first k-mer is less than entry with
+  //    a binary search of the block directories, and scan forward from its start
+
+static uint8 *GoTo_Zip_String(_Kmer_Stream *S, uint8 *entry)
+{ int       kbyte = S->kbyte;
+  Zip_Part *z;
+  int       p, q;
+  int64     l, r, m, b;
+
+  q = 1;
+  b = 0;
+  for (p = 1; p <= S->nthr; p++)
+    { z = S->zprt + (p-1);
+      if (z->nblk == 0)
+        continue;
+      if (mycmp(z->first,entry,kbyte) >= 0)
+        break;
+
+      // largest l s.t. first k-mer of block l < entry
+
+      l = 0;
+      r = z->nblk-1;
+      while (l < r)
+        { m = ((l+r+1) >> 1);
+          if (mycmp(z->first+m*kbyte,entry,kbyte) < 0)
+            l = m;
+          else
+            r = m-1;
+        }
+      q = p;
+      b = l;
+    }
+
+  if (S->nels == 0)
+    { S->celm = NULL;
+      S->cidx = 0;
+      return (NULL);
+    }
+  GoTo_Kmer_Index((Kmer_Stream *) S,(q > 1 ? S->neps[q-2] : 0) + b*ZIP_BLOCK);
+
+  while (S->celm != NULL && mycmp(S->celm,entry,kbyte) < 0)
+    Next_Kmer_Entry((Kmer_Stream *) S);
+
+  return (S->celm);
+}
+
+uint8 *GoTo_Kmer_String(Kmer_Stream *_S, uint8 *entry)
+{ _Kmer_Stream *S = (_Kmer_Stream *) _S;
+
+  int    tbyte = S->tbyte;
+  int    kbyte = S->kbyte;
+  int64  proff = sizeof(int) + sizeof(int64);
+
+  uint8  kbuf[kbyte];
+  int    p, f;
+  int64  l, r, m, lo;
+
+  if (S->zip)
+    return (GoTo_Zip_String(S,entry));
+
+  if (S->part <= S->nthr)
+    close(S->copn);
+
+  lo = 0;
+  for (p = 1; p <= S->nthr; p++)
     { sprintf(S->name+S->nlen,"%d",p);
-      copn = open(S->name,O_RDONLY);
-      if (copn < 0)
-        { fprintf(stderr,"%s: Table part %s is missing ?\n",Prog_Name,S->name);
+      f = open(S->name,O_RDONLY);
+      lseek(f,proff+((S->neps[p-1]-lo)-1)*tbyte,SEEK_SET);
+      read(f,kbuf,kbyte);
+      if (mycmp(kbuf,entry,kbyte) >= 0)
+        break;
+      close(f);
+      lo = S->neps[p-1];
+    }
+
+  S->part = p;
+  if (p > S->nthr)
+    { S->celm = NULL;
+      S->cidx = S->nels;
+      return (NULL);
+    }
+  S->copn = f;
+
+  // smallest l s.t. KMER(l) >= entry  (or S->neps[p] if does not exist)
+
+  l = 0;
+  r = S->neps[p-1]-lo;
+
+  while (r-l > STREAM_BLOCK)
+    { m = ((l+r) >> 1);
+      lseek(f,proff+m*tbyte,SEEK_SET);
+      read(f,kbuf,kbyte);
+      if (mycmp(kbuf,entry,kbyte) < 0)
+        l = m+1;
+      else
+        r = m;
+    }
+
+  lseek(f,proff+l*tbyte,SEEK_SET);
+
+  More_Kmer_Stream(S);
+  if (p > 1)
+    S->cidx = l + S->neps[p-2];
+  else
+    S->cidx = l;
+
+  while (mycmp(S->celm,entry,kbyte) < 0)
+    Next_Kmer_Entry(_S);
+
+  return (S->celm);
+}
+
+#define REAL(S) ((_Kmer_Stream *) S)
+
+inline uint8 *Next_Kmer_Entry(Kmer_Stream *S)
+{ REAL(S)->celm += REAL(S)->tbyte;
+  REAL(S)->cidx += 1;
+  if (REAL(S)->celm >= REAL(S)->ctop)
+    More_Kmer_Stream(REAL(S));
+  return (REAL(S)->celm);
+}
+
+char *Current_Kmer(Kmer_Stream *S)
+{ static char *seq = NULL;
+  static int   max = 0;
+
+  int kmer = S->kmer;
+
+  if (S == NULL)
+    { free(seq);
+      max = 0;
+      return (NULL);
+    }
+
+  if (kmer > max)
+    { max = kmer;
+      seq = Realloc(seq,max+1,"Reallocating k-mer buffer");
+      if (seq == NULL)
+        exit (1);
+    }
+
+  { int    j;
+    uint8 *a;
+
+    a = ((_Kmer_Stream *) S)->celm;
+    for (j = 0; j < kmer; j += 4)
+      sprintf(seq+j,"%s",fmer[*a++]);
+    seq[kmer] = '\0';
+  }
+
+  return (seq);
+}
+
+int Current_Count(Kmer_Stream *S)
+{ int kbyte = S->kbyte;
+  return (COUNT_OF(((_Kmer_Stream *) S)->celm));
+}
+
+void Free_Kmer_Stream(Kmer_Stream *_S)
+{ _Kmer_Stream *S = (_Kmer_Stream *) _S;
+
+  if (S->zip)
+    { int p;
+
+      for (p = 0; p < S->nthr; p++)
+        free(S->zprt[p].boff);
+      free(S->zprt);
+      free(S->zbuf);
+    }
+  free(S->neps);
+  free(S->table);
+  if (S->copn >= 0)
+    close(S->copn);
+  free(S->name);
+  free(S);
+}
+
+/****************************************************************************************
+ *
+ *  Convert a table between the plain and compressed encodings of its parts
+ *
+ *****************************************************************************************/
+
+typedef struct
+  { char *dir;      //  Table is dir/root.ktab
+    char *root;
+    int   beg;      //  Convert parts beg, beg+step, ... <= nparts
+    int   step;
+    int   nparts;
+    int   zip;      //  Compress if set, otherwise uncompress
+    int   kbyte;
+  } Convert_Arg;
+
+static void *convert_thread(void *arg)
+{ Convert_Arg *data  = (Convert_Arg *) arg;
+  int          kbyte = data->kbyte;
+  int          tbyte = kbyte+2;
+
+  char    *in, *out;
+  uint8   *buf, *zbuf;
+  Zip_Part z;
+  int      p, f, g, kmer, n;
+  int64    nels, b, len, hdr;
+
+  in   = Malloc(2*(strlen(data->dir)+strlen(data->root)+30),"Allocating part names");
+  buf  = Malloc(ZIP_BLOCK*tbyte + zip_block_max(kbyte),"Allocating conversion buffers");
+  if (in == NULL || buf == NULL)
+    exit (1);
+  out  = in + (strlen(data->dir)+strlen(data->root)+30);
+  zbuf = buf + ZIP_BLOCK*tbyte;
+
+  for (p = data->beg; p <= data->nparts; p += data->step)
+    { sprintf(in,"%s/.%s.ktab.%d",data->dir,data->root,p);
+      sprintf(out,"%s/.%s.ktab.%d.tmp",data->dir,data->root,p);
+      f = open(in,O_RDONLY);
+      g = open(out,O_CREAT|O_TRUNC|O_WRONLY,S_IRWXU);
+      if (f < 0 || g < 0)
+        { fprintf(stderr,"%s: Cannot open table part %s or its conversion\n",Prog_Name,in);
           exit (1);
         }
-      read(copn,&kmer,sizeof(int));
-      read(copn,&n,sizeof(int64));
-      nels += n;
-      S->neps[p-1] = nels;
-      if (kmer != smer)
-        { fprintf(stderr,"%s: Table part %s does not have k-mer length matching stub ?\n",
-                         Prog_Name,S->name);
+      read(f,&kmer,sizeof(int));
+      read(f,&nels,sizeof(int64));
+      write(g,&kmer,sizeof(int));
+      write(g,&nels,sizeof(int64));
+
+      if (data->zip)
+        { z.nblk  = (nels + ZIP_BLOCK-1) / ZIP_BLOCK;
+          z.boff  = Malloc((z.nblk+1)*sizeof(int64)+z.nblk*kbyte+1,"Allocating block directory");
+          if (z.boff == NULL)
+            exit (1);
+          z.first = (uint8 *) (z.boff + (z.nblk+1));
+
+          hdr = sizeof(int) + 2*sizeof(int64) + (z.nblk+1)*sizeof(int64) + z.nblk*kbyte;
+          lseek(g,hdr,SEEK_SET);
+          for (b = 0; b < z.nblk; b++)
+            { n = ZIP_BLOCK;
+              if (b*ZIP_BLOCK + n > nels)
+                n = nels - b*ZIP_BLOCK;
+              read(f,buf,n*tbyte);
+              mycpy(z.first+b*kbyte,buf,kbyte);
+              len = zip_encode(buf,n,kbyte,tbyte,zbuf);
+              write(g,zbuf,len);
+              z.boff[b] = hdr;
+              hdr += len;
+            }
+          z.boff[z.nblk] = hdr;
+
+          lseek(g,sizeof(int)+sizeof(int64),SEEK_SET);
+          write(g,&(z.nblk),sizeof(int64));
+          write(g,z.boff,(z.nblk+1)*sizeof(int64));
+          write(g,z.first,z.nblk*kbyte);
+        }
+      else
+        { read_zip_part(f,nels,kbyte,&z);
+          lseek(f,z.boff[0],SEEK_SET);
+          for (b = 0; b < z.nblk; b++)
+            { n = ZIP_BLOCK;
+              if (b*ZIP_BLOCK + n > nels)
+                n = nels - b*ZIP_BLOCK;
+              read(f,zbuf,z.boff[b+1]-z.boff[b]);
+              zip_decode(zbuf,n,z.first+b*kbyte,kbyte,tbyte,buf);
+              write(g,buf,n*tbyte);
+            }
+        }
+
+      free(z.boff);
+      close(g);
+      close(f);
+    }
+
+  free(buf);
+  free(in);
+  return (NULL);
+}
+
+int Convert_Kmer_Table(char *name, int zip, int nthreads)
+{ char        *dir, *root, *full, *part;
+  int          f, p, t, smer, nparts, minval, one;
+  Convert_Arg  parm[nthreads];
+
+  dir  = PathTo(name);
+  root = Root(name,".ktab");
+  full = Malloc(2*(strlen(dir)+strlen(root)+30),"Table name allocation");
+  if (full == NULL)
+    exit (1);
+  part = full + (strlen(dir)+strlen(root)+30);
+  sprintf(full,"%s/%s.ktab",dir,root);
+  f = open(full,O_RDONLY);
+  if (f < 0)
+    { free(full);
+      free(root);
+      free(dir);
+      return (1);
+    }
+  read(f,&smer,sizeof(int));
+  read(f,&nparts,sizeof(int));
+  read(f,&minval,sizeof(int));
+  one = is_zip_stub(f);
+  close(f);
+
+  if (one != zip)
+    { if (nthreads > nparts)
+        nthreads = nparts;
+      for (t = 0; t < nthreads; t++)
+        { parm[t].dir    = dir;
+          parm[t].root   = root;
+          parm[t].beg    = t+1;
+          parm[t].step   = nthreads;
+          parm[t].nparts = nparts;
+          parm[t].zip    = zip;
+          parm[t].kbyte  = (smer+3) >> 2;
+        }
+      run_threads(convert_thread,(void *) parm,sizeof(Convert_Arg),nthreads);
+
+      for (p = 1; p <= nparts; p++)
+        { sprintf(part,"%s/.%s.ktab.%d",dir,root,p);
+          sprintf(full,"%s/.%s.ktab.%d.tmp",dir,root,p);
+          rename(full,part);
+        }
+
+      sprintf(full,"%s/%s.ktab",dir,root);
+      f = open(full,O_CREAT|O_TRUNC|O_WRONLY,S_IRWXU);
+      write(f,&smer,sizeof(int));
+      write(f,&nparts,sizeof(int));
+      write(f,&minval,sizeof(int));
+      one = 1;
+      if (zip)
+        write(f,&one,sizeof(int));
+      close(f);
+    }
+
+  free(full);
+  free(root);
+  free(dir);
+  return (0);
+}
+
+
+/****************************************************************************************
+ *
+ *  Rewrite a table as a given number of parts.  Part p of the new table holds the entries
+ *    [beg[p],beg[p+1]) of the table as a whole, and each thread copies every nthreads'th
+ *    new part from its own stream into a temporary file.  The order and number of the
+ *    entries is unchanged, so a .kidx or .khsh of the table remains valid.
+ *
+ *****************************************************************************************/
+
+#define SHARD_BUF 0x100000   //  Bytes of entries written at a time
+
+typedef struct
+  { char  *name;     //  Table to read
+    char  *dir;      //  Table is dir/root.ktab
+    char  *root;
+    int    beg;      //  Write new parts beg, beg+step, ... <= nparts
+    int    step;
+    int    nparts;
+    int64 *range;    //  New part p holds entries [range[p-1],range[p])
+  } Shard_Arg;
+
+static void *shard_thread(void *arg)
+{ Shard_Arg   *data = (Shard_Arg *) arg;
+  Kmer_Stream *S;
+  char        *out;
+  uint8       *buf, *bptr, *btop, *e;
+  int64        i, nels;
+  int          p, g, kmer, tbyte;
+
+  S = Open_Kmer_Stream(data->name);
+  if (S == NULL)
+    { fprintf(stderr,"%s: Cannot open table %s\n",Prog_Name,data->name);
+      exit (1);
+    }
+  kmer  = S->kmer;
+  tbyte = S->tbyte;
+
+  out = Malloc(strlen(data->dir)+strlen(data->root)+30,"Allocating part names");
+  buf = Malloc(SHARD_BUF,"Allocating part buffer");
+  if (out == NULL || buf == NULL)
+    exit (1);
+  btop = buf + (SHARD_BUF/tbyte)*tbyte;
+
+  for (p = data->beg; p <= data->nparts; p += data->step)
+    { sprintf(out,"%s/.%s.ktab.%d.tmp",data->dir,data->root,p);
+      g = open(out,O_CREAT|O_TRUNC|O_WRONLY,S_IRWXU);
+      if (g < 0)
+        { fprintf(stderr,"%s: Cannot open table part %s for writing\n",Prog_Name,out);
           exit (1);
         }
-      close(copn);
+      nels = data->range[p] - data->range[p-1];
+      write(g,&kmer,sizeof(int));
+      write(g,&nels,sizeof(int64));
+
+      bptr = buf;
+      if (nels > 0)
+        { e = GoTo_Kmer_Index(S,data->range[p-1]);
+          for (i = 0; i < nels; i++)
+            { if (bptr >= btop)
+                { write(g,buf,bptr-buf);
+                  bptr = buf;
+                }
+              mycpy(bptr,e,tbyte);
+              bptr += tbyte;
+              e = Next_Kmer_Entry(S);
+            }
+        }
+      write(g,buf,bptr-buf);
+      close(g);
+    }
+
+  free(buf);
+  free(out);
+  Free_Kmer_Stream(S);
+  return (NULL);
+}
+
+int Reshard_Kmer_Table(char *name, int nparts, char **bounds, int nthreads)
+{ Kmer_Stream *S;
+  char        *dir, *root, *full, *part;
+  int          f, p, t, smer, oparts, minval, zip;
+  int64       *range;
+  Shard_Arg    parm[nthreads];
+
+  dir  = PathTo(name);
+  root = Root(name,".ktab");
+  full = Malloc(2*(strlen(dir)+strlen(root)+30),"Table name allocation");
+  if (full == NULL)
+    exit (1);
+  part = full + (strlen(dir)+strlen(root)+30);
+  sprintf(full,"%s/%s.ktab",dir,root);
+  f = open(full,O_RDONLY);
+  if (f < 0)
+    { free(full);
+      free(root);
+      free(dir);
+      return (1);
+    }
+  read(f,&smer,sizeof(int));
+  read(f,&oparts,sizeof(int));
+  read(f,&minval,sizeof(int));
+  zip = is_zip_stub(f);
+  close(f);
+
+  //  Determine the range of entries of each new part: equal numbers of entries if bounds
+  //    is NULL, otherwise part p+1 starts at the first k-mer not less than bounds[p] padded
+  //    with a's, where bounds[0..nparts-2] are Ascii k-mer prefixes.
+
+  S = Open_Kmer_Stream(name);
+  if (S == NULL)
+    exit (1);
+
+  if (bounds == NULL && nparts > 1 && nparts > S->nels)
+    { Free_Kmer_Stream(S);
+      free(full);
+      free(root);
+      free(dir);
+      return (2);
+    }
+
+  range = Malloc(sizeof(int64)*(nparts+1),"Allocating part ranges");
+  if (range == NULL)
+    exit (1);
+
+  range[0]      = 0;
+  range[nparts] = S->nels;
+  if (bounds == NULL)
+    { for (p = 1; p < nparts; p++)
+        range[p] = (S->nels*p)/nparts;
+    }
+  else
+    { char  kseq[smer+4];
+      uint8 cmp[S->kbyte];
+      int   len;
+
+      for (p = 1; p < nparts; p++)
+        { len = strlen(bounds[p-1]);
+          if (len > smer)
+            len = smer;
+          memset(kseq,'a',smer+3);
+          memcpy(kseq,bounds[p-1],len);
+          compress_norm(kseq,smer,cmp);
+          if (S->nels == 0 || GoTo_Kmer_String(S,cmp) == NULL)
+            range[p] = S->nels;
+          else
+            range[p] = S->cidx;
+          if (range[p] < range[p-1])
+            range[p] = range[p-1];
+        }
+    }
+  Free_Kmer_Stream(S);
+
+  if (nthreads > nparts)
+    nthreads = nparts;
+  for (t = 0; t < nthreads; t++)
+    { parm[t].name   = name;
+      parm[t].dir    = dir;
+      parm[t].root   = root;
+      parm[t].beg    = t+1;
+      parm[t].step   = nthreads;
+      parm[t].nparts = nparts;
+      parm[t].range  = range;
     }
+  run_threads(shard_thread,(void *) parm,sizeof(Shard_Arg),nthreads);
 
-  //  Allocate in-memory buffer & establish initial condition
+  //  Replace the old parts with the new ones and rewrite the stub
 
-  S->kmer   = kmer;
-  S->minval = minval;
-  S->tbyte  = tbyte;
-  S->kbyte  = kbyte;
-  S->nels   = nels;
+  for (p = 1; p <= nparts; p++)
+    { sprintf(part,"%s/.%s.ktab.%d",dir,root,p);
+      sprintf(full,"%s/.%s.ktab.%d.tmp",dir,root,p);
+      rename(full,part);
+    }
+  for (p = nparts+1; p <= oparts; p++)
+    { sprintf(part,"%s/.%s.ktab.%d",dir,root,p);
+      unlink(part);
+    }
 
-  sprintf(S->name+S->nlen,"%d",1);
-  copn = open(S->name,O_RDONLY);
-  read(copn,&kmer,sizeof(int));
-  read(copn,&n,sizeof(int64));
+  sprintf(full,"%s/%s.ktab",dir,root);
+  f = open(full,O_CREAT|O_TRUNC|O_WRONLY,S_IRWXU);
+  write(f,&smer,sizeof(int));
+  write(f,&nparts,sizeof(int));
+  write(f,&minval,sizeof(int));
+  close(f);
 
-  S->copn  = copn;
-  S->part  = 1;
-  S->nthr  = nthreads;
+  //  The new parts are plain, so compress them again if the table was compressed
 
-  More_Kmer_Stream(S);
-  S->cidx  = 0;
+  if (zip)
+    Convert_Kmer_Table(name,1,nthreads);
 
-  return ((Kmer_Stream *) S);
+  free(range);
+  free(full);
+  free(root);
+  free(dir);
+  return (0);
 }
 
+
 /****************************************************************************************
  *
- *  Free, Iterate, and Get Stream Entries
+ *  Open independent copies of streams (e.g. one per thread), and merge the entries of
+ *    several streams in k-mer order.  The heads of the streams are merged by a linear scan
+ *    if there are at most LINEAR_MERGE of them, and otherwise with a loser tree: lose[0] is
+ *    the stream with the smallest head and lose[j] for j in [1,n) is the loser of the match
+ *    at internal node j.  An exhausted stream has a NULL head and loses to every other
+ *    stream.  key[c] holds the first 8 bytes of the head of stream c as a big-endian
+ *    integer so most matches are decided by a single integer compare.
  *
  *****************************************************************************************/
 
-inline uint8 *First_Kmer_Entry(Kmer_Stream *_S)
+Kmer_Stream *Clone_Kmer_Stream(Kmer_Stream *_S)
 { _Kmer_Stream *S = (_Kmer_Stream *) _S;
+  Kmer_Stream  *C;
+  char         *name, *root;
+  int           len;
 
-  if (S->cidx != 0)
-    { if (S->part != 1)
-        { if (S->part <= S->nthr)
-            close(S->copn);
-          sprintf(S->name+S->nlen,"%d",1);
-          S->copn = open(S->name,O_RDONLY);
-          S->part = 1;
-        }
+  //  S->name[0..nlen) is <dir>/.<root>.ktab. and never changes, so S may be in use
 
-      lseek(S->copn,sizeof(int)+sizeof(int64),SEEK_SET);
+  len  = S->nlen - 6;
+  name = Malloc(len+1,"Allocating table name");
+  if (name == NULL)
+    exit (1);
+  memcpy(name,S->name,len);
+  name[len] = '\0';
+  root = rindex(name,'/') + 1;
+  memmove(root,root+1,strlen(root));
+
+  C = Open_Kmer_Stream(name);
+  free(name);
+  return (C);
+}
 
-      More_Kmer_Stream(S);
-      S->cidx = 0;
+Kmer_Stream **Clone_Kmer_Streams(int n, Kmer_Stream **S)
+{ Kmer_Stream **C;
+  int           c;
+
+  C = Malloc(sizeof(Kmer_Stream *)*n,"Allocating stream array");
+  if (C == NULL)
+    exit (1);
+  for (c = 0; c < n; c++)
+    { C[c] = Clone_Kmer_Stream(S[c]);
+      if (C[c] == NULL)
+        { Free_Kmer_Streams(c,C);
+          return (NULL);
+        }
     }
+  return (C);
+}
 
-  return (S->celm);
+void Free_Kmer_Streams(int n, Kmer_Stream **S)
+{ int c;
+
+  for (c = 0; c < n; c++)
+    Free_Kmer_Stream(S[c]);
+  free(S);
 }
 
-inline uint8 *GoTo_Kmer_Index(Kmer_Stream *_S, int64 i)
-{ _Kmer_Stream *S = (_Kmer_Stream *) _S;
-  int p;
+#define LINEAR_MERGE  32   //  Merge by a linear scan of the stream heads up to this many
 
-  if (i < 0 || i >= S->nels)
-    return (NULL);
+#define EMPTY_KEY  0xffffffffffffffffllu
 
-  if (S->cidx != i)
-    { S->cidx = i;
+typedef struct
+  { int           nstreams;
+    int           kbyte;
+    uint8        *kmer;
+    int           nin;
+    int          *in;
+    int          *cnt;
+    Kmer_Stream **S;     //  The streams merged
+    int64        *ends;  //  Stream c is merged up to entry ends[c]
+    uint8       **ptr;   //  ptr[c] = head of stream c (NULL if exhausted)
+    uint64       *key;   //  key[c] = first 8 bytes of ptr[c] (EMPTY_KEY if exhausted)
+    int          *lose;  //  Loser tree (if nstreams > LINEAR_MERGE)
+    int          *win;
+  } _Kmer_Merge;
+
+static inline uint64 head_key(uint8 *p, int kbyte)
+{ uint64 k;
+  int    i;
 
-      p = 0;
-      while (i >= S->neps[p])
-        p += 1;
-      
-      if (p > 0)
-        i -= S->neps[p-1];
-      p += 1;
+  if (kbyte >= 8)
+    return (__builtin_bswap64(*((uint64 *) p)));
+  k = 0;
+  for (i = 0; i < 8; i++)
+    { k <<= 8;
+      if (i < kbyte)
+        k |= p[i];
+    }
+  return (k);
+}
 
-      if (S->part != p)
-        { if (S->part <= S->nthr)
-            close(S->copn);
-          sprintf(S->name+S->nlen,"%d",p);
-          S->copn = open(S->name,O_RDONLY);
-          S->part = p;
-        }
+  //  Compare the bytes of two k-mers after the first 8 (which are compared by key)
 
-      lseek(S->copn,sizeof(int) + sizeof(int64) + i*S->tbyte,SEEK_SET);
+static inline int tail_cmp(uint8 *a, uint8 *b, int kbyte)
+{ if (kbyte <= 8)
+    return (0);
+  return (mycmp(a+8,b+8,kbyte-8));
+}
 
-      More_Kmer_Stream(S);
-    }
+static inline int beats(_Kmer_Merge *M, int a, int b)
+{ uint8 **ptr = M->ptr;
+  uint64 *key = M->key;
+  int     x;
 
-  return (S->celm);
+  if (key[a] != key[b])
+    return (key[a] < key[b]);
+  if (ptr[a] == NULL)
+    return (0);
+  if (ptr[b] == NULL)
+    return (1);
+  x = tail_cmp(ptr[a],ptr[b],M->kbyte);
+  return (x < 0 || (x == 0 && a < b));
 }
 
-uint8 *GoTo_Kmer_String(Kmer_Stream *_S, uint8 *entry)
-{ _Kmer_Stream *S = (_Kmer_Stream *) _S;
+static void build_tree(_Kmer_Merge *M)
+{ int *lose = M->lose;
+  int *win  = M->win;
+  int  n    = M->nstreams;
+  int  j, l, r;
+
+  for (j = 0; j < n; j++)
+    win[n+j] = j;
+  for (j = n-1; j > 0; j--)
+    { l = win[2*j];
+      r = win[2*j+1];
+      if (beats(M,l,r))
+        { win[j]  = l;
+          lose[j] = r;
+        }
+      else
+        { win[j]  = r;
+          lose[j] = l;
+        }
+    }
+  lose[0] = win[1];
+}
 
-  int    tbyte = S->tbyte;
-  int    kbyte = S->kbyte;
-  int64  proff = sizeof(int) + sizeof(int64);
+static inline void replay_tree(_Kmer_Merge *M, int c)
+{ int *lose = M->lose;
+  int  j, w, x;
+
+  w = c;
+  for (j = (c+M->nstreams) >> 1; j > 0; j >>= 1)
+    if (beats(M,lose[j],w))
+      { x = lose[j];
+        lose[j] = w;
+        w = x;
+      }
+  lose[0] = w;
+}
 
-  uint8  kbuf[kbyte];
-  int    p, f;
-  int64  l, r, m, lo;
+  //  Record the head of stream c in the current k-mer's list and advance the stream
 
-  if (S->part <= S->nthr)
-    close(S->copn);
+static inline void pop_head(_Kmer_Merge *M, int c)
+{ Kmer_Stream *S = M->S[c];
+  int          kbyte = M->kbyte;
+  uint8       *p;
 
-  lo = 0;
-  for (p = 1; p <= S->nthr; p++)
-    { sprintf(S->name+S->nlen,"%d",p);
-      f = open(S->name,O_RDONLY);
-      lseek(f,proff+((S->neps[p-1]-lo)-1)*tbyte,SEEK_SET);
-      read(f,kbuf,kbyte);
-      if (mycmp(kbuf,entry,kbyte) >= 0)
-        break;
-      close(f);
-      lo = S->neps[p-1];
-    }
+  M->in[M->nin]  = c;
+  M->cnt[M->nin] = *((uint16 *) (M->ptr[c]+kbyte));
+  M->nin += 1;
 
-  S->part = p;
-  if (p > S->nthr)
-    { S->celm = NULL;
-      S->cidx = S->nels;
-      return (NULL);
+  p = Next_Kmer_Entry(S);
+  if (S->cidx >= M->ends[c])
+    { M->ptr[c] = NULL;
+      M->key[c] = EMPTY_KEY;
     }
-  S->copn = f;
+  else
+    { M->ptr[c] = p;
+      M->key[c] = head_key(p,kbyte);
+    }
+}
 
-  // smallest l s.t. KMER(l) >= entry  (or S->neps[p] if does not exist)
+Kmer_Merge *Open_Kmer_Merge(int n, Kmer_Stream **S, int64 *begs, int64 *ends)
+{ _Kmer_Merge *M;
+  int          kbyte = S[0]->kbyte;
+  int          c;
 
-  l = 0;
-  r = S->neps[p-1]-lo;
+  M = Malloc(sizeof(_Kmer_Merge),"Allocating merge");
+  if (M == NULL)
+    exit (1);
+  M->kmer = Malloc(kbyte,"Allocating merge");
+  M->in   = Malloc(sizeof(int)*n,"Allocating merge");
+  M->cnt  = Malloc(sizeof(int)*n,"Allocating merge");
+  M->ends = Malloc(sizeof(int64)*n,"Allocating merge");
+  M->ptr  = Malloc(sizeof(uint8 *)*n,"Allocating merge");
+  M->key  = Malloc(sizeof(uint64)*n,"Allocating merge");
+  M->lose = Malloc(sizeof(int)*n,"Allocating merge");
+  M->win  = Malloc(sizeof(int)*2*n,"Allocating merge");
+  if (M->kmer == NULL || M->in == NULL || M->cnt == NULL || M->ends == NULL
+                      || M->ptr == NULL || M->key == NULL || M->lose == NULL || M->win == NULL)
+    exit (1);
 
-  while (r-l > STREAM_BLOCK)
-    { m = ((l+r) >> 1);
-      lseek(f,proff+m*tbyte,SEEK_SET);
-      read(f,kbuf,kbyte);
-      if (mycmp(kbuf,entry,kbyte) < 0)
-        l = m+1;
+  M->nstreams = n;
+  M->kbyte    = kbyte;
+  M->nin      = 0;
+  M->S        = S;
+  for (c = 0; c < n; c++)
+    { M->ends[c] = (ends == NULL ? S[c]->nels : ends[c]);
+      M->ptr[c]  = GoTo_Kmer_Index(S[c],(begs == NULL ? 0 : begs[c]));
+      if (S[c]->cidx >= M->ends[c] || M->ptr[c] == NULL)
+        { M->ptr[c] = NULL;
+          M->key[c] = EMPTY_KEY;
+        }
       else
-        r = m;
+        M->key[c] = head_key(M->ptr[c],kbyte);
     }
+  if (n > LINEAR_MERGE)
+    build_tree(M);
 
-  lseek(f,proff+l*tbyte,SEEK_SET);
+  return ((Kmer_Merge *) M);
+}
 
-  More_Kmer_Stream(S);
-  if (p > 1)
-    S->cidx = l + S->neps[p-2];
+void Free_Kmer_Merge(Kmer_Merge *_M)
+{ _Kmer_Merge *M = (_Kmer_Merge *) _M;
+
+  free(M->win);
+  free(M->lose);
+  free(M->key);
+  free(M->ptr);
+  free(M->ends);
+  free(M->cnt);
+  free(M->in);
+  free(M->kmer);
+  free(M);
+}
+
+int Next_Kmer_Merge(Kmer_Merge *_M)
+{ _Kmer_Merge *M = (_Kmer_Merge *) _M;
+  uint8      **ptr   = M->ptr;
+  uint64      *key   = M->key;
+  int          kbyte = M->kbyte;
+  int          n     = M->nstreams;
+  uint8       *kmr   = M->kmer;
+  uint64       kkey;
+  int          c, m;
+
+  M->nin = 0;
+  if (n <= LINEAR_MERGE)
+    { m = -1;
+      for (c = 0; c < n; c++)
+        { if (ptr[c] == NULL)
+            continue;
+          if (m >= 0)
+            { if (key[c] > key[m])
+                continue;
+              if (key[c] == key[m] && tail_cmp(ptr[c],ptr[m],kbyte) >= 0)
+                continue;
+            }
+          m = c;
+        }
+      if (m < 0)
+        return (0);
+      memcpy(kmr,ptr[m],kbyte);
+      kkey = key[m];
+      for (c = m; c < n; c++)
+        if (ptr[c] != NULL && key[c] == kkey && tail_cmp(ptr[c],kmr,kbyte) == 0)
+          pop_head(M,c);
+    }
   else
-    S->cidx = l;
+    { c = M->lose[0];
+      if (ptr[c] == NULL)
+        return (0);
+      memcpy(kmr,ptr[c],kbyte);
+      kkey = key[c];
+      do
+        { pop_head(M,c);
+          replay_tree(M,c);
+          c = M->lose[0];
+        }
+      while (ptr[c] != NULL && key[c] == kkey && tail_cmp(ptr[c],kmr,kbyte) == 0);
+    }
+  return (M->nin);
+}
 
-  while (mycmp(S->celm,entry,kbyte) < 0)
-    Next_Kmer_Entry(_S);
 
-  return (S->celm);
-}
+/*********************************************************************************************\
+ *
+ *  PROFILE CODE
+ *
+ *****************************************************************************************/
 
-#define REAL(S) ((_Kmer_Stream *) S)
+/****************************************************************************************
+ *
+ *  Compact profile indices.  If the stub of a profile has a non-zero 3rd integer, then
+ *    each .pidx part holds the end offsets of the compressed profiles of its n reads as
+ *    an Elias-Fano sequence rather than as n int64's.  With l = floor(log2(U/n)) where U
+ *    is the last offset, the low l bits of each offset are packed in low, and the high
+ *    bits of the i'th are encoded by setting bit i + (offset >> l) of high.  The position
+ *    in high of every EF_SAMPLE'th set bit is sampled so that any offset is found in O(1)
+ *    time, for a total of about 2 + l bits per read.  After the usual header (k-mer length,
+ *    id of the first read in the part, and n) are a 4-byte pad, l, and the lengths in
+ *    words of low, high, and the samples, followed by the three arrays.  A part is mapped
+ *    into memory and not read.
+ *
+ *****************************************************************************************/
 
-inline uint8 *Next_Kmer_Entry(Kmer_Stream *S)
-{ REAL(S)->celm += REAL(S)->tbyte;
-  REAL(S)->cidx += 1;
-  if (REAL(S)->celm >= REAL(S)->ctop)
-    More_Kmer_Stream(REAL(S));
-  return (REAL(S)->celm);
+#define EF_SAMPLE 256
+
+typedef struct
+  { int64   n;       //  # of offsets
+    int64   lbits;   //  # of low bits per offset
+    uint64 *low;     //  Packed low bits
+    uint64 *high;    //  Unary coded high bits
+    int64  *samp;    //  samp[j] = position in high of set bit j*EF_SAMPLE
+    void   *map;     //  Memory map of the part and its size
+    int64   msize;
+  } EF_Index;
+
+#define EF_HEADER  (sizeof(int) + 2*sizeof(int64) + sizeof(int) + 4*sizeof(int64))
+
+  //  Return the i'th offset of E
+
+static inline int64 ef_value(EF_Index *E, int64 i)
+{ uint64 *high = E->high;
+  int64   l    = E->lbits;
+  int64   b, w, c;
+  uint64  x, v;
+  int     p;
+
+  b = E->samp[i/EF_SAMPLE];
+  c = i % EF_SAMPLE;
+  w = (b >> 6);
+  x = high[w] & (~0llu << (b & 0x3f));
+  while (c >= (p = __builtin_popcountll(x)))
+    { c -= p;
+      x  = high[++w];
+    }
+  while (c-- > 0)
+    x &= x-1;
+  v = (uint64) ((w << 6) + __builtin_ctzll(x) - i) << l;
+
+  if (l > 0)
+    { b = i*l;
+      w = (b >> 6);
+      b &= 0x3f;
+      x = E->low[w] >> b;
+      if (b+l > 64)
+        x |= E->low[w+1] << (64-b);
+      v |= x & ((1llu << l) - 1);
+    }
+  return (v);
 }
 
-char *Current_Kmer(Kmer_Stream *S)
-{ static char *seq = NULL;
-  static int   max = 0;
+  //  Map the compact .pidx part at path into E, returning 1 if it cannot be opened
 
-  int kmer = S->kmer;
+static int ef_map(char *path, EF_Index *E)
+{ int64  hdr[4];
+  int    f;
+  uint8 *m;
 
-  if (S == NULL)
-    { free(seq);
-      max = 0;
-      return (NULL);
+  f = open(path,O_RDONLY);
+  if (f < 0)
+    return (1);
+  E->msize = lseek(f,0,SEEK_END);
+  m = mmap(NULL,E->msize,PROT_READ,MAP_SHARED,f,0);
+  close(f);
+  if (m == MAP_FAILED)
+    { fprintf(stderr,"Could not map profile part %s\n",path);
+      exit (1);
     }
 
-  if (kmer > max)
-    { max = kmer;
-      seq = Realloc(seq,max+1,"Reallocating k-mer buffer");
-      if (seq == NULL)
-        exit (1);
-    }
+  E->map = m;
+  E->n   = *((int64 *) (m + sizeof(int) + sizeof(int64)));
+  memcpy(hdr,m + sizeof(int) + 2*sizeof(int64) + sizeof(int),4*sizeof(int64));
+  E->lbits = hdr[0];
+  E->low   = (uint64 *) (m + EF_HEADER);
+  E->high  = E->low + hdr[1];
+  E->samp  = (int64 *) (E->high + hdr[2]);
+  return (0);
+}
 
-  { int    j;
-    uint8 *a;
+  //  Write the n offsets in val to file f as the body of a compact .pidx part
 
-    a = ((_Kmer_Stream *) S)->celm;
-    for (j = 0; j < kmer; j += 4)
-      sprintf(seq+j,"%s",fmer[*a++]);
-    seq[kmer] = '\0';
-  }
+static void ef_write(int f, int64 *val, int64 n)
+{ int64   U, q, l, nlow, nhigh, nsamp;
+  int64   i, b, p, v, hdr[4];
+  uint64 *low, *high;
+  int64  *samp;
+  int     pad;
 
-  return (seq);
-}
+  U = (n > 0 ? val[n-1] : 0);
+  q = (n > 0 ? U/n : 0);
+  for (l = 0; (q >> l) > 1; l++)
+    ;
 
-int Current_Count(Kmer_Stream *S)
-{ int kbyte = S->kbyte;
-  return (COUNT_OF(((_Kmer_Stream *) S)->celm));
-}
+  nlow  = (n*l + 63)/64 + 1;
+  nhigh = (n + (U >> l) + 64)/64 + 1;
+  nsamp = (n + EF_SAMPLE-1)/EF_SAMPLE + 1;
 
-void Free_Kmer_Stream(Kmer_Stream *_S)
-{ _Kmer_Stream *S = (_Kmer_Stream *) _S;
+  low  = (uint64 *) Malloc((nlow+nhigh+nsamp)*sizeof(uint64),"Allocating compact index");
+  if (low == NULL)
+    exit (1);
+  high = low + nlow;
+  samp = (int64 *) (high + nhigh);
+  bzero(low,(nlow+nhigh+nsamp)*sizeof(uint64));
+
+  for (i = 0; i < n; i++)
+    { p = (val[i] >> l) + i;
+      high[p >> 6] |= (1llu << (p & 0x3f));
+      if (i % EF_SAMPLE == 0)
+        samp[i/EF_SAMPLE] = p;
+      if (l > 0)
+        { v = val[i] & ((1llu << l) - 1);
+          b = i*l;
+          low[b >> 6] |= ((uint64) v) << (b & 0x3f);
+          if ((b & 0x3f) + l > 64)
+            low[(b >> 6) + 1] |= ((uint64) v) >> (64 - (b & 0x3f));
+        }
+    }
 
-  free(S->neps);
-  free(S->table);
-  if (S->copn >= 0)
-    close(S->copn);
-  free(S->name);
-  free(S);
-}
+  pad    = 0;
+  hdr[0] = l;
+  hdr[1] = nlow;
+  hdr[2] = nhigh;
+  hdr[3] = nsamp;
+  write(f,&pad,sizeof(int));
+  write(f,hdr,4*sizeof(int64));
+  write(f,low,(nlow+nhigh+nsamp)*sizeof(uint64));
 
+  free(low);
+}
 
-/*********************************************************************************************\
- *
- *  PROFILE CODE
- *
- *****************************************************************************************/
+typedef struct
+  { int    kmer;
+    int    nparts;
+    int    nreads;
+    int64 *nbase;
+    int   *nfile;
+    int64 *index;
+    EF_Index *efx;   //  Compact index of each part if the profile has one, NULL otherwise
+  } _Profile_Index;
+
+  //  Read the compact flag, if any, of the profile stub f
+
+static int is_compact_stub(int f)
+{ int cmp;
+
+  if (read(f,&cmp,sizeof(int)) != sizeof(int))
+    return (0);
+  return (cmp != 0);
+}
 
 /****************************************************************************************
  *
- *  Open a profile as a Profile_Index.  Index to compressed profiles is in memory,
- *    but compressed profiles are left on disk and reaad only when requested.
+ *  Open a profile as a Profile_Index.  Index to compressed profiles is in memory (or
+ *    mapped if compact), but compressed profiles are left on disk and reaad only when
+ *    requested.
  *
  *****************************************************************************************/
 
@@ -958,10 +3025,11 @@ Profile_Index *Open_Profiles(char *name)
   int            kmer, nparts;
   int64          nreads, *nbase, *index;
   int           *nfile;
+  EF_Index      *efx;
 
   int    f, x;
   char  *dir, *root, *full;
-  int    smer, nthreads;
+  int    smer, nthreads, cmp;
   int64  n;
 
   //  Open stub file and get # of parts
@@ -979,6 +3047,7 @@ Profile_Index *Open_Profiles(char *name)
     return (NULL);
   read(f,&smer,sizeof(int));
   read(f,&nthreads,sizeof(int));
+  cmp = is_compact_stub(f);
   close(f);
 
   //  Find all parts and accumulate total size
@@ -1005,24 +3074,38 @@ Profile_Index *Open_Profiles(char *name)
   //  Allocate in-memory table
 
   P     = Malloc(sizeof(Profile_Index),"Allocating profile record");
-  index = Malloc((nreads+1)*sizeof(int64),"Allocating profile index");
   nbase = Malloc(nparts*sizeof(int64),"Allocating profile index");
   nfile = Malloc(nparts*sizeof(FILE *),"Allocating profile index");
-  if (P == NULL || index == NULL || nbase == NULL || nfile == NULL)
+  if (cmp)
+    { index = NULL;
+      efx   = Malloc(nparts*sizeof(EF_Index),"Allocating profile index");
+    }
+  else
+    { index = Malloc((nreads+1)*sizeof(int64),"Allocating profile index");
+      efx   = NULL;
+    }
+  if (P == NULL || (index == NULL && efx == NULL) || nbase == NULL || nfile == NULL)
     exit (1);
 
   nreads = 0;
-  index[0] = 0;
+  if (index != NULL)
+    index[0] = 0;
   for (nparts = 0; nparts < nthreads; nparts++)
     { sprintf(full+x,"pidx.%d",nparts+1);
-      f = open(full,O_RDONLY);
-      read(f,&kmer,sizeof(int));
-      read(f,&n,sizeof(int64));
-      read(f,&n,sizeof(int64));
-      read(f,index+(nreads+1),n*sizeof(int64));
+      if (cmp)
+        { ef_map(full,efx+nparts);
+          n = efx[nparts].n;
+        }
+      else
+        { f = open(full,O_RDONLY);
+          read(f,&kmer,sizeof(int));
+          read(f,&n,sizeof(int64));
+          read(f,&n,sizeof(int64));
+          read(f,index+(nreads+1),n*sizeof(int64));
+          close(f);
+        }
       nreads += n;
       nbase[nparts] = nreads;
-      close(f);
 
       sprintf(full+x,"prof.%d",nparts+1);
       f = open(full,O_RDONLY);
@@ -1041,6 +3124,7 @@ Profile_Index *Open_Profiles(char *name)
   P->index  = index;
   P->nbase  = nbase;
   P->nfile  = nfile;
+  ((_Profile_Index *) P)->efx = efx;
 
   return (P);
 }
@@ -1054,8 +3138,14 @@ Profile_Index *Open_Profiles(char *name)
 #undef SHOW_RUN
 
 void Free_Profiles(Profile_Index *P)
-{ int i;
+{ EF_Index *efx = ((_Profile_Index *) P)->efx;
+  int       i;
 
+  if (efx != NULL)
+    { for (i = 0; i < P->nparts; i++)
+        munmap(efx[i].map,efx[i].msize);
+      free(efx);
+    }
   free(P->index);
   free(P->nbase);
   for (i = 0; i < P->nparts; i++)
@@ -1064,47 +3154,57 @@ void Free_Profiles(Profile_Index *P)
   free(P);
 }
 
-  //  Places uncompressed profile for read id (0-based) in profile of length plen.
-  //    Returns the length of the uncompressed profile.  If the plen is less than
-  //    this then only the first plen counts are uncompressed into profile
-
-#define PROF_BUF0 4096
-#define PROF_BUF1 4095
-
-int Fetch_Profile(Profile_Index *P, int64 id, int plen, uint16 *profile)
-{ uint8 count[PROF_BUF0], *cend = count+PROF_BUF1;
-  int    f;
-  int    w, len;
-  uint8 *p, *q;
-  uint16 x, d, i;
-  int    n;
-
+  //  Find the part w, offset, and length of the compressed profile for read id.
+  //    The part files are only ever read with pread, so any number of threads
+  //    can fetch profiles from the same Profile_Index concurrently.
+
+static int64 locate_profile(Profile_Index *P, int64 id, int *part, int64 *off)
+{ int w;
+
   for (w = 0; w < P->nparts; w++)
     if (id < P->nbase[w])
       break;
-  if (w >= P->nparts)
+  if (w >= P->nparts || id < 0)
     { fprintf(stderr,"Id %lld is out of range [1,%lld]\n",id,P->nbase[P->nparts-1]);
       exit (1);
     }
-  f = P->nfile[w];
+  *part = w;
+
+  if (P->index == NULL)
+    { EF_Index *E = ((_Profile_Index *) P)->efx + w;
+      int64     end;
+
+      if (w > 0)
+        id -= P->nbase[w-1];
+      end = ef_value(E,id);
+      if (id == 0)
+        *off = 0;
+      else
+        *off = ef_value(E,id-1);
+      return (end - *off);
+    }
 
   if (id == 0 || (w > 0 && id == P->nbase[w-1]))
-    { lseek(f,0,SEEK_SET);
-      len = P->index[id+1];
+    { *off = 0;
+      return (P->index[id+1]);
     }
   else
-    { int64 off = P->index[id];
-      lseek(f,off,SEEK_SET);
-      len = P->index[id+1] - off;
+    { *off = P->index[id];
+      return (P->index[id+1] - *off);
     }
+}
 
-  if (len == 0)
-    return (len);
+  //  Uncompress the profile in p[0..len) into profile[0..plen) and return its length
 
-  read(f,count,PROF_BUF0);
+static int decode_profile(uint8 *p, int64 len, int plen, uint16 *profile)
+{ uint8 *q;
+  uint16 x, d, i;
+  int    n;
+
+  if (len == 0)
+    return (0);
 
-  p = count;
-  q = count + len;
+  q = p + len;
 
   x = *p++;
   if ((x & 0x80) != 0)
@@ -1120,19 +3220,7 @@ int Fetch_Profile(Profile_Index *P, int64 id, int plen, uint16 *profile)
 #endif
 
       while (p < q)
-        { if (p >= cend)
-            { if (p == cend)
-                { *count = *p; 
-                  read(f,count+1,PROF_BUF1);
-                  q -= PROF_BUF1;
-                }
-              else
-                { read(f,count,PROF_BUF0);
-                  q -= PROF_BUF0;
-                }
-              p = count;
-            }
-          x = *p++;
+        { x = *p++;
           if ((x & 0xc0) == 0)
             { if (n+x > plen)
                 { n += x;
@@ -1178,19 +3266,7 @@ int Fetch_Profile(Profile_Index *P, int64 id, int plen, uint16 *profile)
     }
 
   while (p < q)
-    { if (p >= cend)
-        { if (p == cend)
-            { *count = *p; 
-              read(f,count+1,PROF_BUF1);
-              q -= PROF_BUF1;
-            }
-          else
-            { read(f,count,PROF_BUF0);
-              q -= PROF_BUF0;
-            }
-          p = count;
-        } 
-      x = *p++;
+    { x = *p++;
       if ((x & 0xc0) == 0)
         n += x;
       else
@@ -1202,3 +3278,633 @@ int Fetch_Profile(Profile_Index *P, int64 id, int plen, uint16 *profile)
 
   return (n);
 }
+
+  //  Read the len bytes at off in file f into buf[0..len)
+
+static void read_profile(int f, uint8 *buf, int64 len, int64 off)
+{ int64 r;
+
+  while (len > 0)
+    { r = pread(f,buf,len,off);
+      if (r <= 0)
+        { fprintf(stderr,"Read of profile part failed ?\n");
+          exit (1);
+        }
+      buf += r;
+      off += r;
+      len -= r;
+    }
+}
+
+  //  Places uncompressed profile for read id (0-based) in profile of length plen.
+  //    Returns the length of the uncompressed profile.  If the plen is less than
+  //    this then only the first plen counts are uncompressed into profile.
+  //    Thread safe: the compressed profile is read in one pread into a stack buffer,
+  //    or a temporary heap buffer if it is longer than PROF_BUF.
+
+#define PROF_BUF 4096
+
+int Fetch_Profile(Profile_Index *P, int64 id, int plen, uint16 *profile)
+{ uint8  count[PROF_BUF], *buf;
+  int64  len, off;
+  int    w, n;
+
+  len = locate_profile(P,id,&w,&off);
+  if (len == 0)
+    return (0);
+
+  if (len <= PROF_BUF)
+    buf = count;
+  else
+    { buf = Malloc(len,"Allocating profile buffer");
+      if (buf == NULL)
+        exit (1);
+    }
+
+  read_profile(P->nfile[w],buf,len,off);
+  n = decode_profile(buf,len,plen,profile);
+
+  if (buf != count)
+    free(buf);
+  return (n);
+}
+
+  //  Fetch the profiles of the n reads ids[0..n) (0-based) with nthreads threads.  The
+  //    profile of ids[i] is placed in profiles[i*plen..(i+1)*plen) and its length in
+  //    lens[i], where as for Fetch_Profile only the first plen counts are placed if
+  //    lens[i] > plen.  The requests are sorted on id, and so on part and offset, and each
+  //    thread fetches a contiguous range of them, so the reads of each part sweep forward.
+
+typedef struct
+  { int64 id;      //  read id
+    int64 idx;     //  position of the request in ids
+  } Prof_Request;
+
+typedef struct
+  { Profile_Index *P;
+    Prof_Request  *reqs;
+    int64          beg, end;
+    int            plen;
+    uint16        *profiles;
+    int           *lens;
+  } Prof_Arg;
+
+static int REQ_SORT(const void *l, const void *r)
+{ Prof_Request *x = (Prof_Request *) l;
+  Prof_Request *y = (Prof_Request *) r;
+
+  if (x->id < y->id)
+    return (-1);
+  return (x->id > y->id);
+}
+
+static void *fetch_thread(void *arg)
+{ Prof_Arg      *parm = (Prof_Arg *) arg;
+  Profile_Index *P    = parm->P;
+  Prof_Request  *reqs = parm->reqs;
+  int64          plen = parm->plen;
+
+  uint8 *buf;
+  int64  bmax, len, off, i;
+  int    w;
+
+  bmax = PROF_BUF;
+  buf  = Malloc(bmax,"Allocating profile buffer");
+  if (buf == NULL)
+    exit (1);
+
+  for (i = parm->beg; i < parm->end; i++)
+    { len = locate_profile(P,reqs[i].id,&w,&off);
+      if (len > bmax)
+        { bmax = 1.2*len + PROF_BUF;
+          buf  = Realloc(buf,bmax,"Reallocating profile buffer");
+          if (buf == NULL)
+            exit (1);
+        }
+      read_profile(P->nfile[w],buf,len,off);
+      parm->lens[reqs[i].idx] =
+           decode_profile(buf,len,plen,parm->profiles + reqs[i].idx*plen);
+    }
+
+  free(buf);
+  return (NULL);
+}
+
+void Fetch_Profiles(Profile_Index *P, int64 n, int64 *ids, int plen, uint16 *profiles,
+                    int *lens, int nthreads)
+{ Prof_Request *reqs;
+  int64         i;
+  int           t;
+
+  if (n <= 0)
+    return;
+  if (nthreads > n)
+    nthreads = n;
+  if (nthreads < 1)
+    nthreads = 1;
+
+  reqs = Malloc(n*sizeof(Prof_Request),"Allocating profile requests");
+  if (reqs == NULL)
+    exit (1);
+  for (i = 0; i < n; i++)
+    { reqs[i].id  = ids[i];
+      reqs[i].idx = i;
+    }
+  qsort(reqs,n,sizeof(Prof_Request),REQ_SORT);
+
+  { Prof_Arg parm[nthreads];
+
+    for (t = 0; t < nthreads; t++)
+      { parm[t].P        = P;
+        parm[t].reqs     = reqs;
+        parm[t].beg      = (n*t)/nthreads;
+        parm[t].end      = (n*(t+1))/nthreads;
+        parm[t].plen     = plen;
+        parm[t].profiles = profiles;
+        parm[t].lens     = lens;
+      }
+    run_threads(fetch_thread,(void *) parm,sizeof(Prof_Arg),nthreads);
+  }
+
+  free(reqs);
+}
+
+
+/****************************************************************************************
+ *
+ *  Stream through all the profiles in order of read id.  Each part's .pidx and .prof
+ *    files are read sequentially in large blocks, so no seeks are needed.  A compact
+ *    .pidx part is instead mapped and its offsets decoded a block at a time.
+ *
+ *****************************************************************************************/
+
+#define PSTREAM_BUF 0x100000   //  Bytes of compressed profiles read at a time
+#define PSTREAM_IDX 0x10000    //  # of profile offsets read at a time
+
+typedef struct
+  { int     kmer;     //  Kmer length
+    int     nparts;   //  # of threads/parts for the profiles
+    int64   nreads;   //  total # of reads in data set
+    int64   cidx;     //  Id of the current read (nreads if at the end)
+    int     plen;     //  Length of the current profile
+    uint16 *profile;  //  Current profile (NULL if at the end)
+
+    int     part;     //  Part currently open
+    int     cmp;      //  The .pidx parts are compact
+    int     ifile;    //  Its .pidx file (if not compact)
+    int     pfile;    //  Its .prof file
+    int     nlen;     //  Length of path name
+    int     pmax;     //  Length of pdat
+    int     iptr;     //  Next offset in ibuf to use
+    int     itop;     //  # of offsets in ibuf
+    char   *name;     //  Path name for parts (only "pidx.#" or "prof.#" missing)
+    int64  *nbase;    //  nbase[p] = id of last read in part p + 1
+    int64  *ibuf;     //  Buffer of offsets from the .pidx file
+    int64   last;     //  End offset in part of the current compressed profile
+    uint8  *pbuf;     //  Buffer of bytes from the .prof file
+    int64   bmax;     //  Size of pbuf
+    uint8  *pptr;     //  Start of the next compressed profile in pbuf
+    uint8  *ptop;     //  End of the bytes read into pbuf
+    uint16 *pdat;     //  Array into which profiles are decoded
+    EF_Index efp;     //  The compact index of the part if cmp,
+    int64   eptr;     //    and the next offset in it to decode
+  } _Profile_Stream;
+
+static void close_profile_part(_Profile_Stream *S)
+{ if (S->part <= S->nparts)
+    { if (S->cmp)
+        munmap(S->efp.map,S->efp.msize);
+      else
+        close(S->ifile);
+      close(S->pfile);
+    }
+}
+
+static void open_profile_part(_Profile_Stream *S, int p)
+{ int64 header[2];
+  int   kmer;
+
+  close_profile_part(S);
+
+  sprintf(S->name+S->nlen,"pidx.%d",p);
+  if (S->cmp)
+    { S->ifile = 0;
+      if (ef_map(S->name,&(S->efp)))
+        S->ifile = -1;
+      S->eptr = 0;
+    }
+  else
+    S->ifile = open(S->name,O_RDONLY);
+  sprintf(S->name+S->nlen,"prof.%d",p);
+  S->pfile = open(S->name,O_RDONLY);
+  if (S->ifile < 0 || S->pfile < 0)
+    { fprintf(stderr,"Profile part %s is misssing ?\n",S->name);
+      exit (1);
+    }
+  if ( ! S->cmp)
+    { read(S->ifile,&kmer,sizeof(int));
+      read(S->ifile,header,2*sizeof(int64));
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+  if ( ! S->cmp)
+    posix_fadvise(S->ifile,0,0,POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(S->pfile,0,0,POSIX_FADV_SEQUENTIAL);
+#endif
+
+  S->part = p;
+  S->iptr = S->itop = 0;
+  S->last = 0;
+  S->pptr = S->ptop = S->pbuf;
+}
+
+  //  Decode the profile of read S->cidx, the read following the last one decoded
+
+static uint16 *next_profile(_Profile_Stream *S)
+{ int64 end, len, r;
+  int   n;
+
+  if (S->cidx >= S->nreads)
+    { S->profile = NULL;
+      S->plen    = 0;
+      return (NULL);
+    }
+
+  while (S->cidx >= S->nbase[S->part-1])
+    open_profile_part(S,S->part+1);
+
+  if (S->iptr >= S->itop)
+    { if (S->cmp)
+        { for (n = 0; n < PSTREAM_IDX && S->eptr < S->efp.n; n++)
+            S->ibuf[n] = ef_value(&(S->efp),S->eptr++);
+          S->itop = n;
+        }
+      else
+        S->itop = read(S->ifile,S->ibuf,PSTREAM_IDX*sizeof(int64)) / sizeof(int64);
+      S->iptr = 0;
+    }
+  end = S->ibuf[S->iptr++];
+  len = end - S->last;
+  S->last = end;
+
+  if (S->pptr + len > S->ptop)
+    { r = S->ptop - S->pptr;
+      memmove(S->pbuf,S->pptr,r);
+      if (len > S->bmax)
+        { S->bmax = len + PSTREAM_BUF;
+          S->pbuf = Realloc(S->pbuf,S->bmax,"Reallocating profile buffer");
+          if (S->pbuf == NULL)
+            exit (1);
+        }
+      while (r < len)
+        { n = read(S->pfile,S->pbuf+r,S->bmax-r);
+          if (n <= 0)
+            { fprintf(stderr,"Profile part %d is truncated ?\n",S->part);
+              exit (1);
+            }
+          r += n;
+        }
+      S->pptr = S->pbuf;
+      S->ptop = S->pbuf + r;
+    }
+
+  n = decode_profile(S->pptr,len,S->pmax,S->pdat);
+  if (n > S->pmax)
+    { S->pmax = 1.2*n + 1000;
+      S->pdat = Realloc(S->pdat,S->pmax*sizeof(uint16),"Reallocating profile array");
+      if (S->pdat == NULL)
+        exit (1);
+      decode_profile(S->pptr,len,S->pmax,S->pdat);
+    }
+  S->pptr += len;
+
+  S->profile = S->pdat;
+  S->plen    = n;
+  return (S->pdat);
+}
+
+Profile_Stream *Open_Profile_Stream(char *name)
+{ _Profile_Stream *S;
+  int    kmer, nparts;
+  int64  nreads, header[2];
+
+  int    f, p, x, k;
+  char  *dir, *root, *full;
+
+  //  Open stub file and get # of parts
+
+  dir  = PathTo(name);
+  root = Root(name,".prof");
+  full = Malloc(strlen(dir)+strlen(root)+30,"Allocating hidden file names\n");
+  if (full == NULL)
+    exit (1);
+  sprintf(full,"%s/%s.prof",dir,root);
+  f = open(full,O_RDONLY);
+  sprintf(full,"%s/.%s.",dir,root);
+  x = strlen(full);
+  free(root);
+  free(dir);
+  if (f < 0)
+    { free(full);
+      return (NULL);
+    }
+  read(f,&kmer,sizeof(int));
+  read(f,&nparts,sizeof(int));
+
+  S = Malloc(sizeof(_Profile_Stream),"Allocating profile stream");
+  if (S == NULL)
+    exit (1);
+  S->cmp = is_compact_stub(f);
+  close(f);
+  S->nbase = Malloc(nparts*sizeof(int64),"Allocating profile stream");
+  S->ibuf  = Malloc(PSTREAM_IDX*sizeof(int64),"Allocating profile stream");
+  S->pbuf  = Malloc(PSTREAM_BUF,"Allocating profile stream");
+  S->pdat  = Malloc(20000*sizeof(uint16),"Allocating profile stream");
+  if (S->nbase == NULL || S->ibuf == NULL || S->pbuf == NULL || S->pdat == NULL)
+    exit (1);
+
+  //  Get the # of reads in each part
+
+  nreads = 0;
+  for (p = 0; p < nparts; p++)
+    { sprintf(full+x,"pidx.%d",p+1);
+      f = open(full,O_RDONLY);
+      if (f < 0)
+        { fprintf(stderr,"Profile part %s is misssing ?\n",full);
+          exit (1);
+        }
+      read(f,&k,sizeof(int));
+      read(f,header,2*sizeof(int64));
+      if (k != kmer)
+        { fprintf(stderr,"Profile part %s does not have k-mer length matching stub ?\n",full);
+          exit (1);
+        }
+      close(f);
+      nreads += header[1];
+      S->nbase[p] = nreads;
+    }
+
+  S->kmer   = kmer;
+  S->nparts = nparts;
+  S->nreads = nreads;
+  S->name   = full;
+  S->nlen   = x;
+  S->pmax   = 20000;
+  S->bmax   = PSTREAM_BUF;
+  S->part   = nparts+1;
+
+  open_profile_part(S,1);
+  S->cidx = 0;
+  next_profile(S);
+
+  return ((Profile_Stream *) S);
+}
+
+void Free_Profile_Stream(Profile_Stream *_S)
+{ _Profile_Stream *S = (_Profile_Stream *) _S;
+
+  close_profile_part(S);
+  free(S->pdat);
+  free(S->pbuf);
+  free(S->ibuf);
+  free(S->nbase);
+  free(S->name);
+  free(S);
+}
+
+  //  Position the stream at the first read, or the next read, and return its profile,
+  //    or NULL if there are no more reads.  The profile and its length are also in the
+  //    fields profile and plen, and remain valid until the stream is next moved.
+
+uint16 *First_Profile_Entry(Profile_Stream *_S)
+{ _Profile_Stream *S = (_Profile_Stream *) _S;
+
+  if (S->cidx != 0)
+    { open_profile_part(S,1);
+      S->cidx = 0;
+      next_profile(S);
+    }
+  return (S->profile);
+}
+
+uint16 *Next_Profile_Entry(Profile_Stream *_S)
+{ _Profile_Stream *S = (_Profile_Stream *) _S;
+
+  if (S->cidx >= S->nreads)
+    return (NULL);
+  S->cidx += 1;
+  return (next_profile(S));
+}
+
+
+/****************************************************************************************
+ *
+ *  Map the .psum file of per-read profile summaries output by FastK -s
+ *
+ *****************************************************************************************/
+
+#define PSUM_HEADER  (2*sizeof(int) + sizeof(int64))
+
+typedef struct
+  { int          kmer;
+    int          solid;
+    int64        nreads;
+    Profile_Sum *sums;
+    uint8       *map;     //  Mapping of the .psum file
+    int64        msize;   //    and its size
+  } _Profile_Summary;
+
+Profile_Summary *Map_Profile_Summary(char *name)
+{ _Profile_Summary *S;
+  int    kmer, solid;
+  int64  nreads, msize;
+  uint8 *map;
+  char  *dir, *root, *full;
+  int    f;
+
+  dir  = PathTo(name);
+  root = Root(name,".psum");
+  full = Malloc(strlen(dir)+strlen(root)+20,"Summary name allocation");
+  if (full == NULL)
+    exit (1);
+  sprintf(full,"%s/%s.psum",dir,root);
+  f = open(full,O_RDONLY);
+  free(root);
+  free(dir);
+  if (f < 0)
+    { free(full);
+      return (NULL);
+    }
+  read(f,&kmer,sizeof(int));
+  read(f,&solid,sizeof(int));
+  nreads = -1;
+  read(f,&nreads,sizeof(int64));
+
+  msize = PSUM_HEADER + nreads*sizeof(Profile_Sum);
+  if (nreads < 0 || lseek(f,0,SEEK_END) != msize)
+    { close(f);                   //  Truncated or otherwise not a .psum file
+      free(full);
+      return (NULL);
+    }
+
+  map   = mmap(NULL,msize,PROT_READ,MAP_SHARED,f,0);
+  close(f);
+  if (map == MAP_FAILED)
+    { fprintf(stderr,"Could not map profile summaries %s into memory\n",full);
+      exit (1);
+    }
+  madvise(map,msize,MADV_SEQUENTIAL);
+  free(full);
+
+  S = Malloc(sizeof(_Profile_Summary),"Allocating profile summary");
+  if (S == NULL)
+    exit (1);
+  S->kmer   = kmer;
+  S->solid  = solid;
+  S->nreads = nreads;
+  S->sums   = (Profile_Sum *) (map + PSUM_HEADER);
+  S->map    = map;
+  S->msize  = msize;
+
+  return ((Profile_Summary *) S);
+}
+
+void Free_Profile_Summary(Profile_Summary *_S)
+{ _Profile_Summary *S = (_Profile_Summary *) _S;
+
+  munmap(S->map,S->msize);
+  free(S);
+}
+
+
+/****************************************************************************************
+ *
+ *  Convert the .pidx parts of a profile between the plain and compact encodings
+ *
+ *****************************************************************************************/
+
+typedef struct
+  { char *dir;      //  Profile is dir/root.prof
+    char *root;
+    int   beg;      //  Convert parts beg, beg+step, ... <= nparts
+    int   step;
+    int   nparts;
+    int   cmp;      //  Make compact if set, otherwise plain
+  } Compact_Arg;
+
+static void *compact_thread(void *arg)
+{ Compact_Arg *data = (Compact_Arg *) arg;
+
+  char    *in, *out;
+  int64   *val, first, n, i;
+  int      p, f, g, kmer;
+  EF_Index E;
+
+  in = Malloc(2*(strlen(data->dir)+strlen(data->root)+30),"Allocating part names");
+  if (in == NULL)
+    exit (1);
+  out = in + (strlen(data->dir)+strlen(data->root)+30);
+
+  for (p = data->beg; p <= data->nparts; p += data->step)
+    { sprintf(in,"%s/.%s.pidx.%d",data->dir,data->root,p);
+      sprintf(out,"%s/.%s.pidx.%d.tmp",data->dir,data->root,p);
+      f = open(in,O_RDONLY);
+      g = open(out,O_CREAT|O_TRUNC|O_WRONLY,S_IRWXU);
+      if (f < 0 || g < 0)
+        { fprintf(stderr,"%s: Cannot open profile part %s or its conversion\n",Prog_Name,in);
+          exit (1);
+        }
+      read(f,&kmer,sizeof(int));
+      read(f,&first,sizeof(int64));
+      read(f,&n,sizeof(int64));
+      close(f);
+
+      val = Malloc((n+1)*sizeof(int64),"Allocating profile offsets");
+      if (val == NULL)
+        exit (1);
+
+      write(g,&kmer,sizeof(int));
+      write(g,&first,sizeof(int64));
+      write(g,&n,sizeof(int64));
+
+      if (data->cmp)
+        { f = open(in,O_RDONLY);
+          lseek(f,sizeof(int)+2*sizeof(int64),SEEK_SET);
+          read(f,val,n*sizeof(int64));
+          close(f);
+          ef_write(g,val,n);
+        }
+      else
+        { ef_map(in,&E);
+          for (i = 0; i < n; i++)
+            val[i] = ef_value(&E,i);
+          munmap(E.map,E.msize);
+          write(g,val,n*sizeof(int64));
+        }
+
+      free(val);
+      close(g);
+    }
+
+  free(in);
+  return (NULL);
+}
+
+int Convert_Profile_Index(char *name, int cmp, int nthreads)
+{ char        *dir, *root, *full, *part;
+  int          f, p, t, kmer, nparts, one;
+
+  dir  = PathTo(name);
+  root = Root(name,".prof");
+  full = Malloc(2*(strlen(dir)+strlen(root)+30),"Profile name allocation");
+  if (full == NULL)
+    exit (1);
+  part = full + (strlen(dir)+strlen(root)+30);
+  sprintf(full,"%s/%s.prof",dir,root);
+  f = open(full,O_RDONLY);
+  if (f < 0)
+    { free(full);
+      free(root);
+      free(dir);
+      return (1);
+    }
+  read(f,&kmer,sizeof(int));
+  read(f,&nparts,sizeof(int));
+  one = is_compact_stub(f);
+  close(f);
+
+  if (one != cmp)
+    { Compact_Arg parm[nthreads];
+
+      if (nthreads > nparts)
+        nthreads = nparts;
+      for (t = 0; t < nthreads; t++)
+        { parm[t].dir    = dir;
+          parm[t].root   = root;
+          parm[t].beg    = t+1;
+          parm[t].step   = nthreads;
+          parm[t].nparts = nparts;
+          parm[t].cmp    = cmp;
+        }
+      run_threads(compact_thread,(void *) parm,sizeof(Compact_Arg),nthreads);
+
+      for (p = 1; p <= nparts; p++)
+        { sprintf(part,"%s/.%s.pidx.%d",dir,root,p);
+          sprintf(full,"%s/.%s.pidx.%d.tmp",dir,root,p);
+          rename(full,part);
+        }
+
+      sprintf(full,"%s/%s.prof",dir,root);
+      f = open(full,O_CREAT|O_TRUNC|O_WRONLY,S_IRWXU);
+      write(f,&kmer,sizeof(int));
+      write(f,&nparts,sizeof(int));
+      one = 1;
+      if (cmp)
+        write(f,&one,sizeof(int));
+      close(f);
+    }
+
+  free(full);
+  free(root);
+  free(dir);
+  return (0);
+}
@@ -48,20 +48,50 @@ typedef struct
     int     tbyte;        //  Kmer+count entry in bytes
     int64   nels;         //  # of unique, sorted k-mers in the table
     uint8  *table;        //  The (huge) table in memory
-    void   *private[1];   //  Private fields
+    int     mapped;       //  Non-zero if the table is mapped from its file rather than read
+    void   *private[6];   //  Private fields
   } Kmer_Table;
 
 Kmer_Table *Load_Kmer_Table(char *name, int cut_off);
+Kmer_Table *Map_Kmer_Table(char *name, int populate);
 void        Free_Kmer_Table(Kmer_Table *T);
 
 char       *Fetch_Kmer(Kmer_Table *T, int64 i);
 int         Fetch_Count(Kmer_Table *T, int64 i);
 
 int64       Find_Kmer(Kmer_Table *T, char *kseq);
+int         Kmer_Prefix_Width(int64 nels, int kmer);
+int64       Kmer_Prefix(uint8 *kmer, int kbyte, int pbits);
+void        Find_Kmers(Kmer_Table *T, int64 n, char **kseqs, int64 *idx);
+void        Find_Packed_Kmers(Kmer_Table *T, int64 n, uint8 *kmers, int64 *idx);
+void        Query_Packed_Kmers(Kmer_Table *T, int64 n, uint8 *kmers, int64 *idx,
+                               int nthreads);
+
+int64       Profile_Sequence(Kmer_Table *T, char *seq, int64 len, uint16 *profile);
 
 void        List_Kmer_Table(Kmer_Table *T, FILE *out);
 int         Check_Kmer_Table(Kmer_Table *T);
 
+int         Convert_Kmer_Table(char *name, int zip, int nthreads);
+int         Reshard_Kmer_Table(char *name, int nparts, char **bounds, int nthreads);
+
+
+  //  K-MER HASH (a minimal perfect hash over the k-mers of a table)
+
+typedef struct
+  { Kmer_Table *table;     //  Table whose k-mers are hashed
+    int         nlevels;   //  # of levels in the hash
+    int64       nleft;     //  # of k-mers not placed by any level (found by a search)
+    void       *private[8];  //  Private fields
+  } Kmer_Hash;
+
+Kmer_Hash  *Make_Kmer_Hash(Kmer_Table *T, int nthreads);
+int         Write_Kmer_Hash(Kmer_Hash *H, char *name);
+Kmer_Hash  *Load_Kmer_Hash(Kmer_Table *T, char *name);
+void        Free_Kmer_Hash(Kmer_Hash *H);
+
+int64       Hash_Kmer(Kmer_Hash *H, char *kseq);
+
 
   //  K-MER STREAM
 
@@ -73,7 +103,7 @@ typedef struct
     int64  nels;       //  # of elements in entire table
     uint8 *celm;       //  Current entry (in buffer)
     int64  cidx;       //  Index of current entry (in table as a whole)
-    void  *private[7]; //  Private fields
+    void  *private[10]; //  Private fields
   } Kmer_Stream;
 
 Kmer_Stream *Open_Kmer_Stream(char *name);
@@ -88,6 +118,30 @@ int          Current_Count(Kmer_Stream *entry);
 uint8       *GoTo_Kmer_Index(Kmer_Stream *S, int64 idx);
 uint8       *GoTo_Kmer_String(Kmer_Stream *S, uint8 *entry);
 
+uint64       Kmer_Stream_Signature(Kmer_Stream *S);
+
+Kmer_Stream  *Clone_Kmer_Stream(Kmer_Stream *S);
+Kmer_Stream **Clone_Kmer_Streams(int n, Kmer_Stream **S);
+void          Free_Kmer_Streams(int n, Kmer_Stream **S);
+
+
+  //  K-MER MERGE (the entries of several streams in k-mer order)
+
+typedef struct
+  { int     nstreams;  //  # of streams merged
+    int     kbyte;     //  Kmer encoding in bytes
+    uint8  *kmer;      //  Current k-mer (2-bit packed)
+    int     nin;       //  # of streams whose head was the current k-mer
+    int    *in;        //  in[0..nin) = those streams in increasing order
+    int    *cnt;       //  cnt[i] = count of the current k-mer in stream in[i]
+    void   *private[6];  //  Private fields
+  } Kmer_Merge;
+
+Kmer_Merge  *Open_Kmer_Merge(int n, Kmer_Stream **S, int64 *begs, int64 *ends);
+void         Free_Kmer_Merge(Kmer_Merge *M);
+
+int          Next_Kmer_Merge(Kmer_Merge *M);
+
 
   //  PROFILES
 
@@ -98,7 +152,8 @@ typedef struct
     int64 *nbase;    //  nbase[i] for i in [0,nparts) = id of last read in part i + 1
     int   *nfile;    //  nfile[i] for i in [0,nparts) = stream for ".prof" file of part i
     int64 *index;    //  index[i] for i in [0,nreads) = offset in relevant part of
-                     //    compressed profile for read i
+                     //    compressed profile for read i (NULL if the index is compact)
+    void  *private[1];  //  Private fields
   } Profile_Index;
 
 Profile_Index *Open_Profiles(char *name);
@@ -107,4 +162,50 @@ void Free_Profiles(Profile_Index *P);
 
 int Fetch_Profile(Profile_Index *P, int64 id, int plen, uint16 *profile);
 
+void Fetch_Profiles(Profile_Index *P, int64 n, int64 *ids, int plen, uint16 *profiles,
+                    int *lens, int nthreads);
+
+int Convert_Profile_Index(char *name, int cmp, int nthreads);
+
+
+  //  PROFILE STREAM
+
+typedef struct
+  { int     kmer;      //  Kmer length
+    int     nparts;    //  # of threads/parts for the profiles
+    int64   nreads;    //  total # of reads in data set
+    int64   cidx;      //  Id of the current read (nreads if at the end)
+    int     plen;      //  Length of the current profile
+    uint16 *profile;   //  Current profile (NULL if at the end)
+    void   *private[21]; //  Private fields
+  } Profile_Stream;
+
+Profile_Stream *Open_Profile_Stream(char *name);
+void            Free_Profile_Stream(Profile_Stream *S);
+
+uint16         *First_Profile_Entry(Profile_Stream *S);
+uint16         *Next_Profile_Entry(Profile_Stream *S);
+
+
+  //  PROFILE SUMMARIES (the .psum file produced by FastK -s)
+
+typedef struct
+  { uint32 len;      //  # of k-mers in the read
+    uint16 median;   //  median k-mer count (the lower one if len is even)
+    uint16 min;      //  minimum k-mer count
+    uint32 nlow;     //  # of k-mers with count < solid
+    uint32 lrun;     //  longest run of consecutive k-mers with count < solid
+  } Profile_Sum;
+
+typedef struct
+  { int          kmer;     //  Kmer length
+    int          solid;    //  Counts less than this are low
+    int64        nreads;   //  # of reads
+    Profile_Sum *sums;     //  sums[i] for i in [0,nreads) = summary of read i (0-based)
+    void        *private[2];  //  Private fields
+  } Profile_Summary;
+
+Profile_Summary *Map_Profile_Summary(char *name);
+void             Free_Profile_Summary(Profile_Summary *S);
+
 #endif // _LIBFASTK
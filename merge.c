@@ -60,6 +60,144 @@ static void reload(IO_block *in)
   in->top += read(in->stream,in->top,BUFLEN_UINT8-del);
 }
 
+  //  Per-read profile summaries (if PRO_SOLID > 0).  Each thread decodes the counts of a
+  //    read as its profile is merged and then appends a Psum record for it to a temporary
+  //    file.  Psum must match Profile_Sum in libfastk.h.
+
+#define SUM_BUF  0x10000
+
+typedef struct
+  { uint32 len;      //  # of k-mers in the read
+    uint16 median;   //  median k-mer count (the lower one if len is even)
+    uint16 min;      //  minimum k-mer count
+    uint32 nlow;     //  # of k-mers with count < PRO_SOLID
+    uint32 lrun;     //  longest run of consecutive k-mers with count < PRO_SOLID
+  } Psum;
+
+typedef struct
+  { int     sfile;   //  Temporary file of summaries for the thread
+    Psum   *buf;     //  Buffer of summaries not yet written
+    int     nbuf;
+    uint16 *cnts;    //  Counts of the current read
+    int64   ncnt;
+    int64   cmax;
+  } Sum_State;
+
+  //  Add the count d followed by those encoded in the len bytes at p to the current read
+
+static void sum_counts(Sum_State *s, uint8 *p, int len, uint16 d)
+{ uint8  *q;
+  uint16 *c, x;
+  int     i;
+
+  if (s->ncnt + 63*len + 1 > s->cmax)
+    { s->cmax = 1.2*(s->ncnt + 63*len) + 1000;
+      s->cnts = Realloc(s->cnts,sizeof(uint16)*s->cmax,"Reallocating count buffer");
+      if (s->cnts == NULL)
+        exit (1);
+    }
+
+  c = s->cnts + s->ncnt;
+  *c++ = d;
+  for (q = p+len; p < q; )
+    { x = *p++;
+      if ((x & 0xc0) == 0)
+        for (i = 0; i < x; i++)
+          *c++ = d;
+      else
+        { if ((x & 0x80) != 0)
+            { if ((x & 0x40) != 0)
+                x <<= 8;
+              else
+                x = (x << 8) & 0x7fff;
+              x |= *p++;
+              d = (d+x) & 0x7fff;
+            }
+          else if ((x & 0x20) != 0)
+            d += (x & 0x1fu) | 0xffe0u;
+          else
+            d += (x & 0x1fu);
+          *c++ = d;
+        }
+    }
+  s->ncnt = c - s->cnts;
+}
+
+  //  Return the k'th smallest of a[0..n) (a is permuted)
+
+static uint16 select_count(uint16 *a, int64 n, int64 k)
+{ int64  l, r, i, j;
+  uint16 v, t;
+
+  l = 0;
+  r = n-1;
+  while (l < r)
+    { v = a[(l+r) >> 1];
+      i = l;
+      j = r;
+      while (i <= j)
+        { while (a[i] < v)
+            i += 1;
+          while (a[j] > v)
+            j -= 1;
+          if (i <= j)
+            { t = a[i];
+              a[i++] = a[j];
+              a[j--] = t;
+            }
+        }
+      if (k <= j)
+        r = j;
+      else if (k >= i)
+        l = i;
+      else
+        break;
+    }
+  return (a[k]);
+}
+
+  //  Summarize the counts of the current read (possibly empty) and start the next
+
+static void end_summary(Sum_State *s)
+{ Psum   *r;
+  uint16 *c;
+  int64   n, i, run;
+
+  if (s->nbuf >= SUM_BUF)
+    { write(s->sfile,s->buf,s->nbuf*sizeof(Psum));
+      s->nbuf = 0;
+    }
+  r = s->buf + s->nbuf++;
+
+  c = s->cnts;
+  n = s->ncnt;
+  r->len    = n;
+  r->min    = 0;
+  r->median = 0;
+  r->nlow   = 0;
+  r->lrun   = 0;
+  if (n == 0)
+    return;
+
+  r->min = c[0];
+  run    = 0;
+  for (i = 0; i < n; i++)
+    { if (c[i] < r->min)
+        r->min = c[i];
+      if (c[i] < PRO_SOLID)
+        { r->nlow += 1;
+          run     += 1;
+          if (run > r->lrun)
+            r->lrun = run;
+        }
+      else
+        run = 0;
+    }
+  r->median = select_count(c,n,(n-1)/2);
+
+  s->ncnt = 0;
+}
+
   //  Thread to merge files of super-mer profiles
 
 static int PAN_SIZE;   //  # of profile runs to output as a block
@@ -79,6 +217,8 @@ typedef struct
     int       dfile;   //  D-file output
     int64     nreads;  //  # of reads seen by this thread
     int64     nbase;   //  First rid for thread
+    int64     rbase;   //  First read id for thread (if PRO_SELECT)
+    Sum_State sum;     //  Read summaries (if PRO_SOLID > 0)
   } Track_Arg;
 
 static int64 totin;  //  Total bytes for part 0, thread 0
@@ -89,6 +229,7 @@ static void *merge_profile_thread(void *arg)
   int          dfile = data->dfile;
   IO_block    *io    = data->io;
   Entry       *chord = data->chord;
+  Sum_State   *sum   = PRO_SOLID > 0 ? &(data->sum) : NULL;
   int          maxS  = 2*MAX_SUPER + 2 + PLEN_BYTES + RUN_BYTES;
 
   uint8 *dbuf;
@@ -101,7 +242,8 @@ static void *merge_profile_thread(void *arg)
   uint16 lcont, d;
   uint8 *db = (uint8 *)  &d;
   int    n;
-  int64  nidx;
+  int64  nidx = 0;
+  int64  sr;
 
   int64  pct1, partin, nextin;
   int    CLOCK;
@@ -232,6 +374,14 @@ static void *merge_profile_thread(void *arg)
       src->ptr = sptr;
     }
 
+  //  If profiling a selection of the reads, find the first range of selected super-mers
+  //    of this thread
+
+  sr = 0;
+  if (PRO_SELECT)
+    while (sr < SEL_NUM && SEL_RANGE[3*sr] < data->nbase)
+      sr += 1;
+
   //  For each run of PAN_SIZE consecutive super-mer profiles do
 
   nidx += data->nbase;
@@ -370,7 +520,25 @@ static void *merge_profile_thread(void *arg)
 
         o = dbuf;
         for (n = 0, p = panel; p < nanel; n++, p++)
-          { len = chord[n].len;
+          { if (PRO_SELECT)                      //  Only selected reads have profiles, the
+              { while (sr < SEL_NUM && SEL_RANGE[3*sr+1] <= p)    //  others are empty
+                  sr += 1;
+                if (sr >= SEL_NUM || p < SEL_RANGE[3*sr])
+                  continue;
+                if (p == SEL_RANGE[3*sr])
+                  while (nreads < SEL_RANGE[3*sr+2] - data->rbase)
+                    { if (aptr >= atop)
+                        { write(afile,abuf,BUFLEN_IBYTE);
+                          aptr = abuf;
+                        }
+                      *aptr++ = offset + (o-dbuf);
+                      nreads += 1;
+                      if (sum != NULL)
+                        end_summary(sum);
+                    }
+              }
+
+            len = chord[n].len;
             ptr = chord[n].frag;
 
             if (len == 0)
@@ -380,6 +548,8 @@ static void *merge_profile_thread(void *arg)
                   }
                 *aptr++ = offset + (o-dbuf);
                 nreads += 1;
+                if (sum != NULL)
+                  end_summary(sum);
                 continue;
               }
 
@@ -437,6 +607,9 @@ static void *merge_profile_thread(void *arg)
                 lcont += d;
               } 
 
+            if (sum != NULL)
+              sum_counts(sum,ptr,len > 2 ? len-4 : 0,lcont);
+
             //  Transfer remainder of profile keeping track of absolute count
           
             if (len > 2)
@@ -465,6 +638,8 @@ static void *merge_profile_thread(void *arg)
                   }
                 *aptr++ = offset + (o-dbuf);
                 nreads += 1;
+                if (sum != NULL)
+                  end_summary(sum);
               }
           }
 
@@ -484,10 +659,26 @@ static void *merge_profile_thread(void *arg)
       }
     }
 
-  //  Flush the A-file buffer
+  //  Add empty profiles for any unselected reads at the end of the thread's reads
+
+  if (PRO_SELECT)
+    while (nreads < NUM_READS[data->wch])
+      { if (aptr >= atop)
+          { write(afile,abuf,BUFLEN_IBYTE);
+            aptr = abuf;
+          }
+        *aptr++ = offset;
+        nreads += 1;
+        if (sum != NULL)
+          end_summary(sum);
+      }
+
+  //  Flush the A-file and summary buffers
 
   if (aptr > abuf)
     write(afile,abuf,(aptr-abuf)*sizeof(int64));
+  if (sum != NULL && sum->nbuf > 0)
+    write(sum->sfile,sum->buf,sum->nbuf*sizeof(Psum));
 
   data->nreads = nreads;
 
@@ -542,9 +733,10 @@ void Merge_Profiles(char *dpwd, char *dbrt)
 #endif
 
   { int   t;
-    int64 o, n;
+    int64 o, n, r;
 
     o = 0;
+    r = 0;
     for (t = 0; t < ITHREADS; t++)
       { int         f;
         struct stat info;
@@ -569,6 +761,10 @@ void Merge_Profiles(char *dpwd, char *dbrt)
 #endif
         parmk[t].nbase = o;
         o += n;
+        if (PRO_SELECT)
+          { parmk[t].rbase = r;
+            r += NUM_READS[t];
+          }
 
         if (VERBOSE && t == 0)
           { fstat(f,&info);
@@ -649,6 +845,24 @@ void Merge_Profiles(char *dpwd, char *dbrt)
         parmk[t].io    = io + p;
         parmk[t].chord = chord + PAN_SIZE*t;
 
+        if (PRO_SOLID > 0)
+          { Sum_State *s = &(parmk[t].sum);
+
+            sprintf(fname,"%s.S%d",root,t);
+            s->sfile = open(fname,O_RDWR|O_CREAT|O_TRUNC,S_IRWXU|S_IRWXG|S_IRWXO);
+            if (s->sfile == -1)
+              { fprintf(stderr,"%s: Cannot open external file %s\n",Prog_Name,fname);
+                exit (1);
+              }
+            s->buf  = Malloc(SUM_BUF*sizeof(Psum),"Allocating summary buffer");
+            s->cmax = 2*(MAX_SUPER+1);
+            s->cnts = Malloc(s->cmax*sizeof(uint16),"Allocating summary buffer");
+            if (s->buf == NULL || s->cnts == NULL)
+              exit (1);
+            s->nbuf = 0;
+            s->ncnt = 0;
+          }
+
 
         for (n = 0; n <= NPARTS; n++, p++)
           io[p].block = blocks + p*BUFLEN_UINT8;
@@ -695,6 +909,55 @@ void Merge_Profiles(char *dpwd, char *dbrt)
         }
     }
 
+    //  Concatenate the thread summaries into the .psum file (if requested)
+
+    if (PRO_SOLID > 0)
+      { int64 nreads, size;
+        int   f, g;
+        int   len;
+        uint8 *buf;
+
+        sprintf(fname,"%s/%s.psum",dpwd,dbrt);
+        f = open(fname,O_WRONLY|O_CREAT|O_TRUNC,S_IRWXU|S_IRWXG|S_IRWXO);
+        if (f == -1)
+          { fprintf(stderr,"%s: Cannot open external file %s for writing\n",Prog_Name,fname);
+            exit (1);
+          }
+        nreads = 0;
+        for (t = 0; t < ITHREADS; t++)
+          nreads += parmk[t].nreads;
+        write(f,&KMER,sizeof(int));
+        write(f,&PRO_SOLID,sizeof(int));
+        write(f,&nreads,sizeof(int64));
+
+        buf = (uint8 *) parmk[0].sum.buf;
+        for (t = 0; t < ITHREADS; t++)
+          { g = parmk[t].sum.sfile;
+            size = lseek(g,0,SEEK_CUR);
+            lseek(g,0,SEEK_SET);
+            while (size > 0)
+              { len = read(g,buf,SUM_BUF*sizeof(Psum));
+                if (len <= 0)
+                  { fprintf(stderr,"%s: Read of summary file failed\n",Prog_Name);
+                    exit (1);
+                  }
+                write(f,buf,len);
+                size -= len;
+              }
+            close(g);
+            sprintf(fname,"%s.S%d",root,t);
+            unlink(fname);
+            free(parmk[t].sum.cnts);
+          }
+        close(f);
+        for (t = 0; t < ITHREADS; t++)
+          free(parmk[t].sum.buf);
+      }
+    else
+      { sprintf(fname,"%s/%s.psum",dpwd,dbrt);    //  Remove any summaries of an earlier run
+        unlink(fname);
+      }
+
     //  Release working data
 
     free(root);
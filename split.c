@@ -783,6 +783,134 @@ int Determine_Scheme(DATA_BLOCK *block)
 }
 
 
+/*******************************************************************************************
+ *
+ *  SAVING, LOADING, AND RESTRICTING A SCHEME
+ *     void Save_Scheme(char *name)
+ *        Write the base mapping, padding, and core prefix trie with its bucket assignment
+ *        to the file name so that other runs on the same data can distribute k-mers to
+ *        exactly the same buckets.
+ *     int  Load_Scheme(char *name)
+ *        Set up the scheme saved in name in place of Determine_Scheme, returning the #
+ *        of k-mers in the longest super-mer.
+ *     void Restrict_Scheme(int beg, int end)
+ *        Renumber buckets [beg,end) to [0,end-beg) and send all other super-mers to the
+ *        non-existent bucket NPARTS = end-beg, so that only those buckets are counted.
+ *
+ ********************************************************************************************/
+
+void Save_Scheme(char *name)
+{ FILE *f;
+  int   i, x;
+
+  f = fopen(name,"w");
+  if (f == NULL)
+    { fprintf(stderr,"\n%s: Cannot open scheme file %s for writing\n",Prog_Name,name);
+      exit (1);
+    }
+  fwrite(&KMER,sizeof(int),1,f);
+  fwrite(&NPARTS,sizeof(int),1,f);
+  fwrite(&PAD,sizeof(int),1,f);
+  for (i = 0; i < 4; i++)
+    { x = Tran[i];
+      fwrite(&x,sizeof(int),1,f);
+    }
+  fwrite(&Min_States,sizeof(int),1,f);
+  fwrite(Min_Part,sizeof(int),Min_States,f);
+  fclose(f);
+}
+
+int Load_Scheme(char *name)
+{ FILE *f;
+  int   i, x, kmer;
+  int   tran[4];
+
+  f = fopen(name,"r");
+  if (f == NULL)
+    { fprintf(stderr,"\n%s: Cannot open scheme file %s\n",Prog_Name,name);
+      exit (1);
+    }
+  if (fread(&kmer,sizeof(int),1,f) != 1 || fread(&NPARTS,sizeof(int),1,f) != 1
+      || fread(&PAD,sizeof(int),1,f) != 1 || fread(tran,sizeof(int),4,f) != 4
+      || fread(&Min_States,sizeof(int),1,f) != 1
+      || NPARTS <= 0 || PAD < 0 || MIN_LEN + PAD > kmer || Min_States < MIN_TOT)
+    { fprintf(stderr,"\n%s: Scheme file %s is not a FastK scheme\n",Prog_Name,name);
+      exit (1);
+    }
+  if (kmer != KMER)
+    { fprintf(stderr,"\n%s: Scheme file %s is for %d-mers, not %d-mers\n",
+                     Prog_Name,name,kmer,KMER);
+      exit (1);
+    }
+
+  Min_Part = Malloc(sizeof(int)*Min_States,"Allocating core prefix trie");
+  if (Min_Part == NULL)
+    exit (1);
+  if ((int) fread(Min_Part,sizeof(int),Min_States,f) != Min_States)
+    { fprintf(stderr,"\n%s: Scheme file %s is truncated\n",Prog_Name,name);
+      exit (1);
+    }
+  fclose(f);
+
+  for (i = 0; i < 4; i++)
+    Tran[i] = tran[i];
+  Tran['a'] = Tran['A'] = Tran[0];
+  Tran['c'] = Tran['C'] = Tran[1];
+  Tran['g'] = Tran['G'] = Tran[2];
+  Tran['t'] = Tran['T'] = Tran[3];
+
+  Dran['a'] = Dran['A'] = 0;
+  Dran['c'] = Dran['C'] = 1;
+  Dran['g'] = Dran['G'] = 2;
+  Dran['t'] = Dran['T'] = 3;
+
+  Fran['a'] = Fran['A'] = 3;
+  Fran['c'] = Fran['C'] = 2;
+  Fran['g'] = Fran['G'] = 1;
+  Fran['t'] = Fran['T'] = 0;
+
+  PAD2     = 2*PAD;
+  PAD_LEN  = MIN_LEN + PAD;
+  PAD_TOT  = (((int64) MIN_TOT) << PAD2);
+  PAD_L1   = PAD_LEN - 1;
+  PAD_MSK  = PAD_TOT - 1; 
+
+  MAX_SUPER = KMER - PAD_L1;
+
+  Cran['a'] = Cran['A'] = (Tran['t'] << (2*PAD_L1));
+  Cran['c'] = Cran['C'] = (Tran['g'] << (2*PAD_L1));
+  Cran['g'] = Cran['G'] = (Tran['c'] << (2*PAD_L1));
+  Cran['t'] = Cran['T'] = (Tran['a'] << (2*PAD_L1));
+
+  for (i = 0; i < Min_States; i++)
+    { x = Min_Part[i];
+      if (x >= NPARTS || (x < 0 && -x+3 >= Min_States))
+        { fprintf(stderr,"\n%s: Scheme file %s is corrupted\n",Prog_Name,name);
+          exit (1);
+        }
+    }
+
+  if (VERBOSE)
+    fprintf(stderr,"  Using %d-minimizers with %d core prefixes in %d buckets from %s\n",
+                   PAD_LEN,Min_States,NPARTS,name);
+
+  return (MAX_SUPER);
+}
+
+void Restrict_Scheme(int beg, int end)
+{ int i;
+
+  for (i = 0; i < Min_States; i++)
+    if (Min_Part[i] >= 0)
+      { if (Min_Part[i] >= beg && Min_Part[i] < end)
+          Min_Part[i] -= beg;
+        else
+          Min_Part[i] = end-beg;
+      }
+  NPARTS = end-beg;
+}
+
+
 /*******************************************************************************************
  *
  *  SUPER K-MER DISTRIBUTOR
@@ -990,6 +1118,36 @@ static int       *totrds;   //  # of reads processed
 static int64     *totbps;   //  # of bps processed
 static int        short_read;  //   There was at least one read < KMER (after prefix removal)
 
+  //  If only a selection of the reads are to be profiled, then the # of super-mer ids spanned
+  //    by each read is recorded as a varint in rspan[tid] so that the ranges of ids of the
+  //    selected reads can be determined once the reads of every thread are known.
+
+static uint8    **rspan;    //  Span list for each thread
+static int64     *rslen;    //  Its length
+static int64     *rsmax;    //  and its allocated size
+static int64     *rsbeg;    //  Id of 1st super-mer of the read being processed (-1 if none)
+
+static void end_read(int tid, int64 nidx)
+{ uint64 span;
+  uint8 *buf;
+
+  if (rslen[tid] + 10 > rsmax[tid])
+    { rsmax[tid] = 1.2*rsmax[tid] + 0x10000;
+      rspan[tid] = Realloc(rspan[tid],rsmax[tid],"Allocating read span list");
+      if (rspan[tid] == NULL)
+        exit (1);
+    }
+  buf  = rspan[tid] + rslen[tid];
+  span = nidx - rsbeg[tid];
+  while (span >= 0x80)
+    { *buf++ = (span & 0x7f) | 0x80;
+      span >>= 7;
+    }
+  *buf++ = span;
+  rslen[tid] = buf - rspan[tid];
+  rsbeg[tid] = -1;
+}
+
 void Distribute_Block(DATA_BLOCK *block, int tid)
 { int    nreads  = block->nreads;
   char  *bases   = block->bases;
@@ -1048,8 +1206,13 @@ void Distribute_Block(DATA_BLOCK *block, int tid)
       q = (t-s)-1;
       r = s-KM1;
 
+      if (PRO_SELECT && rsbeg[tid] < 0)
+        rsbeg[tid] = nidx;
+
       if (q < KMER)
         { nidx += 1;
+          if (PRO_SELECT && (i < nreads-1 || block->rem == 0))
+            end_read(tid,nidx);
           continue;
         }
 
@@ -1116,6 +1279,8 @@ void Distribute_Block(DATA_BLOCK *block, int tid)
                   b = Min_Part[o];
                   y -= 2;
                 }
+              if (b >= NPARTS)      //  Bucket of another shard (-B)
+                goto next_super;
 
 #ifdef DEBUG_DISTRIBUTE
               if (force)
@@ -1188,6 +1353,7 @@ void Distribute_Block(DATA_BLOCK *block, int tid)
                 }
               trg->bptrs = ptr;
 
+            next_super:
               if (force)
                 { mc = min[(++m) & MOD_MSK];
                   for (n = m+1; n <= p; n++)
@@ -1227,6 +1393,8 @@ void Distribute_Block(DATA_BLOCK *block, int tid)
               if (PACKET < 0 || b == PACKET)
                 printf("   EOF\n");
 #endif
+              if (PRO_SELECT)
+                end_read(tid,nidx);
             }
         }
     }
@@ -1247,12 +1415,89 @@ void Distribute_Block(DATA_BLOCK *block, int tid)
 
 int64 *NUM_RID;   //  [i] for i in [0,NTHREADS) = # of super-mers per vertical stripe
 
+int64 *NUM_READS; //  [i] for i in [0,ITHREADS) = # of reads per vertical stripe (if PRO_SELECT)
+int64  SEL_NUM;   //  # of ranges of super-mer ids of selected reads (if PRO_SELECT)
+int64 *SEL_RANGE; //  [3i,3i+1] = ids [beg,end) of range i, [3i+2] = id of its first read
+
+  //  A random but reproducible choice of a PRO_FRACT fraction of the read ids
+
+static inline int sample_read(int64 id)
+{ uint64 h = id + 0x9e3779b97f4a7c15llu;
+
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9llu;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebllu;
+  h = (h ^ (h >> 31));
+  return ((h >> 11) * 0x1.0p-53 < PRO_FRACT);
+}
+
+  //  Given the span of every read, find the ranges of super-mer ids of the selected reads
+
+static void Select_Reads()
+{ int64  rbase, gbase, rmax, span, *list;
+  int64  nsel;
+  uint8 *buf, *end;
+  int64  tsel;
+  int    t, x, sel;
+
+  rbase = gbase = 0;
+  nsel  = 0;
+  rmax  = 0;
+  list  = PRO_LIST;
+  for (t = 0; t < ITHREADS; t++)
+    { buf  = rspan[t];
+      end  = buf + rslen[t];
+      tsel = nsel;               //  Ranges do not cross threads
+      while (buf < end)
+        { span = 0;
+          for (x = 0; *buf & 0x80; x += 7)
+            span |= ((int64) (*buf++ & 0x7f)) << x;
+          span |= ((int64) *buf++) << x;
+
+          if (PRO_LIST != NULL)
+            { while (list < PRO_LIST+2*PRO_LLEN && list[1] <= gbase)
+                list += 2;
+              sel = (list < PRO_LIST+2*PRO_LLEN && list[0] <= gbase);
+            }
+          else
+            sel = sample_read(gbase);
+
+          if (sel)
+            { if (nsel > tsel && SEL_RANGE[3*nsel-2] == rbase)
+                SEL_RANGE[3*nsel-2] += span;
+              else
+                { if (nsel >= rmax)
+                    { rmax = 1.2*nsel + 1000;
+                      SEL_RANGE = Realloc(SEL_RANGE,3*rmax*sizeof(int64),"Allocating selection");
+                      if (SEL_RANGE == NULL)
+                        exit (1);
+                    }
+                  SEL_RANGE[3*nsel]   = rbase;
+                  SEL_RANGE[3*nsel+1] = rbase + span;
+                  SEL_RANGE[3*nsel+2] = gbase;
+                  nsel += 1;
+                }
+            }
+          rbase += span;
+          gbase += 1;
+        }
+      rbase  = 0;
+      for (x = 0; x <= t; x++)
+        rbase += nfirst[x];
+      NUM_READS[t] = gbase;
+      free(rspan[t]);
+    }
+  for (t = ITHREADS-1; t > 0; t--)
+    NUM_READS[t] -= NUM_READS[t-1];
+  SEL_NUM = nsel;
+}
+
 void Split_Kmers(Input_Partition *io, char *root)
 { int           overflow;
   uint64        nfiles;
   int           nreads;
   int64         totlen;
   int64         nids;
+  int64         masked, dropped;
 
   Min_File     *out;
   IO_UTYPE     *buffers;
@@ -1353,7 +1598,30 @@ void Split_Kmers(Input_Partition *io, char *root)
         totbps[i] = 0;
       }
 
+    if (PRO_SELECT)
+      { rspan = Malloc(sizeof(uint8 *)*ITHREADS,"Allocating read span lists");
+        rslen = Malloc(sizeof(int64)*4*ITHREADS,"Allocating read span lists");
+        NUM_READS = Malloc(sizeof(int64)*ITHREADS,"Allocating read span lists");
+        if (rspan == NULL || rslen == NULL || NUM_READS == NULL)
+          exit (1);
+        rsmax = rslen + ITHREADS;
+        rsbeg = rsmax + ITHREADS;
+        for (i = 0; i < ITHREADS; i++)
+          { rspan[i] = NULL;
+            rslen[i] = rsmax[i] = 0;
+            rsbeg[i] = -1;
+          }
+        SEL_RANGE = NULL;
+      }
+
     Scan_All_Input(io);
+    masked = Masked_Bases(io,&dropped);
+
+    if (PRO_SELECT)
+      { Select_Reads();
+        free(rslen);
+        free(rspan);
+      }
 
     if (short_read)
       { if (VERBOSE)
@@ -1411,6 +1679,16 @@ void Split_Kmers(Input_Partition *io, char *root)
         fprintf(stderr," reads totalling ");
         Print_Number(totlen,0,stderr);
         fprintf(stderr," bps\n");
+        if (QUAL_MIN > 0)
+          { fprintf(stderr,"    after masking ");
+            Print_Number(masked,0,stderr);
+            fprintf(stderr," bases (%.1f%%) of quality < %d\n",
+                           (100.*masked)/(totlen+masked+dropped),QUAL_MIN);
+            fprintf(stderr,"    and dropping ");
+            Print_Number(dropped,0,stderr);
+            fprintf(stderr," bases (%.1f%%) in runs shorter than %d\n",
+                           (100.*dropped)/(totlen+masked+dropped),KMER);
+          }
         kwide = Number_Digits(ktot);
         nwide = Number_Digits(ntot);
         awide = Number_Digits(ktot/ntot);
@@ -1467,8 +1745,12 @@ void Split_Kmers(Input_Partition *io, char *root)
         fprintf(stderr," (%.2f%%)\n",(200.*(KMAX-kmin))/(KMAX+kmin));
       }
 
-    KMAX_BYTES = 0;
-    for (val = KMAX-1; val > 0; val >>= 8)
+    KMAX_BYTES = 0;                  //  If selecting reads then an index of all 1's must
+    if (PRO_SELECT)                  //    not be a valid index of a k-mer (see count.c)
+      val = KMAX;
+    else
+      val = KMAX-1;
+    for ( ; val > 0; val >>= 8)
       KMAX_BYTES += 1;
     if (KMAX_BYTES < 2)  //  CMER_BYTES = KMAX_BYTES+1 must be 3 or more
       KMAX_BYTES = 2;
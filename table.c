@@ -25,6 +25,7 @@
 
 #include "gene_core.h"
 #include "FastK.h"
+#include "libfastk.h"
 
 #undef    DEBUG
 #undef    DEBUG_MERGE
@@ -303,6 +304,151 @@ static void *merge_table_thread(void *arg)
   return (NULL);
 }
 
+  //  Write the search accelerator for the table in the hidden file .root.kidx.  The prefix
+  //    width and prefixes are computed by libfastk's Kmer_Prefix_Width and Kmer_Prefix so
+  //    the file always agrees with its readers: after the k-mer length, the prefix width
+  //    pbits, the # of entries, and the table's signature, index[v] for v in [0,2^pbits]
+  //    is the index of the first entry whose k-mer's leading pbits bits are not less than v.
+  //    Each thread fills the index for the prefixes ending in its part of the table.
+
+#define IDX_ENTRIES  0x10000   //  # of table entries read at a time by an index thread
+
+typedef struct
+  { int     stream;   //  Table part open at its first entry
+    int64   nels;     //  # of entries in the part
+    int64   first;    //  Index of the first entry of the part in the table
+    int64   prev;     //  Prefix of the last entry of all preceding parts (-1 if none)
+    int64  *index;
+    int     pbits;
+  } Index_Arg;
+
+static void *index_thread(void *arg)
+{ Index_Arg *data  = (Index_Arg *) arg;
+  int64     *index = data->index;
+  int        pbits = data->pbits;
+  int64      prev  = data->prev;
+
+  uint8 *buf, *bptr;
+  int64  i, n, val;
+
+  buf = Malloc(IDX_ENTRIES*TMER_WORD,"Allocating index buffer");
+  if (buf == NULL)
+    exit (1);
+
+  for (i = 0; i < data->nels; i += n)
+    { n = data->nels - i;
+      if (n > IDX_ENTRIES)
+        n = IDX_ENTRIES;
+      read(data->stream,buf,n*TMER_WORD);
+      for (bptr = buf; bptr < buf + n*TMER_WORD; bptr += TMER_WORD)
+        { val = Kmer_Prefix(bptr,KMER_BYTES,pbits);
+          while (prev < val)
+            index[++prev] = data->first + (bptr-buf)/TMER_WORD + i;
+        }
+    }
+
+  free(buf);
+  return (NULL);
+}
+
+static void Write_Table_Index(char *path, char *root, char *fname)
+{ THREAD     threads[NTHREADS];
+  Index_Arg  parmi[NTHREADS];
+  int64     *index;
+  int64      nels, top, last;
+  uint64     sig;
+  uint8      entry[TMER_WORD];
+  int        f, t, kmer, pbits;
+
+  if (VERBOSE)
+    { fprintf(stderr,"  Writing search index .%s.kidx\n",root);
+      fflush(stderr);
+    }
+
+  //  Open the parts and find the # of entries in each and the prefix of its last entry
+
+  nels = 0;
+  last = -1;
+  for (t = 0; t < NTHREADS; t++)
+    { sprintf(fname,"%s/.%s.ktab.%d",path,root,t+1);
+      f = open(fname,O_RDONLY);
+      if (f == -1)
+        { fprintf(stderr,"\n%s: Cannot open table part %s\n",Prog_Name,fname);
+          exit (1);
+        }
+      read(f,&kmer,sizeof(int));
+      read(f,&(parmi[t].nels),sizeof(int64));
+      parmi[t].stream = f;
+      parmi[t].first  = nels;
+      nels += parmi[t].nels;
+    }
+
+  pbits = Kmer_Prefix_Width(nels,KMER);
+  top   = (1ll << pbits);
+  index = Malloc(sizeof(int64)*(top+1),"Allocating index");
+  if (index == NULL)
+    exit (1);
+
+  for (t = 0; t < NTHREADS; t++)
+    { parmi[t].prev  = last;
+      parmi[t].index = index;
+      parmi[t].pbits = pbits;
+      if (parmi[t].nels > 0)
+        { pread(parmi[t].stream,entry,TMER_WORD,
+                sizeof(int)+sizeof(int64)+(parmi[t].nels-1)*TMER_WORD);
+          last = Kmer_Prefix(entry,KMER_BYTES,pbits);
+        }
+    }
+
+  //  In parallel fill in the index for the prefixes up to the last of each part
+
+#ifdef DEBUG_MERGE
+  for (t = 0; t < NTHREADS; t++)
+    index_thread(parmi+t);
+#else
+  for (t = 1; t < NTHREADS; t++)
+    pthread_create(threads+t,NULL,index_thread,parmi+t);
+  index_thread(parmi);
+  for (t = 1; t < NTHREADS; t++)
+    pthread_join(threads[t],NULL);
+#endif
+
+  for (t = 0; t < NTHREADS; t++)
+    close(parmi[t].stream);
+
+  while (last < top)
+    index[++last] = nels;
+
+  //  The signature of the table, from a sample of its k-mers, ties the index to it
+
+  { Kmer_Stream *S;
+
+    sprintf(fname,"%s/%s",path,root);
+    S = Open_Kmer_Stream(fname);
+    if (S == NULL)
+      { fprintf(stderr,"\n%s: Cannot open table %s\n",Prog_Name,fname);
+        exit (1);
+      }
+    sig = Kmer_Stream_Signature(S);
+    Free_Kmer_Stream(S);
+  }
+
+  sprintf(fname,"%s/.%s.kidx",path,root);
+  f = open(fname,O_CREAT|O_TRUNC|O_WRONLY,S_IRWXU);
+  if (f == -1)
+    { fprintf(stderr,"\n%s: Cannot open external file %s for writing\n",Prog_Name,fname);
+      exit (1);
+    }
+  write(f,&KMER,sizeof(int));
+  write(f,&pbits,sizeof(int));
+  write(f,&nels,sizeof(int64));
+  write(f,&sig,sizeof(uint64));
+  write(f,index,sizeof(int64)*(top+1));
+  close(f);
+
+  free(index);
+}
+
   //  Top-Level
 
 void Merge_Tables(char *path, char *root)
@@ -430,5 +576,15 @@ void Merge_Tables(char *path, char *root)
   free(blocks);
   free(io);
   free(heap);
+
+  if (DO_INDEX)
+    Write_Table_Index(path,root,fname);
+  else
+    { sprintf(fname,"%s/.%s.kidx",path,root);    //  Remove any stale index of a prior table
+      unlink(fname);
+    }
+  sprintf(fname,"%s/.%s.khsh",path,root);        //  Remove any hash of a prior table
+  unlink(fname);
+
   free(fname);
 }